@@ -0,0 +1,555 @@
+/*
+Micro-benchmarks of the kernels of the Legendre transform phase,
+without building a full plan:
+
+ - bfm_scatter, all group/add variants (generic and nvecs=2)
+ - pack_every_other and wavemoth_legendre_transform_pack
+ - wavemoth_legendre_transform_sse
+ - dgemm_ccc
+
+The first three are swept over nx/nk/nvecs on synthetic data. If a
+resource file is given with -r, the butterfly trees in it are walked
+and the shapes actually occuring (interpolation dgemms and scatters,
+dense residual dgemms, Legendre strips) are tallied; the shapes
+carrying the most flops are then benchmarked as well.
+
+Every kernel is timed cache-hot (repeated calls on the same buffers)
+and cache-cold (a buffer larger than the last level cache is written
+between calls; set its size with -e). Cycles are TSC cycles, i.e.,
+at the nominal clock frequency. "Elements" are doubles moved for
+scatter/pack, and matrix elements for dgemm and Legendre (so that the
+numbers are comparable with the Legendre flop counts elsewhere, which
+count 2 * nvecs flops per matrix element).
+
+Usage:
+
+    kernelbench [-r resourcefile] [-k nmaps] [-s m_stride] [-t ntop] [-e evict_MB]
+*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <malloc.h>
+#include <math.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <x86intrin.h>
+
+#include "wavemoth.h"
+#include "wavemoth_private.h"
+#include "wavemoth_error.h"
+#include "legendre_transform.h"
+#include "butterfly_utils.h"
+#include "blas.h"
+#include "benchutils.h"
+
+#define NTRIALS 5
+
+static double tsc_hz;
+static size_t evict_size = 128UL * 1024 * 1024;
+static char *evict_buf;
+
+static double calibrate_tsc(void) {
+  double t0 = walltime();
+  uint64_t c0 = __rdtsc();
+  while (walltime() - t0 < 0.1);
+  uint64_t c1 = __rdtsc();
+  return (c1 - c0) / (walltime() - t0);
+}
+
+static void evict_caches(void) {
+  for (size_t i = 0; i < evict_size; i += 64) {
+    evict_buf[i]++;
+  }
+}
+
+/*
+Timing
+*/
+
+typedef void (*kernel_func_t)(void *ctx);
+
+typedef struct {
+  double hot, cold; /* cycles per call */
+} timing_t;
+
+static timing_t time_kernel(kernel_func_t func, void *ctx) {
+  timing_t r = { 1e300, 1e300 };
+  size_t reps = 1;
+  uint64_t c0, dc;
+  func(ctx);
+  /* Grow batch until it is long enough that rdtsc overhead vanishes */
+  while (1) {
+    c0 = __rdtsc();
+    for (size_t i = 0; i != reps; ++i) func(ctx);
+    dc = __rdtsc() - c0;
+    if (dc > 1000000 || reps >= (1 << 20)) break;
+    reps *= 2;
+  }
+  for (int trial = 0; trial != NTRIALS; ++trial) {
+    c0 = __rdtsc();
+    for (size_t i = 0; i != reps; ++i) func(ctx);
+    dc = __rdtsc() - c0;
+    r.hot = fmin(r.hot, (double)dc / reps);
+  }
+  for (int trial = 0; trial != NTRIALS; ++trial) {
+    evict_caches();
+    _mm_mfence();
+    c0 = __rdtsc();
+    func(ctx);
+    dc = __rdtsc() - c0;
+    r.cold = fmin(r.cold, (double)dc);
+  }
+  return r;
+}
+
+static void print_header(void) {
+  printf("%-9s %-26s %6s %6s %6s  %9s %9s  %8s %8s  %9s\n",
+         "kernel", "variant", "a", "b", "nvecs", "cyc/el", "cyc/el", "GFLOP/s", "GFLOP/s",
+         "count");
+  printf("%-9s %-26s %6s %6s %6s  %9s %9s  %8s %8s  %9s\n",
+         "", "", "", "", "", "hot", "cold", "hot", "cold", "");
+}
+
+static void report(char *kernel, char *variant, size_t a, size_t b, size_t nvecs,
+                   double elements, double flops, size_t count, timing_t t) {
+  printf("%-9s %-26s %6zu %6zu %6zu  %9.3f %9.3f  ", kernel, variant, a, b, nvecs,
+         t.hot / elements, t.cold / elements);
+  if (flops > 0) {
+    printf("%8.3f %8.3f  ", flops / (t.hot / tsc_hz) / 1e9, flops / (t.cold / tsc_hz) / 1e9);
+  } else {
+    printf("%8s %8s  ", "-", "-");
+  }
+  if (count > 0) {
+    printf("%9zu\n", count);
+  } else {
+    printf("%9s\n", "-");
+  }
+}
+
+/*
+Kernels
+*/
+
+typedef const char *(*scatter_func_t)(const char *restrict mask, double *restrict target1,
+                                      double *restrict target2,
+                                      const double *restrict source,
+                                      size_t len1, size_t len2, size_t nvecs);
+typedef const char *(*scatter2_func_t)(const char *restrict mask, double *restrict target1,
+                                       double *restrict target2,
+                                       const double *restrict source,
+                                       size_t len1, size_t len2);
+
+typedef struct {
+  void *func;
+  int fixed_nvecs;
+  char *mask;
+  double *target1, *target2, *source;
+  size_t len1, len2, nvecs;
+} scatter_ctx_t;
+
+static void run_scatter(void *ctx_) {
+  scatter_ctx_t *ctx = ctx_;
+  if (ctx->fixed_nvecs) {
+    ((scatter2_func_t)ctx->func)(ctx->mask, ctx->target1, ctx->target2, ctx->source,
+                                 ctx->len1, ctx->len2);
+  } else {
+    ((scatter_func_t)ctx->func)(ctx->mask, ctx->target1, ctx->target2, ctx->source,
+                                ctx->len1, ctx->len2, ctx->nvecs);
+  }
+}
+
+/* Both scatters of an interpolation block, as done in transpose_apply_interpolation_block */
+static void run_scatter_pair(void *ctx_) {
+  scatter_ctx_t *ctx = ctx_;
+  size_t n = ctx->len1 + ctx->len2;
+  bfm_scatter(ctx->mask, ctx->target1, ctx->target2, ctx->source,
+              ctx->len1, ctx->len2, ctx->nvecs, 0, 0);
+  bfm_scatter(ctx->mask, ctx->target1, ctx->target2, ctx->source + n * ctx->nvecs,
+              ctx->len1, ctx->len2, ctx->nvecs, 1, 0);
+}
+
+typedef struct {
+  size_t nk, nvecs;
+  double *input, *output;
+} pack_ctx_t;
+
+static void run_pack_every_other(void *ctx_) {
+  pack_ctx_t *ctx = ctx_;
+  pack_every_other(ctx->nk, ctx->nvecs, ctx->input, ctx->output);
+}
+
+static void run_legendre_transform_pack(void *ctx_) {
+  pack_ctx_t *ctx = ctx_;
+  wavemoth_legendre_transform_pack(ctx->nk, ctx->nvecs, ctx->input, ctx->output);
+}
+
+typedef struct {
+  size_t nx, nk, nvecs;
+  double *a, *y, *x_squared, *auxdata, *P, *Pp1;
+  char *work;
+} legendre_ctx_t;
+
+static void run_legendre(void *ctx_) {
+  legendre_ctx_t *ctx = ctx_;
+  wavemoth_legendre_transform_sse(ctx->nx, ctx->nk, ctx->nvecs, ctx->a, ctx->y,
+                                  ctx->x_squared, ctx->auxdata, ctx->P, ctx->Pp1, ctx->work);
+}
+
+typedef struct {
+  size_t m, n, k;
+  double *A, *B, *C;
+} dgemm_ctx_t;
+
+static void run_dgemm(void *ctx_) {
+  dgemm_ctx_t *ctx = ctx_;
+  dgemm_ccc(ctx->A, ctx->B, ctx->C, ctx->m, ctx->n, ctx->k, 0.0);
+}
+
+/*
+Benchmarks for a single configuration
+*/
+
+static char *random_mask(size_t n, size_t nzeros) {
+  /* nzeros entries with value 0, the rest 1, randomly permuted */
+  char *mask = malloc(n);
+  for (size_t i = 0; i != n; ++i) mask[i] = (i < nzeros) ? 0 : 1;
+  for (size_t i = n - 1; i > 0; --i) {
+    size_t j = rand() % (i + 1);
+    char tmp = mask[i];
+    mask[i] = mask[j];
+    mask[j] = tmp;
+  }
+  return mask;
+}
+
+static void bench_scatter_variants(size_t len, size_t nvecs) {
+  static const struct {
+    char *name;
+    void *func, *func2;
+    int group, should_add;
+  } variants[] = {
+    { "group0_noadd", &bfm_scatter_group0_noadd, &bfm_scatter_group0_noadd_2, 0, 0 },
+    { "group0_add", &bfm_scatter_group0_add, &bfm_scatter_group0_add_2, 0, 1 },
+    { "group1_noadd", &bfm_scatter_group1_noadd, &bfm_scatter_group1_noadd_2, 1, 0 },
+    { "group1_add", &bfm_scatter_group1_add, &bfm_scatter_group1_add_2, 1, 1 },
+  };
+  size_t len1 = len / 2, len2 = len - len / 2;
+  char *mask = random_mask(len, len / 2);
+  double *target1 = zeros(len1 * nvecs), *target2 = zeros(len2 * nvecs);
+  double *source = gauss_array(len * nvecs);
+  for (int v = 0; v != 4; ++v) {
+    for (int fixed = 0; fixed != 2; ++fixed) {
+      if (fixed && nvecs != 2) continue;
+      char name[64];
+      scatter_ctx_t ctx = { fixed ? variants[v].func2 : variants[v].func, fixed, mask,
+                            target1, target2, source, len1, len2, nvecs };
+      snprintf(name, sizeof(name), "%s%s", variants[v].name, fixed ? "_2" : "");
+      /* Half the mask entries are in the group */
+      double elements = (len / 2) * nvecs;
+      double flops = variants[v].should_add ? elements : 0;
+      report("scatter", name, len1, len2, nvecs, elements, flops, 0,
+             time_kernel(&run_scatter, &ctx));
+    }
+  }
+  free(mask);
+  free(target1);
+  free(target2);
+  free(source);
+}
+
+static void bench_pack(size_t nk, size_t nvecs) {
+  pack_ctx_t ctx = { nk, nvecs, gauss_array(2 * nk * nvecs), zeros(nk * nvecs) };
+  report("pack", "pack_every_other", nk, 0, nvecs, nk * nvecs, 0, 0,
+         time_kernel(&run_pack_every_other, &ctx));
+  report("pack", "legendre_transform_pack", nk, 0, nvecs, nk * nvecs, 0, 0,
+         time_kernel(&run_legendre_transform_pack, &ctx));
+  free(ctx.input);
+  free(ctx.output);
+}
+
+static void bench_legendre(size_t nx, size_t nk, size_t nvecs, size_t count) {
+  legendre_ctx_t ctx;
+  ctx.nx = nx;
+  ctx.nk = nk;
+  ctx.nvecs = nvecs;
+  ctx.a = gauss_array(nk * nvecs);
+  ctx.y = zeros(nx * nvecs);
+  ctx.x_squared = zeros(nx);
+  ctx.P = zeros(nx);
+  ctx.Pp1 = zeros(nx);
+  ctx.auxdata = zeros(3 * (nk - 2));
+  ctx.work = memalign(16, wavemoth_legendre_transform_sse_query_work(nvecs) + 16);
+  for (size_t i = 0; i != nx; ++i) {
+    double x = (i + 0.5) / nx;
+    ctx.x_squared[i] = x * x;
+    ctx.P[i] = 1e-2;
+    ctx.Pp1[i] = 1e-2 * x;
+  }
+  wavemoth_legendre_transform_auxdata(0, 0, nk, ctx.auxdata);
+  report("legendre", "sse", nx, nk, nvecs, nx * nk, 2.0 * nvecs * nx * nk, count,
+         time_kernel(&run_legendre, &ctx));
+  free(ctx.a);
+  free(ctx.y);
+  free(ctx.x_squared);
+  free(ctx.P);
+  free(ctx.Pp1);
+  free(ctx.auxdata);
+  free(ctx.work);
+}
+
+static void bench_dgemm(char *variant, size_t n, size_t k, size_t nvecs, size_t count) {
+  dgemm_ctx_t ctx = { nvecs, n, k, gauss_array(nvecs * k), gauss_array(k * n),
+                      zeros(nvecs * n) };
+  report("dgemm", variant, n, k, nvecs, (n * k > 0) ? n * k : 1, 2.0 * nvecs * n * k,
+         count, time_kernel(&run_dgemm, &ctx));
+  free(ctx.A);
+  free(ctx.B);
+  free(ctx.C);
+}
+
+static void bench_scatter_pair(size_t n, size_t k, size_t nvecs, size_t count) {
+  /* Real interpolation block shape; n entries of which k are skeleton (group 0) */
+  size_t len1 = n / 2, len2 = n - n / 2;
+  char *mask = random_mask(n, k);
+  double *target1 = zeros(len1 * nvecs), *target2 = zeros(len2 * nvecs);
+  double *source = gauss_array(2 * n * nvecs);
+  scatter_ctx_t ctx = { NULL, 0, mask, target1, target2, source, len1, len2, nvecs };
+  report("scatter", "interpolation_block", n, k, nvecs, n * nvecs, 0, count,
+         time_kernel(&run_scatter_pair, &ctx));
+  free(mask);
+  free(target1);
+  free(target2);
+  free(source);
+}
+
+/*
+Shapes from resource file
+*/
+
+#define SHAPE_INTERPOLATION 0 /* a=n, b=k */
+#define SHAPE_RESIDUAL 1      /* a=ncols, b=nk */
+#define SHAPE_LEGENDRE 2      /* a=nx, b=nk */
+
+typedef struct {
+  int kind;
+  size_t a, b, count;
+} shape_t;
+
+typedef struct {
+  shape_t *shapes;
+  size_t n, capacity;
+} shape_list_t;
+
+static void add_shape(shape_list_t *lst, int kind, size_t a, size_t b) {
+  if (lst->n == lst->capacity) {
+    lst->capacity = (lst->capacity == 0) ? 1024 : 2 * lst->capacity;
+    lst->shapes = realloc(lst->shapes, sizeof(shape_t[lst->capacity]));
+    check(lst->shapes != NULL, "Out of memory");
+  }
+  lst->shapes[lst->n++] = (shape_t){ kind, a, b, 1 };
+}
+
+static void walk_residual(shape_list_t *lst, char *payload, size_t ncols) {
+  skip128(&payload);
+  size_t row_start = read_int64(&payload);
+  size_t row_stop = read_int64(&payload);
+  size_t nk = row_stop - row_start;
+  if (nk <= 4 || ncols == 0) {
+    add_shape(lst, SHAPE_RESIDUAL, ncols, nk);
+    return;
+  }
+  size_t nstrips = read_int64(&payload);
+  if (read_int64(&payload) < 0) {
+    /* List of rings */
+    skip128(&payload);
+    payload += sizeof(int32_t[ncols]);
+  }
+  size_t cstart = 0;
+  for (size_t i = 0; i != nstrips; ++i) {
+    size_t rstart = read_int64(&payload);
+    size_t cstop = read_int64(&payload);
+    size_t nx_strip = cstop - cstart, nk_strip = nk - rstart;
+    if (nk_strip <= 4) {
+      add_shape(lst, SHAPE_RESIDUAL, nx_strip, nk_strip);
+      read_aligned_array_d(&payload, nk_strip * nx_strip);
+    } else {
+      add_shape(lst, SHAPE_LEGENDRE, nx_strip, nk_strip);
+      read_aligned_array_d(&payload, nx_strip);
+      /* P1 is only stored for strips not starting at the first row */
+      if (row_start + rstart != 0) read_aligned_array_d(&payload, nx_strip);
+    }
+    cstart = cstop;
+  }
+}
+
+/* Mirrors transpose_apply_node in butterfly.c.in */
+static void walk_node(shape_list_t *lst, char **node_heap, size_t inode, char **payloads) {
+  char *node_data = node_heap[inode];
+  size_t nblocks = read_index(&node_data);
+  if (nblocks == 0) {
+    size_t n = read_index(&node_data);
+    if (payloads != NULL) walk_residual(lst, payloads[0], n);
+    return;
+  }
+  bfm_index_t *block_heights = (bfm_index_t*)node_data;
+  node_data += sizeof(bfm_index_t[nblocks]);
+  char *left_child_data = node_heap[2 * inode];
+  char *right_child_data = node_heap[2 * inode + 1];
+  read_index(&left_child_data);
+  read_index(&right_child_data);
+  bfm_index_t *left_heights = (bfm_index_t*)left_child_data;
+  bfm_index_t *right_heights = (bfm_index_t*)right_child_data;
+  for (size_t i = 0; i != nblocks / 2; ++i) {
+    for (int j = 0; j != 2; ++j) {
+      size_t k = block_heights[2 * i + j];
+      size_t n = left_heights[i] + right_heights[i];
+      if (payloads != NULL) walk_residual(lst, payloads[2 * i + j], k);
+      add_shape(lst, SHAPE_INTERPOLATION, n, k);
+      node_data += sizeof(char[n]);
+      node_data = skip_padding(node_data);
+      node_data += sizeof(double[(n - k) * k]);
+    }
+  }
+  walk_node(lst, node_heap, 2 * inode, NULL);
+  walk_node(lst, node_heap, 2 * inode + 1, NULL);
+}
+
+static void walk_matrix(shape_list_t *lst, char *record) {
+  bfm_matrix_data_info info;
+  double *auxdata;
+  char *matrix_data = wavemoth_matrix_bfm_data(record, &auxdata);
+  char *head = bfm_query_matrix_data(matrix_data, &info);
+  char *residual_payload_headers[info.first_level_size];
+  char *heap_buf[info.heap_size];
+  read_pointer_list(&head, residual_payload_headers, info.first_level_size, matrix_data);
+  read_pointer_list(&head, heap_buf, info.heap_size, matrix_data);
+  char **node_heap = heap_buf - info.heap_first_index;
+  for (size_t iroot = 0; iroot != info.first_level_size; ++iroot) {
+    char *payload_head = residual_payload_headers[iroot];
+    size_t n = read_int64(&payload_head);
+    char *payloads[n + 1];
+    read_pointer_list(&payload_head, payloads, n + 1, matrix_data);
+    walk_node(lst, node_heap, info.heap_first_index + iroot, payloads);
+  }
+}
+
+static int compare_shape(const void *x_, const void *y_) {
+  const shape_t *x = x_, *y = y_;
+  if (x->kind != y->kind) return x->kind - y->kind;
+  if (x->a != y->a) return (x->a < y->a) ? -1 : 1;
+  if (x->b != y->b) return (x->b < y->b) ? -1 : 1;
+  return 0;
+}
+
+static double shape_flops(shape_t *s) {
+  /* per vector; interpolation blocks multiply (n - k) x k */
+  double ab = (s->kind == SHAPE_INTERPOLATION) ? (double)(s->a - s->b) * s->b : (double)s->a * s->b;
+  return ab * s->count;
+}
+
+static int compare_shape_flops(const void *x_, const void *y_) {
+  double x = shape_flops((shape_t*)x_), y = shape_flops((shape_t*)y_);
+  return (x > y) ? -1 : (x < y);
+}
+
+static void bench_resource_shapes(char *filename, size_t nvecs, int m_stride, int ntop) {
+  precomputation_t data;
+  shape_list_t lst = { NULL, 0, 0 };
+  int Nside;
+  checkf(wavemoth_mmap_resources(filename, &data, &Nside) == 0, "Could not load %s", filename);
+  for (int m = 0; m <= data.mmax; m += m_stride) {
+    for (int odd = 0; odd != 2; ++odd) {
+      if (data.matrices[m].data[odd] != NULL) walk_matrix(&lst, data.matrices[m].data[odd]);
+    }
+  }
+  printf("\n%zu kernel calls found in %s (Nside=%d, lmax=%d, every %d. m)\n",
+         lst.n, filename, Nside, data.lmax, m_stride);
+
+  /* Tally equal shapes, then sort each kind by flops carried */
+  qsort(lst.shapes, lst.n, sizeof(shape_t), &compare_shape);
+  size_t ndistinct = 0;
+  for (size_t i = 0; i != lst.n; ++i) {
+    if (ndistinct > 0 && compare_shape(&lst.shapes[ndistinct - 1], &lst.shapes[i]) == 0) {
+      lst.shapes[ndistinct - 1].count++;
+    } else {
+      lst.shapes[ndistinct++] = lst.shapes[i];
+    }
+  }
+  for (int kind = 0; kind != 3; ++kind) {
+    size_t start = 0, stop;
+    while (start != ndistinct && lst.shapes[start].kind != kind) ++start;
+    stop = start;
+    while (stop != ndistinct && lst.shapes[stop].kind == kind) ++stop;
+    qsort(lst.shapes + start, stop - start, sizeof(shape_t), &compare_shape_flops);
+    for (size_t i = start; i != stop && i - start != (size_t)ntop; ++i) {
+      shape_t *s = &lst.shapes[i];
+      switch (kind) {
+      case SHAPE_INTERPOLATION:
+        bench_dgemm("interpolation", s->a - s->b, s->b, nvecs, s->count);
+        bench_scatter_pair(s->a, s->b, nvecs, s->count);
+        break;
+      case SHAPE_RESIDUAL:
+        bench_dgemm("residual", s->a, s->b, nvecs, s->count);
+        break;
+      case SHAPE_LEGENDRE:
+        bench_legendre(s->a, s->b, nvecs, s->count);
+        break;
+      }
+    }
+  }
+  free(lst.shapes);
+  munmap(data.mmapped_buffer, data.mmap_len);
+  free(data.matrices);
+}
+
+int main(int argc, char *argv[]) {
+  static const size_t nvecs_list[] = { 2, 4, 8, 20 };
+  static const size_t len_list[] = { 16, 64, 256, 1024 };
+  static const size_t nx_list[] = { 16, 64, 256 };
+  static const size_t nk_list[] = { 8, 64, 512 };
+  char *resourcefile = NULL;
+  int nmaps = 1, m_stride = 16, ntop = 10, c;
+
+  while ((c = getopt(argc, argv, "r:k:s:t:e:")) != -1) {
+    switch (c) {
+    case 'r': resourcefile = optarg; break;
+    case 'k': nmaps = atoi(optarg); break;
+    case 's': m_stride = atoi(optarg); break;
+    case 't': ntop = atoi(optarg); break;
+    case 'e': evict_size = (size_t)atoi(optarg) * 1024 * 1024; break;
+    }
+  }
+  check(m_stride > 0, "Invalid -s");
+
+  evict_buf = malloc(evict_size);
+  memset(evict_buf, 0, evict_size);
+  tsc_hz = calibrate_tsc();
+  printf("TSC: %.3f GHz, evicting %zu MB between cold calls\n\n", tsc_hz / 1e9,
+         evict_size / (1024 * 1024));
+  print_header();
+
+  for (size_t iv = 0; iv != sizeof(nvecs_list) / sizeof(size_t); ++iv) {
+    size_t nvecs = nvecs_list[iv];
+    for (size_t i = 0; i != sizeof(len_list) / sizeof(size_t); ++i) {
+      bench_scatter_variants(len_list[i], nvecs);
+    }
+    for (size_t i = 0; i != sizeof(len_list) / sizeof(size_t); ++i) {
+      bench_pack(len_list[i], nvecs);
+    }
+    for (size_t i = 0; i != sizeof(nx_list) / sizeof(size_t); ++i) {
+      for (size_t j = 0; j != sizeof(nk_list) / sizeof(size_t); ++j) {
+        bench_legendre(nx_list[i], nk_list[j], nvecs, 0);
+      }
+    }
+  }
+
+  if (resourcefile != NULL) {
+    bench_resource_shapes(resourcefile, 2 * nmaps, m_stride, ntop);
+  }
+
+  free(evict_buf);
+  return 0;
+}
@@ -0,0 +1,220 @@
+/*
+Per-thread hardware performance counters through perf_event_open.
+
+One counter group is opened per thread, led by the cycle counter, so
+that all events of a thread are scheduled onto the PMU together and
+ratios between them are meaningful even when the kernel has to
+multiplex. Values are scaled by time_enabled / time_running.
+
+Only the generic hardware events are opened by default; model
+specific events (FP_ARITH_INST_RETIRED, uncore/offcore DRAM events
+etc.) can be added as raw events, see perf_counters_parse_spec.
+*/
+
+#ifndef _PERFCOUNTERS_H_
+#define _PERFCOUNTERS_H_
+
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <sys/ioctl.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <math.h>
+#include <errno.h>
+
+#define PERF_MAX_EVENTS 16
+#define PERF_NAMELEN 32
+
+typedef struct {
+  char name[PERF_NAMELEN];
+  uint32_t type;
+  uint64_t config;
+  /* Multiplier applied to the count; e.g., 2 for an event counting
+     packed double SSE instructions when one wants flops. */
+  double scale;
+} perf_event_spec_t;
+
+typedef struct {
+  int nevents, nthreads;
+  perf_event_spec_t events[PERF_MAX_EVENTS];
+  int *fds;      /* [nthreads][nevents], -1 if the event could not be opened */
+  uint64_t *ids; /* [nthreads][nevents], kernel ids used to demultiplex group reads */
+} perf_counters_t;
+
+static void perf_counters_add_event(perf_counters_t *pc, char *name, uint32_t type,
+                                    uint64_t config, double scale) {
+  if (pc->nevents == PERF_MAX_EVENTS) {
+    fprintf(stderr, "Too many perf events, ignoring %s\n", name);
+    return;
+  }
+  perf_event_spec_t *e = &pc->events[pc->nevents++];
+  strncpy(e->name, name, PERF_NAMELEN);
+  e->name[PERF_NAMELEN - 1] = '\0';
+  e->type = type;
+  e->config = config;
+  e->scale = scale;
+}
+
+static void perf_counters_init(perf_counters_t *pc) {
+  memset(pc, 0, sizeof(perf_counters_t));
+  /* cycles must come first, it is the group leader */
+  perf_counters_add_event(pc, "cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES, 1);
+  perf_counters_add_event(pc, "instructions", PERF_TYPE_HARDWARE,
+                          PERF_COUNT_HW_INSTRUCTIONS, 1);
+  perf_counters_add_event(pc, "llc-refs", PERF_TYPE_HARDWARE,
+                          PERF_COUNT_HW_CACHE_REFERENCES, 1);
+  perf_counters_add_event(pc, "llc-misses", PERF_TYPE_HARDWARE,
+                          PERF_COUNT_HW_CACHE_MISSES, 1);
+}
+
+/*
+Parse a comma-separated list of raw events, "name=config[*scale],...",
+e.g. "fp=0x4c7*2,dram=0x1b7*64". The config is the raw PMU encoding
+(umask << 8 | event) as listed in the vendor manuals. By convention,
+events whose name starts with "fp" count floating point operations
+and events whose name starts with "dram" count bytes moved to/from
+memory; shbench uses this to compute rates.
+*/
+static int perf_counters_parse_spec(perf_counters_t *pc, char *spec) {
+  char buf[1024];
+  char *tok, *saveptr;
+  strncpy(buf, spec, sizeof(buf));
+  buf[sizeof(buf) - 1] = '\0';
+  for (tok = strtok_r(buf, ",", &saveptr); tok != NULL; tok = strtok_r(NULL, ",", &saveptr)) {
+    char *eq = strchr(tok, '=');
+    char *star;
+    double scale = 1;
+    if (eq == NULL) {
+      fprintf(stderr, "Invalid perf event spec (expected name=config): %s\n", tok);
+      return -1;
+    }
+    *eq = '\0';
+    star = strchr(eq + 1, '*');
+    if (star != NULL) {
+      *star = '\0';
+      scale = atof(star + 1);
+    }
+    perf_counters_add_event(pc, tok, PERF_TYPE_RAW, strtoull(eq + 1, NULL, 0), scale);
+  }
+  return 0;
+}
+
+static int perf_event_open(struct perf_event_attr *attr, pid_t pid, int cpu,
+                           int group_fd, unsigned long flags) {
+  return syscall(__NR_perf_event_open, attr, pid, cpu, group_fd, flags);
+}
+
+/*
+Attach counters to the given threads (which must belong to this
+process). Returns the number of events that could be opened on at
+least one thread; 0 means that perf is unavailable (see
+/proc/sys/kernel/perf_event_paranoid).
+*/
+static int perf_counters_attach(perf_counters_t *pc, pid_t *tids, int nthreads) {
+  int nopened = 0;
+  pc->nthreads = nthreads;
+  pc->fds = malloc(sizeof(int[nthreads * PERF_MAX_EVENTS]));
+  pc->ids = malloc(sizeof(uint64_t[nthreads * PERF_MAX_EVENTS]));
+  for (int e = 0; e != pc->nevents; ++e) {
+    int any = 0;
+    for (int t = 0; t != nthreads; ++t) {
+      int *fds = pc->fds + t * PERF_MAX_EVENTS;
+      struct perf_event_attr attr;
+      memset(&attr, 0, sizeof(attr));
+      attr.size = sizeof(attr);
+      attr.type = pc->events[e].type;
+      attr.config = pc->events[e].config;
+      attr.exclude_kernel = 1;
+      attr.exclude_hv = 1;
+      attr.read_format = (PERF_FORMAT_GROUP | PERF_FORMAT_ID |
+                          PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING);
+      if (e == 0) {
+        attr.disabled = 1;
+        fds[e] = perf_event_open(&attr, tids[t], -1, -1, 0);
+      } else {
+        fds[e] = (fds[0] == -1) ? -1 : perf_event_open(&attr, tids[t], -1, fds[0], 0);
+      }
+      if (fds[e] != -1) {
+        ioctl(fds[e], PERF_EVENT_IOC_ID, &pc->ids[t * PERF_MAX_EVENTS + e]);
+        any = 1;
+      }
+    }
+    if (any) {
+      nopened++;
+    } else {
+      fprintf(stderr, "perf: could not open event %s (%s)\n", pc->events[e].name,
+              strerror(errno));
+    }
+  }
+  if (nopened > 0) {
+    for (int t = 0; t != nthreads; ++t) {
+      int fd = pc->fds[t * PERF_MAX_EVENTS];
+      if (fd != -1) {
+        ioctl(fd, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+        ioctl(fd, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+      }
+    }
+  }
+  return nopened;
+}
+
+/*
+Read all counters, scaled for multiplexing, and summed over
+threads. out has length pc->nevents; NaN for unavailable events.
+*/
+static void perf_counters_read(perf_counters_t *pc, double *out) {
+  uint64_t buf[3 + 2 * PERF_MAX_EVENTS];
+  int available[PERF_MAX_EVENTS];
+  memset(available, 0, sizeof(available));
+  for (int e = 0; e != pc->nevents; ++e) {
+    out[e] = 0;
+  }
+  for (int t = 0; t != pc->nthreads; ++t) {
+    int *fds = pc->fds + t * PERF_MAX_EVENTS;
+    uint64_t *ids = pc->ids + t * PERF_MAX_EVENTS;
+    if (fds[0] == -1) continue;
+    if (read(fds[0], buf, sizeof(buf)) < (ssize_t)sizeof(uint64_t[3])) continue;
+    uint64_t nr = buf[0], enabled = buf[1], running = buf[2];
+    double scale = (running == 0) ? 0.0 : (double)enabled / running;
+    for (uint64_t i = 0; i != nr; ++i) {
+      uint64_t value = buf[3 + 2 * i], id = buf[3 + 2 * i + 1];
+      for (int e = 0; e != pc->nevents; ++e) {
+        if (fds[e] != -1 && ids[e] == id) {
+          out[e] += value * scale * pc->events[e].scale;
+          available[e] = 1;
+        }
+      }
+    }
+  }
+  for (int e = 0; e != pc->nevents; ++e) {
+    if (!available[e]) out[e] = NAN;
+  }
+}
+
+static int perf_counters_find(perf_counters_t *pc, char *name) {
+  for (int e = 0; e != pc->nevents; ++e) {
+    if (strcmp(pc->events[e].name, name) == 0) return e;
+  }
+  return -1;
+}
+
+static void perf_counters_close(perf_counters_t *pc) {
+  for (int t = 0; t != pc->nthreads; ++t) {
+    /* Close members before the leader */
+    for (int e = pc->nevents - 1; e >= 0; --e) {
+      int fd = pc->fds[t * PERF_MAX_EVENTS + e];
+      if (fd != -1) close(fd);
+    }
+  }
+  free(pc->fds);
+  free(pc->ids);
+  pc->fds = NULL;
+  pc->ids = NULL;
+  pc->nthreads = 0;
+}
+
+#endif
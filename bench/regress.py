@@ -0,0 +1,275 @@
+#!/usr/bin/env python
+from __future__ import division
+
+#
+# Benchmark regression harness. Runs shbench over a matrix of
+# configurations, records median/min/stddev of each phase together
+# with host metadata as JSON, and optionally compares with a stored
+# baseline (a previous output of this script).
+#
+# The configuration is a JSON file like
+#
+#   {
+#     "shbench": "build/shbench",
+#     "resources": "/data/wavemoth/{Nside}.dat",
+#     "iterations": 20,
+#     "matrix": {
+#       "Nside": [512, 1024],
+#       "nmaps": [1, 10],
+#       "threads": [1, 16],
+#       "flags": [["MEASURE"], ["MEASURE", "NO_RESOURCE_COPY"]]
+#     }
+#   }
+#
+# A regression is flagged when the phase is slower than the baseline
+# by more than --threshold (relative, on the median) *and* a one-sided
+# Mann-Whitney U test on the raw samples rejects "not slower" at
+# level --alpha. Exit status is 1 if any regression was flagged.
+#
+
+import sys
+import os
+import json
+import math
+import socket
+import platform
+import tempfile
+import itertools
+import subprocess
+from time import strftime
+from optparse import OptionParser
+
+PHASES = ['total', 'legendre', 'fft']
+
+# Flag names -> shbench switches. MEASURE is shbench's default.
+FLAG_SWITCHES = {
+    'MEASURE' : [],
+    'ESTIMATE' : ['-E'],
+    'NO_RESOURCE_COPY' : ['-C'],
+    'COSCHEDULE' : ['-B'],
+    'SMT' : ['-H'],
+    'HUGEPAGES' : ['-G'],
+    'SHARED_RESOURCES' : ['-R'],
+    'REPLICATE_INPUT' : ['-I'],
+    'PLACED_ARRAYS' : ['-A'],
+    'NO_FFT' : ['-F'],
+    }
+
+#
+# Statistics
+#
+
+def median(x):
+    x = sorted(x)
+    n = len(x)
+    if n % 2 == 1:
+        return x[n // 2]
+    else:
+        return 0.5 * (x[n // 2 - 1] + x[n // 2])
+
+def stddev(x):
+    if len(x) < 2:
+        return 0.0
+    mu = sum(x) / len(x)
+    return math.sqrt(sum((v - mu)**2 for v in x) / (len(x) - 1))
+
+def summarize(x):
+    return dict(median=median(x), min=min(x), max=max(x), stddev=stddev(x), n=len(x))
+
+def mann_whitney_greater(x, y):
+    """
+    One-sided p-value for the hypothesis that samples x tend to be
+    larger than samples y, using the normal approximation with tie
+    correction. Timing samples are rarely normal (long right tail),
+    hence a rank test rather than a t-test.
+    """
+    n1, n2 = len(x), len(y)
+    if n1 == 0 or n2 == 0:
+        return 1.0
+    combined = sorted([(v, 0) for v in x] + [(v, 1) for v in y])
+    ranks = [0.0] * len(combined)
+    tie_term = 0.0
+    i = 0
+    while i < len(combined):
+        j = i
+        while j + 1 < len(combined) and combined[j + 1][0] == combined[i][0]:
+            j += 1
+        for k in range(i, j + 1):
+            ranks[k] = 0.5 * (i + j) + 1
+        t = j - i + 1
+        tie_term += t**3 - t
+        i = j + 1
+    R1 = sum(r for r, (v, group) in zip(ranks, combined) if group == 0)
+    U1 = R1 - n1 * (n1 + 1) / 2
+    N = n1 + n2
+    sigma2 = n1 * n2 / 12 * ((N + 1) - tie_term / (N * (N - 1)))
+    if sigma2 <= 0:
+        return 1.0
+    z = (U1 - n1 * n2 / 2 - 0.5) / math.sqrt(sigma2)
+    return 0.5 * math.erfc(z / math.sqrt(2))
+
+#
+# Host metadata
+#
+
+def read_first(filename, default=None):
+    try:
+        with open(filename) as f:
+            return f.read().strip()
+    except IOError:
+        return default
+
+def cpu_model():
+    cpuinfo = read_first('/proc/cpuinfo', '')
+    for line in cpuinfo.splitlines():
+        if line.startswith('model name'):
+            return line.split(':', 1)[1].strip()
+    return platform.processor()
+
+def numa_nodes():
+    try:
+        return len([x for x in os.listdir('/sys/devices/system/node')
+                    if x.startswith('node') and x[4:].isdigit()])
+    except OSError:
+        return 1
+
+def git_revision():
+    try:
+        return subprocess.check_output(['git', 'rev-parse', 'HEAD'],
+                                       cwd=os.path.dirname(os.path.abspath(__file__))).strip()
+    except (OSError, subprocess.CalledProcessError):
+        return None
+
+def host_metadata():
+    uname = platform.uname()
+    return dict(
+        hostname=socket.gethostname(),
+        kernel='%s %s' % (uname[0], uname[2]),
+        machine=uname[4],
+        cpu_model=cpu_model(),
+        ncpus=os.sysconf('SC_NPROCESSORS_ONLN'),
+        numa_nodes=numa_nodes(),
+        governor=read_first('/sys/devices/system/cpu/cpu0/cpufreq/scaling_governor'),
+        git_revision=git_revision(),
+        date=strftime('%Y-%m-%d %H:%M:%S'),
+        )
+
+#
+# Running
+#
+
+def config_key(cfg):
+    return 'Nside=%d nmaps=%d threads=%d flags=%s' % (
+        cfg['Nside'], cfg['nmaps'], cfg['threads'], '|'.join(sorted(cfg['flags'])))
+
+def expand_matrix(matrix):
+    for Nside, nmaps, threads, flags in itertools.product(
+        matrix['Nside'], matrix.get('nmaps', [1]), matrix.get('threads', [1]),
+        matrix.get('flags', [['MEASURE']])):
+        yield dict(Nside=Nside, nmaps=nmaps, threads=threads, flags=list(flags))
+
+def run_config(conf, cfg, verbose):
+    fd, json_filename = tempfile.mkstemp(suffix='.json')
+    os.close(fd)
+    try:
+        cmd = [conf['shbench'],
+               '-r', conf['resources'].format(Nside=cfg['Nside']),
+               '-k', str(cfg['nmaps']),
+               '-j', str(cfg['threads']),
+               '-n', str(conf.get('iterations', 10)),
+               '-J', json_filename]
+        for flag in cfg['flags']:
+            cmd += FLAG_SWITCHES[flag]
+        cmd.append('sht')
+        if verbose:
+            print >> sys.stderr, ' '.join(cmd)
+        with open(os.devnull, 'w') as devnull:
+            subprocess.check_call(cmd, stdout=None if verbose else devnull)
+        with open(json_filename) as f:
+            raw = json.load(f)
+    finally:
+        os.unlink(json_filename)
+    result = dict(cfg)
+    result['lmax'] = raw['lmax']
+    result['samples'] = raw['samples']
+    result['phases'] = dict((phase, summarize(raw['samples'][phase]))
+                            for phase in PHASES if len(raw['samples'][phase]) > 0)
+    return result
+
+#
+# Comparison
+#
+
+def compare(results, baseline, alpha, threshold):
+    base_by_key = dict((config_key(r), r) for r in baseline['results'])
+    regressions = []
+    print '%-52s %-8s %10s %10s %8s %8s' % ('config', 'phase', 'base', 'new', 'change', 'p')
+    for r in results['results']:
+        key = config_key(r)
+        b = base_by_key.get(key)
+        if b is None:
+            print '%-52s (not in baseline)' % key
+            continue
+        for phase in PHASES:
+            if phase not in r['phases'] or phase not in b['phases']:
+                continue
+            new_med = r['phases'][phase]['median']
+            base_med = b['phases'][phase]['median']
+            if base_med == 0:
+                continue
+            change = new_med / base_med - 1
+            p = mann_whitney_greater(r['samples'][phase], b['samples'][phase])
+            flagged = change > threshold and p < alpha
+            print '%-52s %-8s %10.4g %10.4g %+7.1f%% %8.2g%s' % (
+                key, phase, base_med, new_med, 100 * change, p,
+                '  REGRESSION' if flagged else '')
+            if flagged:
+                regressions.append(dict(config=key, phase=phase, change=change, p=p))
+    return regressions
+
+def main():
+    parser = OptionParser(usage='%prog [options] config.json')
+    parser.add_option('-o', '--output', help='Write results to this JSON file')
+    parser.add_option('-b', '--baseline', help='Compare with this stored result file')
+    parser.add_option('--alpha', type='float', default=0.01,
+                      help='Significance level for flagging a regression (default 0.01)')
+    parser.add_option('--threshold', type='float', default=0.02,
+                      help='Minimum relative slowdown of the median to flag (default 0.02)')
+    parser.add_option('-v', '--verbose', action='store_true', default=False)
+    options, args = parser.parse_args()
+    if len(args) != 1:
+        parser.error('Please provide a configuration file')
+
+    with open(args[0]) as f:
+        conf = json.load(f)
+    conf.setdefault('shbench', os.path.join(os.path.dirname(__file__), '..', 'build', 'shbench'))
+
+    results = dict(host=host_metadata(), config=conf, results=[])
+    for cfg in expand_matrix(conf['matrix']):
+        print >> sys.stderr, 'Running %s' % config_key(cfg)
+        r = run_config(conf, cfg, options.verbose)
+        results['results'].append(r)
+        for phase in PHASES:
+            if phase in r['phases']:
+                s = r['phases'][phase]
+                print >> sys.stderr, '  %-8s median %.4g min %.4g stddev %.2g (n=%d)' % (
+                    phase, s['median'], s['min'], s['stddev'], s['n'])
+
+    if options.output is not None:
+        with open(options.output, 'w') as f:
+            json.dump(results, f, indent=2, sort_keys=True)
+
+    if options.baseline is not None:
+        with open(options.baseline) as f:
+            baseline = json.load(f)
+        if baseline['host'].get('cpu_model') != results['host']['cpu_model']:
+            print >> sys.stderr, 'Warning: baseline is from a different CPU (%s)' % (
+                baseline['host'].get('cpu_model'))
+        regressions = compare(results, baseline, options.alpha, options.threshold)
+        if len(regressions) > 0:
+            print '%d regression(s) found' % len(regressions)
+            return 1
+    return 0
+
+if __name__ == '__main__':
+    sys.exit(main())
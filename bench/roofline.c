@@ -0,0 +1,343 @@
+/*
+Roofline analysis of the Legendre transform phase.
+
+For every m (even and odd part summed), the butterfly-compressed
+matrix is applied on its own, on a single core of the node that owns
+the m in the plan, and timed. Combined with the flop count from
+wavemoth_get_legendre_flops and the number of bytes streamed
+(m_resource_t.len), this gives the arithmetic intensity and achieved
+GB/s and GFLOP/s per m, which is compared with the bandwidth and
+peak flop rate measured for one core on the same node (or given on
+the command line, e.g. from numabench/cpubench).
+
+Nodes are measured concurrently, one core per node. The m loop is the
+inner loop and repetitions the outer one, so that (as long as the
+per-node resource data is larger than the last level cache) each m is
+timed with its data coming from memory, as during a real execute.
+
+Usage:
+
+    roofline -r 2048.dat [-k nmaps] [-n reps] [-B GB/s] [-F GFLOP/s]
+             [-w m_bin_width] [-f csv|json] [-o outfile]
+*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <malloc.h>
+#include <math.h>
+#include <time.h>
+#include <pthread.h>
+#include <sched.h>
+#include <numa.h>
+
+#include <xmmintrin.h>
+#include <emmintrin.h>
+
+#include "wavemoth.h"
+#include "wavemoth_private.h"
+#include "wavemoth_error.h"
+#include "blas.h"
+#include "benchutils.h"
+
+#define BW_BUF_SIZE (256UL * 1024 * 1024)
+#define NFLAGGED 5
+
+typedef struct {
+  int m, node_id, inode;
+  double bytes, flops, time;
+} m_sample_t;
+
+typedef struct {
+  wavemoth_plan plan;
+  int inode;
+  int reps;
+  double bandwidth, peak; /* bytes/s, flops/s; measured if <= 0 on entry */
+  m_sample_t *samples;    /* indexed by m */
+} node_ctx_t;
+
+static int nmaps = 1;
+
+static double measure_read_bandwidth(void) {
+  /* Single core streaming read, same kernel as numabench */
+  float *buf = numa_alloc_local(BW_BUF_SIZE);
+  size_t n = BW_BUF_SIZE / sizeof(float);
+  double best = 0;
+  memset(buf, 0, BW_BUF_SIZE);
+  for (int it = 0; it != 3; ++it) {
+    __m128 acc = _mm_setzero_ps();
+    double t0 = walltime();
+    for (size_t i = 0; i < n; i += 4) {
+      acc = _mm_add_ps(acc, _mm_load_ps(buf + i));
+    }
+    double dt = walltime() - t0;
+    _mm_store_ps(buf, acc);
+    best = fmax(best, BW_BUF_SIZE / dt);
+  }
+  numa_free(buf, BW_BUF_SIZE);
+  return best;
+}
+
+static double measure_peak_flops(void) {
+  /* In-cache dgemm, as in cpubench but sized to stay in L2 */
+  const int n = 128;
+  double *A = zeros(n * n), *B = zeros(n * n), *C = zeros(n * n);
+  double best = 0;
+  for (int it = 0; it != 5; ++it) {
+    int repeats = 20;
+    double t0 = walltime();
+    for (int j = 0; j != repeats; ++j) {
+      dgemm_ccc(A, B, C, n, n, n, 1.0);
+    }
+    double dt = walltime() - t0;
+    best = fmax(best, 2.0 * n * n * n * repeats / dt);
+  }
+  free(A);
+  free(B);
+  free(C);
+  return best;
+}
+
+static void *node_main(void *ctx_) {
+  node_ctx_t *ctx = ctx_;
+  wavemoth_plan plan = ctx->plan;
+  wavemoth_node_plan_t *node_plan = plan->node_plans[ctx->inode];
+  wavemoth_cpu_plan_t *cpu_plan = &node_plan->cpu_plans[0];
+  wavemoth_legendre_worker_t *worker = &cpu_plan->legendre_workers[0];
+  size_t nrings_half = plan->grid->mid_ring + 1;
+
+  numa_set_localalloc();
+  if (ctx->bandwidth <= 0) ctx->bandwidth = measure_read_bandwidth();
+  if (ctx->peak <= 0) ctx->peak = measure_peak_flops();
+
+  for (size_t im = 0; im != node_plan->nm; ++im) {
+    m_resource_t *res = &node_plan->m_resources[im];
+    m_sample_t *s = &ctx->samples[res->m];
+    s->m = res->m;
+    s->node_id = node_plan->node_id;
+    s->inode = ctx->inode;
+    s->time = 1e300;
+    s->bytes = s->flops = 0;
+    for (int odd = 0; odd != 2; ++odd) {
+      if (res->data[odd] == NULL) continue;
+      s->bytes += res->len[odd];
+      s->flops += (double)wavemoth_get_legendre_flops(plan, res->m, odd) * nmaps;
+    }
+  }
+
+  for (int rep = 0; rep != ctx->reps; ++rep) {
+    for (size_t im = 0; im != node_plan->nm; ++im) {
+      m_resource_t *res = &node_plan->m_resources[im];
+      double t0 = walltime();
+      for (int odd = 0; odd != 2; ++odd) {
+        if (res->data[odd] == NULL) continue;
+        double *target = node_plan->work_q + (2 * im + odd) * plan->work_q_stride;
+        wavemoth_perform_matmul(plan, worker->bfm, res->data[odd], res->schedules[odd],
+                               res->m, odd,
+                               nrings_half, target, worker->legendre_transform_work,
+                               worker->work_a_l, worker->work_x_squared,
+                               worker->work_P1);
+      }
+      double dt = walltime() - t0;
+      m_sample_t *s = &ctx->samples[res->m];
+      s->time = fmin(s->time, dt);
+    }
+  }
+  return NULL;
+}
+
+static double roof(double intensity, double bandwidth, double peak) {
+  return fmin(peak, intensity * bandwidth);
+}
+
+/* Reported as 0 rather than NaN or inf when nothing was loaded or
+   timed (e.g. an m without matrices) */
+static double ratio(double x, double y) {
+  return (y > 0) ? x / y : 0;
+}
+
+typedef struct {
+  int m_start, m_stop;
+  double bytes, flops, time, efficiency;
+} m_range_t;
+
+static int compare_efficiency(const void *a, const void *b) {
+  double x = ((m_range_t*)a)->efficiency, y = ((m_range_t*)b)->efficiency;
+  return (x < y) ? -1 : (x > y);
+}
+
+int main(int argc, char *argv[]) {
+  char *resourcefile = NULL, *outfile = NULL, *format = "csv";
+  int reps = 3, bin_width = 0, c;
+  double bandwidth = 0, peak = 0;
+  int Nside, lmax;
+
+  while ((c = getopt(argc, argv, "r:k:n:B:F:w:f:o:")) != -1) {
+    switch (c) {
+    case 'r': resourcefile = optarg; break;
+    case 'k': nmaps = atoi(optarg); break;
+    case 'n': reps = atoi(optarg); break;
+    case 'B': bandwidth = atof(optarg) * 1e9; break;
+    case 'F': peak = atof(optarg) * 1e9; break;
+    case 'w': bin_width = atoi(optarg); break;
+    case 'f': format = optarg; break;
+    case 'o': outfile = optarg; break;
+    }
+  }
+  check(resourcefile != NULL, "Please provide a resource file with -r");
+  check(strcmp(format, "csv") == 0 || strcmp(format, "json") == 0,
+        "Format (-f) must be csv or json");
+  check(numa_available() >= 0, "NUMA not available");
+
+  wavemoth_configure("");
+  checkf(wavemoth_query_resourcefile(resourcefile, &Nside, &lmax) == 0,
+         "Could not read %s", resourcefile);
+  if (bin_width <= 0) bin_width = (lmax + 32) / 32;
+
+  /* One core on every node we may run on */
+  struct bitmask *run_nodes = numa_get_run_node_mask();
+  int nnodes = 0;
+  for (int i = 0; i <= numa_max_node(); ++i) {
+    if (numa_bitmask_isbitset(run_nodes, i)) nnodes++;
+  }
+  numa_free_nodemask(run_nodes);
+
+  size_t npix = 12 * (size_t)Nside * Nside;
+  double *input = gauss_array(((lmax + 1) * (lmax + 2)) / 2 * 2 * nmaps);
+  double *output = zeros(npix * nmaps);
+  wavemoth_plan plan = wavemoth_plan_to_healpix(Nside, lmax, lmax, nmaps, nnodes, input,
+                                                output, WAVEMOTH_MMAJOR, WAVEMOTH_ESTIMATE,
+                                                resourcefile);
+  check(plan != NULL, "Plan creation failed");
+  fprintf(stderr, "Measuring %d m's on %d node(s), %d reps\n", lmax + 1, plan->nnodes, reps);
+
+  m_sample_t *samples = malloc(sizeof(m_sample_t[lmax + 1]));
+  node_ctx_t ctxs[plan->nnodes];
+  pthread_t threads[plan->nnodes];
+  for (int inode = 0; inode != plan->nnodes; ++inode) {
+    cpu_set_t cpu_set;
+    pthread_attr_t attr;
+    ctxs[inode] = (node_ctx_t){ plan, inode, reps, bandwidth, peak, samples };
+    CPU_ZERO(&cpu_set);
+    CPU_SET(plan->node_plans[inode]->cpu_plans[0].cpu_id, &cpu_set);
+    pthread_attr_init(&attr);
+    pthread_attr_setaffinity_np(&attr, sizeof(cpu_set_t), &cpu_set);
+    pthread_create(&threads[inode], &attr, &node_main, &ctxs[inode]);
+    pthread_attr_destroy(&attr);
+  }
+  for (int inode = 0; inode != plan->nnodes; ++inode) {
+    pthread_join(threads[inode], NULL);
+  }
+
+  FILE *out = stdout;
+  if (outfile != NULL) {
+    out = fopen(outfile, "w");
+    checkf(out != NULL, "Could not open %s", outfile);
+  }
+  int json = strcmp(format, "json") == 0;
+
+  /* Ceilings per node */
+  if (json) {
+    fprintf(out, "{\n  \"Nside\": %d, \"lmax\": %d, \"nmaps\": %d,\n  \"nodes\": [\n",
+            Nside, lmax, nmaps);
+  }
+  for (int inode = 0; inode != plan->nnodes; ++inode) {
+    node_ctx_t *ctx = &ctxs[inode];
+    double bytes = 0, flops = 0, time = 0;
+    wavemoth_node_plan_t *np = plan->node_plans[inode];
+    for (size_t im = 0; im != np->nm; ++im) {
+      m_sample_t *s = &samples[np->m_resources[im].m];
+      bytes += s->bytes;
+      flops += s->flops;
+      time += s->time;
+    }
+    double ai = ratio(flops, bytes), rate = ratio(flops, time);
+    double efficiency = ratio(rate, roof(ai, ctx->bandwidth, ctx->peak));
+    fprintf(stderr, "node %d: ceilings %.2f GB/s, %.2f GFLOP/s; achieved %.2f GB/s, "
+            "%.2f GFLOP/s (%.0f%% of roof at %.3f flop/byte)\n",
+            np->node_id, ctx->bandwidth / 1e9, ctx->peak / 1e9, ratio(bytes, time) / 1e9,
+            rate / 1e9, 100 * efficiency, ai);
+    if (json) {
+      fprintf(out, "    {\"node\": %d, \"bandwidth_GBs\": %.6g, \"peak_GFLOPs\": %.6g, "
+              "\"bytes\": %.17g, \"flops\": %.17g, \"time\": %.9g, \"intensity\": %.6g, "
+              "\"GBs\": %.6g, \"GFLOPs\": %.6g, \"efficiency\": %.6g}%s\n",
+              np->node_id, ctx->bandwidth / 1e9, ctx->peak / 1e9, bytes, flops, time,
+              ai, ratio(bytes, time) / 1e9, rate / 1e9, efficiency,
+              (inode + 1 == plan->nnodes) ? "" : ",");
+    }
+  }
+
+  /* Per m */
+  if (json) {
+    fprintf(out, "  ],\n  \"m\": [\n");
+  } else {
+    fprintf(out, "m,node,bytes,flops,time,intensity,GBs,GFLOPs,roof_GFLOPs,efficiency,bound\n");
+  }
+  for (int m = 0; m != lmax + 1; ++m) {
+    m_sample_t *s = &samples[m];
+    node_ctx_t *ctx = &ctxs[s->inode];
+    double ai = ratio(s->flops, s->bytes), rate = ratio(s->flops, s->time);
+    double r = roof(ai, ctx->bandwidth, ctx->peak);
+    char *bound = (s->bytes == 0) ? "n/a" : (ai * ctx->bandwidth < ctx->peak) ? "memory" :
+      "compute";
+    if (json) {
+      fprintf(out, "    {\"m\": %d, \"node\": %d, \"bytes\": %.17g, \"flops\": %.17g, "
+              "\"time\": %.9g, \"intensity\": %.6g, \"GBs\": %.6g, \"GFLOPs\": %.6g, "
+              "\"roof_GFLOPs\": %.6g, \"efficiency\": %.6g, \"bound\": \"%s\"}%s\n",
+              m, s->node_id, s->bytes, s->flops, s->time, ai, ratio(s->bytes, s->time) / 1e9,
+              rate / 1e9, r / 1e9, ratio(rate, r), bound,
+              (m == lmax) ? "" : ",");
+    } else {
+      fprintf(out, "%d,%d,%.17g,%.17g,%.9g,%.6g,%.6g,%.6g,%.6g,%.6g,%s\n",
+              m, s->node_id, s->bytes, s->flops, s->time, ai, ratio(s->bytes, s->time) / 1e9,
+              rate / 1e9, r / 1e9, ratio(rate, r), bound);
+    }
+  }
+
+  /* Flag the m ranges furthest below the roof. The roof of a range
+     is taken at its aggregate intensity, using the ceilings of the
+     first node (ranges straddle nodes due to round-robin assignment).
+     Ranges that load nothing are not flagged. */
+  int nbins = (lmax + bin_width) / bin_width, nranges = 0;
+  m_range_t ranges[nbins];
+  for (int i = 0; i != nbins; ++i) {
+    m_range_t *rg = &ranges[nranges];
+    rg->m_start = i * bin_width;
+    rg->m_stop = ((i + 1) * bin_width < lmax + 1) ? (i + 1) * bin_width : lmax + 1;
+    rg->bytes = rg->flops = rg->time = 0;
+    for (int m = rg->m_start; m != rg->m_stop; ++m) {
+      rg->bytes += samples[m].bytes;
+      rg->flops += samples[m].flops;
+      rg->time += samples[m].time;
+    }
+    if (rg->bytes == 0) continue;
+    rg->efficiency = ratio(ratio(rg->flops, rg->time),
+                           roof(rg->flops / rg->bytes, ctxs[0].bandwidth, ctxs[0].peak));
+    nranges++;
+  }
+  qsort(ranges, nranges, sizeof(m_range_t), &compare_efficiency);
+  int nflagged = (nranges < NFLAGGED) ? nranges : NFLAGGED;
+  if (json) fprintf(out, "  ],\n  \"flagged\": [\n");
+  for (int i = 0; i != nflagged; ++i) {
+    m_range_t *rg = &ranges[i];
+    fprintf(stderr, "flagged: m=%d..%d at %.0f%% of roof (%.3f flop/byte, %.2f GFLOP/s)\n",
+            rg->m_start, rg->m_stop - 1, 100 * rg->efficiency, rg->flops / rg->bytes,
+            ratio(rg->flops, rg->time) / 1e9);
+    if (json) {
+      fprintf(out, "    {\"m_start\": %d, \"m_stop\": %d, \"intensity\": %.6g, "
+              "\"GFLOPs\": %.6g, \"efficiency\": %.6g}%s\n",
+              rg->m_start, rg->m_stop, rg->flops / rg->bytes, ratio(rg->flops, rg->time) / 1e9,
+              rg->efficiency, (i + 1 == nflagged) ? "" : ",");
+    }
+  }
+  if (json) fprintf(out, "  ]\n}\n");
+  if (out != stdout) fclose(out);
+
+  wavemoth_destroy_plan(plan);
+  free(samples);
+  free(input);
+  free(output);
+  return 0;
+}
@@ -26,6 +26,7 @@ C program to benchmark spherical harmonic transforms
 #include "wavemoth_error.h"
 #include "blas.h"
 #include "benchutils.h"
+#include "perfcounters.h"
 
 
 #define MAXPATH 2048
@@ -37,6 +38,8 @@ int do_ffts;
 int N_threads = 1;
 
 int N_threads;
+int *sht_cpu_ids = NULL; /* -L; overrides -j */
+char *snapshot_save_dir = NULL, *snapshot_load_dir = NULL; /* -s, -l */
 
 /*
 Butterfly SHT benchmark
@@ -47,16 +50,224 @@ wavemoth_plan sht_plan;
 int sht_nmaps;
 int sht_m_stride = 1;
 unsigned sht_flags;
+int sht_place_arrays = 0; /* -A: use wavemoth_alloc_input/output */
+double *placed_input, *placed_output;
 
 double min_legendre_dt = 1e300;
 
+/*
+Hardware counters (-p, -P). Counts are split into phases
+(0: Legendre transforms, 1: FFTs) by the phase hook, which runs at the
+execute barriers. Only collected after the warmup run.
+*/
+#define NPHASES 2
+int collecting = 0; /* set after warmup */
+int use_perf = 0;
+char *perf_spec = NULL;
+double peak_flops_per_cycle = 4; /* SSE2: one mulpd and one addpd per cycle */
+perf_counters_t sht_perf;
+int sht_perf_ok = 0;
+int perf_nexecutes = 0;
+double perf_last[PERF_MAX_EVENTS];
+double perf_phase_counts[NPHASES][PERF_MAX_EVENTS];
+double perf_phase_time[NPHASES];
+double sht_legendre_flops = 0;
+
+/*
+Per-execute samples for the JSON output (-J), also only after warmup.
+*/
+char *json_filename = NULL;
+size_t nsamples = 0, samples_capacity = 0;
+double *samples[3]; /* total, legendre, fft */
+
+void sht_phase_hook(wavemoth_plan plan, int phase, void *ctx) {
+  double now[PERF_MAX_EVENTS];
+  perf_counters_read(&sht_perf, now);
+  if (phase != WAVEMOTH_PHASE_START && collecting) {
+    for (int e = 0; e != sht_perf.nevents; ++e) {
+      perf_phase_counts[phase - 1][e] += now[e] - perf_last[e];
+    }
+  }
+  memcpy(perf_last, now, sizeof(now));
+}
+
+static void record_sample(double total, double legendre, double fft) {
+  if (nsamples == samples_capacity) {
+    samples_capacity = (samples_capacity == 0) ? 64 : 2 * samples_capacity;
+    for (int i = 0; i != 3; ++i) {
+      samples[i] = realloc(samples[i], sizeof(double[samples_capacity]));
+      check(samples[i] != NULL, "Out of memory");
+    }
+  }
+  samples[0][nsamples] = total;
+  samples[1][nsamples] = legendre;
+  samples[2][nsamples] = fft;
+  nsamples++;
+}
+
 void execute_sht(void *ctx) {
+  double t0 = walltime();
   if (do_ffts) {
     wavemoth_execute(sht_plan);
     double dt = sht_plan->times.legendre_transform_done - sht_plan->times.legendre_transform_start;
+    double dt_fft = sht_plan->times.fft_done - sht_plan->times.legendre_transform_done;
     min_legendre_dt = fmin(min_legendre_dt, dt);
+    if (collecting) {
+      perf_phase_time[0] += dt;
+      perf_phase_time[1] += dt_fft;
+      perf_nexecutes++;
+      record_sample(walltime() - t0, dt, dt_fft);
+    }
   } else {
     wavemoth_perform_legendre_transforms(sht_plan);
+    if (collecting) {
+      double dt = walltime() - t0;
+      record_sample(dt, dt, 0);
+    }
+  }
+}
+
+/*
+Write the raw per-execute times as JSON, for bench/regress.py
+*/
+static void write_json_samples(char *filename, double psht_time, double rho) {
+  static char *phase_names[3] = {"total", "legendre", "fft"};
+  FILE *f = fopen(filename, "w");
+  if (!f) {
+    fprintf(stderr, "Could not open %s for writing\n", filename);
+    return;
+  }
+  fprintf(f, "{\n  \"Nside\": %d, \"lmax\": %d, \"nmaps\": %d, \"nthreads\": %d,\n",
+          Nside, lmax, sht_nmaps, N_threads);
+  fprintf(f, "  \"flags\": %u, \"do_ffts\": %d, \"m_stride\": %d,\n",
+          sht_flags, do_ffts, sht_m_stride);
+  fprintf(f, "  \"psht_time\": %.15e, \"relative_error\": %.15e,\n", psht_time, rho);
+  fprintf(f, "  \"samples\": {\n");
+  for (int i = 0; i != 3; ++i) {
+    fprintf(f, "    \"%s\": [", phase_names[i]);
+    for (size_t j = 0; j != nsamples; ++j) {
+      fprintf(f, "%s%.9e", (j == 0) ? "" : ", ", samples[i][j]);
+    }
+    fprintf(f, "]%s\n", (i == 2) ? "" : ",");
+  }
+  fprintf(f, "  }\n}\n");
+  fclose(f);
+}
+
+static void setup_perf(void) {
+  int nthreads = 0;
+  pid_t tids[sht_plan->ncpus_total * sht_plan->threads_per_cpu];
+
+  if (!do_ffts) {
+    fprintf(stderr, "Hardware counters require FFTs (the execute threads), ignoring -p\n");
+    return;
+  }
+  perf_counters_init(&sht_perf);
+  if (perf_spec != NULL && perf_counters_parse_spec(&sht_perf, perf_spec) != 0) {
+    exit(1);
+  }
+  for (int inode = 0; inode != sht_plan->nnodes; ++inode) {
+    wavemoth_node_plan_t *node_plan = sht_plan->node_plans[inode];
+    for (int icpu = 0; icpu != node_plan->ncpus; ++icpu) {
+      /* The execute thread of the CPU and its extra Legendre workers
+         (-B/-H), which only take part in the Legendre phase */
+      for (int w = 0; w != sht_plan->threads_per_cpu; ++w) {
+        tids[nthreads++] = node_plan->cpu_plans[icpu].legendre_workers[w].tid;
+      }
+    }
+  }
+  if (perf_counters_attach(&sht_perf, tids, nthreads) == 0) {
+    fprintf(stderr, "Hardware counters not available, check "
+            "/proc/sys/kernel/perf_event_paranoid\n");
+    perf_counters_close(&sht_perf);
+    return;
+  }
+  sht_perf_ok = 1;
+  memset(perf_phase_counts, 0, sizeof(perf_phase_counts));
+  memset(perf_phase_time, 0, sizeof(perf_phase_time));
+  sht_plan->phase_hook = &sht_phase_hook;
+  sht_plan->phase_hook_ctx = NULL;
+
+  /* Flop count of the Legendre phase, as modelled by the library */
+  for (int inode = 0; inode != sht_plan->nnodes; ++inode) {
+    wavemoth_node_plan_t *node_plan = sht_plan->node_plans[inode];
+    for (size_t im = 0; im != node_plan->nm; ++im) {
+      m_resource_t *res = &node_plan->m_resources[im];
+      for (int odd = 0; odd != 2; ++odd) {
+        if (res->data[odd] == NULL) continue;
+        sht_legendre_flops += (double)wavemoth_get_legendre_flops(sht_plan, res->m, odd) *
+          sht_nmaps;
+      }
+    }
+  }
+}
+
+static double sum_events_with_prefix(double *counts, char *prefix) {
+  double r = NAN;
+  for (int e = 0; e != sht_perf.nevents; ++e) {
+    if (strncmp(sht_perf.events[e].name, prefix, strlen(prefix)) == 0 && !isnan(counts[e])) {
+      r = (isnan(r) ? 0 : r) + counts[e];
+    }
+  }
+  return r;
+}
+
+static void print_perf_report(void) {
+  char *phase_names[NPHASES] = {"legendre", "fft"};
+  char tbuf[20];
+  int n = perf_nexecutes;
+  int icycles = perf_counters_find(&sht_perf, "cycles");
+  int iinstr = perf_counters_find(&sht_perf, "instructions");
+  int irefs = perf_counters_find(&sht_perf, "llc-refs");
+  int imisses = perf_counters_find(&sht_perf, "llc-misses");
+
+  printf("  Hardware counters (mean per execute, summed over %d threads):\n",
+         sht_perf.nthreads);
+  for (int p = 0; p != NPHASES; ++p) {
+    double c[PERF_MAX_EVENTS];
+    double t = perf_phase_time[p] / n;
+    for (int e = 0; e != sht_perf.nevents; ++e) {
+      c[e] = perf_phase_counts[p][e] / n;
+    }
+    snftime(tbuf, 20, t);
+    printf("    %s (%s):\n", phase_names[p], tbuf);
+    for (int e = 0; e != sht_perf.nevents; ++e) {
+      if (isnan(c[e])) {
+        printf("      %-16s %12s\n", sht_perf.events[e].name, "n/a");
+      } else {
+        printf("      %-16s %12.4e\n", sht_perf.events[e].name, c[e]);
+      }
+    }
+    printf("      %-16s %12.3f\n", "IPC", c[iinstr] / c[icycles]);
+    printf("      %-16s %12.3f\n", "llc-miss-ratio", c[imisses] / c[irefs]);
+
+    /* Memory traffic: raw dram* events if given, otherwise LLC misses
+       times the cache line size as a proxy. */
+    double bytes = sum_events_with_prefix(c, "dram");
+    if (isnan(bytes)) bytes = c[imisses] * 64;
+    printf("      %-16s %12.3f\n", "DRAM~GB/s", bytes / t / 1e9);
+
+    /* Flops: raw fp* events if given; for the Legendre phase we
+       always have the flop count of the compressed matrices. */
+    double measured_flops = sum_events_with_prefix(c, "fp");
+    double flops = measured_flops;
+    if (!isnan(measured_flops)) {
+      printf("      %-16s %12.3f\n", "GFLOP/s(counted)", measured_flops / t / 1e9);
+    }
+    if (p == 0) {
+      printf("      %-16s %12.3f\n", "GFLOP/s(model)", sht_legendre_flops / t / 1e9);
+      if (isnan(flops)) flops = sht_legendre_flops;
+    }
+    if (!isnan(flops)) {
+      double per_cycle = flops / c[icycles];
+      printf("      %-16s %12.3f (%.0f%% of %.0f flop/cycle peak)\n", "flop/cycle",
+             per_cycle, 100 * per_cycle / peak_flops_per_cycle, peak_flops_per_cycle);
+      if (bytes > 0) {
+        printf("      %-16s %12.3f\n", "flop/byte", flops / bytes);
+      } else {
+        printf("      %-16s %12s\n", "flop/byte", "n/a");
+      }
+    }
   }
 }
 
@@ -71,10 +282,35 @@ void setup_sht() {
     fclose(fd);
   }
 
-  sht_plan = wavemoth_plan_to_healpix(Nside, lmax, lmax, nmaps, N_threads, sht_input,
-                                     sht_output, WAVEMOTH_MMAJOR, sht_flags,
-                                     sht_resourcefile);
-  checkf(sht_plan, "plan not created, nthreads=%d", N_threads);
+  if (snapshot_load_dir != NULL) {
+    sht_plan = wavemoth_plan_load(snapshot_load_dir, sht_input, sht_output);
+    checkf(sht_plan, "plan not loaded from %s", snapshot_load_dir);
+  } else {
+    sht_plan = wavemoth_plan_to_healpix_on_cpus(Nside, lmax, lmax, nmaps, N_threads,
+                                               sht_cpu_ids, sht_input, sht_output,
+                                               WAVEMOTH_MMAJOR, sht_flags,
+                                               sht_resourcefile);
+    checkf(sht_plan, "plan not created, nthreads=%d", N_threads);
+  }
+  if (sht_place_arrays) {
+    size_t nlm = ((lmax + 1) * (lmax + 2)) / 2;
+    placed_input = wavemoth_alloc_input(sht_plan);
+    placed_output = wavemoth_alloc_output(sht_plan);
+    check(placed_input != NULL && placed_output != NULL, "could not place arrays");
+    memcpy(placed_input, sht_input, sizeof(double[nlm * 2 * nmaps]));
+  }
+  if (snapshot_save_dir != NULL) {
+    checkf(wavemoth_plan_save(sht_plan, snapshot_save_dir) == 0,
+           "could not save plan to %s", snapshot_save_dir);
+  }
+  {
+    wavemoth_plan_stats_t stats;
+    wavemoth_get_plan_stats(sht_plan, &stats);
+    printf("  Plan created in %.2f s; loaded %.1f MB in %.2f s (%.1f MB/s)\n",
+           stats.plan_time, stats.load_bytes / 1024.0 / 1024.0, stats.load_time,
+           (stats.load_time > 0) ? stats.load_bytes / 1024.0 / 1024.0 / stats.load_time : 0);
+  }
+  if (use_perf) setup_perf();
 
   /* Export FFTW wisdom generated during planning */
   fd = fopen("fftw.wisdom", "w");
@@ -88,6 +324,17 @@ void finish_sht(void) {
   char tbuf[20];
   snftime(tbuf, 20, min_legendre_dt);
   printf("  Legendre transform time: %s (min)\n", tbuf);
+  if (sht_perf_ok) {
+    if (perf_nexecutes > 0) print_perf_report();
+    sht_plan->phase_hook = NULL;
+    perf_counters_close(&sht_perf);
+    sht_perf_ok = 0;
+  }
+  if (sht_place_arrays) {
+    memcpy(sht_output, placed_output, sizeof(double[12 * Nside * Nside * sht_nmaps]));
+    wavemoth_free_input(sht_plan, placed_input);
+    wavemoth_free_output(sht_plan, placed_output);
+  }
   wavemoth_destroy_plan(sht_plan);
 }
 
@@ -241,16 +488,36 @@ int main(int argc, char *argv[]) {
   do_ffts = -1;
   sht_flags = WAVEMOTH_MEASURE;
 
-  while ((c = getopt (argc, argv, "r:N:j:n:t:S:k:a:o:FEC")) != -1) {
+  while ((c = getopt (argc, argv, "r:N:j:L:n:t:S:k:a:o:J:pP:K:FECBHGRIAs:l:")) != -1) {
     switch (c) {
     case 'r': sht_resourcefile = optarg; break;
     case 'N': Nside = atoi(optarg);  break;
     case 'j': N_threads = atoi(optarg); break;
+    case 'L':
+      {
+        /* Comma-separated list of CPU ids */
+        char *tok, *saveptr;
+        sht_cpu_ids = malloc(sizeof(int[strlen(optarg) + 1]));
+        N_threads = 0;
+        for (tok = strtok_r(optarg, ",", &saveptr); tok != NULL;
+             tok = strtok_r(NULL, ",", &saveptr)) {
+          sht_cpu_ids[N_threads++] = atoi(tok);
+        }
+      }
+      break;
     case 'n': miniter = atoi(optarg); break;
     case 't': mintime = atof(optarg); break;
     case 'E':
       sht_flags &= ~WAVEMOTH_MEASURE; break;
     case 'C': sht_flags |= WAVEMOTH_NO_RESOURCE_COPY;  break;
+    case 'B': sht_flags |= WAVEMOTH_COSCHEDULE;  break;
+    case 'H': sht_flags |= WAVEMOTH_SMT;  break;
+    case 'G': sht_flags |= WAVEMOTH_HUGEPAGES;  break;
+    case 'R': sht_flags |= WAVEMOTH_SHARED_RESOURCES;  break;
+    case 'I': sht_flags |= WAVEMOTH_REPLICATE_INPUT;  break;
+    case 'A': sht_place_arrays = 1;  break;
+    case 's': snapshot_save_dir = optarg; break;
+    case 'l': snapshot_load_dir = optarg; break;
     case 'a':
       stats_filename = optarg;
       stats_mode = "a";
@@ -259,6 +526,7 @@ int main(int argc, char *argv[]) {
       stats_filename = optarg;
       stats_mode = "w";
       break;
+    case 'J': json_filename = optarg; break;
     case 'S': 
       sht_m_stride = atoi(optarg); 
       do_ffts = 0;
@@ -267,6 +535,12 @@ int main(int argc, char *argv[]) {
       do_ffts = 0;
       break;
     case 'k': sht_nmaps = atoi(optarg); break;
+    case 'p': use_perf = 1; break;
+    case 'P':
+      use_perf = 1;
+      perf_spec = optarg;
+      break;
+    case 'K': peak_flops_per_cycle = atof(optarg); break;
     }  }
   argv += optind;
   argc -= optind;
@@ -313,6 +587,7 @@ int main(int argc, char *argv[]) {
     pbench->setup();
     printf("  Warming up\n");
     pbench->execute(NULL);
+    collecting = 1;
     printf("  Executing\n");
     
 #ifdef HAS_PPROF
@@ -358,7 +633,11 @@ int main(int argc, char *argv[]) {
     }
   }
 
+  if (json_filename != NULL) {
+    write_json_samples(json_filename, psht_benchmark->min_time, rho);
+  }
 
+  for (i = 0; i != 3; ++i) free(samples[i]);
   free(psht_output);
   free(sht_output);
   free(sht_input);
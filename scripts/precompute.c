@@ -0,0 +1,131 @@
+/*
+Native counterpart of precompute.py: computes a resource file with
+the multithreaded precomputation engine of libwavemoth (see
+precompute.h). No Python/NumPy needed.
+
+Usage:
+
+    precompute [-c chunk_size] [-m memop_cost] [-C] [-M model] [-j threads]
+               [-e tolerance] [-L lmax] [-s stride] [-r] [-R m_list] [-q]
+               Nside target
+
+-r uses randomized interpolative decompositions, which is faster.
+
+-C measures the cost model (see costmodel.h) on this host and uses it
+instead of memop_cost to choose the compression depth; it is printed
+in the form taken by -M, "ip_element,ip_row,ip_block,residual_element,
+residual_block", for use when the resources are computed elsewhere.
+As every calibration gives a slightly different model, resume an
+interrupted calibrated run by passing the printed model to -M.
+
+-R recomputes only the m in m_list (e.g. "0-15,100") of the existing
+target, copying the other matrices from it.
+
+If target is a directory, the file is written to target/<Nside>.dat.
+An interrupted run is resumed by running the same command again.
+*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "precompute.h"
+#include "wavemoth_error.h"
+
+/* Parse "a-b,c,..." into *ms; returns the number of m, or -1 */
+static int parse_m_list(const char *str, int mmax, int **ms) {
+  int n = 0, lo, hi, len;
+  *ms = malloc(sizeof(int[mmax + 1]));
+  if (*ms == NULL) return -1;
+  while (*str != '\0') {
+    if (sscanf(str, "%d%n", &lo, &len) != 1) return -1;
+    str += len;
+    hi = lo;
+    if (*str == '-') {
+      if (sscanf(str + 1, "%d%n", &hi, &len) != 1) return -1;
+      str += 1 + len;
+    }
+    if (lo < 0 || hi > mmax || lo > hi) return -1;
+    for (int m = lo; m <= hi && n <= mmax; ++m) (*ms)[n++] = m;
+    if (*str == ',') ++str;
+  }
+  return n;
+}
+
+int main(int argc, char *argv[]) {
+  wavemoth_precompute_options_t opts;
+  int chunk_size = 64, nthreads = 0, lmax = -1, stride = 1, verbose = 1, randomized = 0, c;
+  int *ms = NULL, nms = 0, ret;
+  const char *m_list = NULL;
+  double memop_cost = 20, eps = 1e-10;
+  wavemoth_cost_model_t model;
+  int calibrate = 0, have_model = 0;
+  struct stat st;
+
+  while ((c = getopt(argc, argv, "c:m:CM:j:e:L:s:rR:q")) != -1) {
+    switch (c) {
+    case 'c': chunk_size = atoi(optarg); break;
+    case 'm': memop_cost = atof(optarg); break;
+    case 'C': calibrate = 1; break;
+    case 'M':
+      check(sscanf(optarg, "%lf,%lf,%lf,%lf,%lf", &model.ip_element, &model.ip_row,
+                   &model.ip_block, &model.residual_element, &model.residual_block) == 5,
+            "Invalid cost model");
+      have_model = 1;
+      break;
+    case 'j': nthreads = atoi(optarg); break;
+    case 'e': eps = atof(optarg); break;
+    case 'L': lmax = atoi(optarg); break;
+    case 's': stride = atoi(optarg); break;
+    case 'r': randomized = 1; break;
+    case 'R': m_list = optarg; break;
+    case 'q': verbose = 0; break;
+    }
+  }
+  check(argc - optind == 2, "Usage: precompute [options] Nside target");
+  int Nside = atoi(argv[optind]);
+  check(Nside > 0, "Invalid Nside");
+
+  size_t buflen = strlen(argv[optind + 1]) + 32;
+  char target[buflen];
+  if (stat(argv[optind + 1], &st) == 0 && S_ISDIR(st.st_mode)) {
+    snprintf(target, buflen, "%s/%d.dat", argv[optind + 1], Nside);
+  } else {
+    snprintf(target, buflen, "%s", argv[optind + 1]);
+  }
+
+  wavemoth_precompute_default_options(&opts, Nside);
+  if (lmax >= 0) opts.lmax = opts.mmax = lmax;
+  opts.chunk_size = chunk_size;
+  opts.memop_cost = memop_cost;
+  opts.eps = eps;
+  opts.m_stride = stride;
+  opts.nthreads = nthreads;
+  opts.randomized = randomized;
+  opts.verbose = verbose;
+  if (calibrate) {
+    check(wavemoth_calibrate_cost_model(&model, 2) == 0, "Calibration failed");
+    have_model = 1;
+    if (verbose) {
+      fprintf(stderr, "Cost model: -M %g,%g,%g,%g,%g\n", model.ip_element, model.ip_row,
+              model.ip_block, model.residual_element, model.residual_block);
+    }
+  }
+  if (have_model) opts.cost_model = &model;
+  if (m_list != NULL) {
+    nms = parse_m_list(m_list, opts.mmax, &ms);
+    check(nms >= 0, "Invalid m list");
+    ret = wavemoth_precompute_regenerate(target, &opts, ms, nms);
+    free(ms);
+  } else {
+    ret = wavemoth_precompute_resources(target, &opts);
+  }
+  if (ret != 0) {
+    fprintf(stderr, "Precomputation failed\n");
+    return 1;
+  }
+  return 0;
+}
@@ -1,29 +1,20 @@
 #!/usr/bin/env python
 from __future__ import division
 
-#
-# We spawn workers and use futures to submit jobs to workers.
-# Each worker opens its own HDF file.
-#
-
 # Stick .. in PYTHONPATH
 import sys
 import os
-from glob import glob
 sys.path.insert(0, os.path.join(os.path.dirname(__file__), '..'))
 
 import argparse
 from concurrent.futures import ProcessPoolExecutor
 import numpy as np
-import tables
 
 from wavemoth.butterfly import *
 from wavemoth.healpix import *
 from wavemoth.lib import *
 from wavemoth.benchmark_utils import *
 from wavemoth import *
-from io import BytesIO
-from wavemoth.utils import FakeExecutor
 
 np.seterr(all='raise')
 
@@ -36,104 +27,44 @@ class PrintLogger:
     def info(self, msg):
         print msg
 
-_aborted = False
-
-def compute_m(filename, m, odd, lmax, Nside, chunk_size, eps, num_levels):
-    global _aborted
-    if _aborted:
-        return
-    try:
-        filename = '%s-%d' % (filename, os.getpid())
-        stream = BytesIO()
-        compute_resources_for_m(stream, m, odd, lmax, Nside, chunk_size, eps, num_levels,
-                                PrintLogger())
-        # Store to HDF file for future concatenation
-        stream_arr = np.frombuffer(stream.getvalue(), dtype=np.byte)
-        f = tables.openFile(filename, 'a')
-        try:
-            group = f.createGroup('/m%d' % m, ['even', 'odd'][odd],
-                                  createparents=True)
-            f.setNodeAttr(group, 'lmax', lmax)
-            f.setNodeAttr(group, 'm', m)
-            f.setNodeAttr(group, 'odd', odd)
-            f.setNodeAttr(group, 'Nside', Nside)
-            f.createArray(group, 'matrix_data', stream_arr)
-        finally:
-            f.close()
-    except KeyboardInterrupt:
-        _aborted = True
-    except:
-        import traceback
-        traceback.print_exc()
-        _aborted = True
-        raise
-
-def compute_with_workers(args):
-    # Delete all files matching target-*
-    for fname in glob('%s-*' % args.target):
-        os.unlink(fname)
-    # Each worker will generate one HDF file
-    futures = []
-    if args.parallel == 1:
-        proc = FakeExecutor()
-    else:
-        proc = ProcessPoolExecutor(max_workers=args.parallel)
-    for m in range(0, args.lmax + 1, args.stride):
-        for odd in range(2):
-            futures.append(proc.submit(compute_m, args.target, m, odd, args.lmax, args.Nside,
-                                       args.chunk_size, args.tolerance, args.num_levels))
-    for fut in futures:
-        fut.result()
-
-def serialize_from_hdf_files(args, target):
-    """ Join the '$target-$pid' HDF file into '$target', a dat
-        file in custom format.
-    """
-    print 'Merging...'
-    infilenames = glob('%s-*' % target)
-    if os.path.isdir(target):
-        target = os.path.join(target, "%d.dat" % args.Nside)
-    with file(target, 'w') as outfile:
-        infiles = [tables.openFile(x) for x in infilenames]
-
-        def get_group(m, odd):
-            for infile in infiles:
-                x = getattr(infile.root, 'm%d/%s' % (m, ['even', 'odd'][odd]), None)
-                if x is not None:
-                    return infile, x
-        
-        try:
-            def get_matrix(stream, m, odd, lmax, Nside, chunk_size,
-                           eps, num_levels, logger):
-                f, g = get_group(m, odd)
-                stream.write(g.matrix_data[:])
-                return stream
-
-            f, g = get_group(0, 0)
-            Nside = f.getNodeAttr(g, 'Nside')
-            lmax = f.getNodeAttr(g, 'lmax')
-            mmax = lmax
-
-            compute_resources(outfile, lmax, mmax, Nside, chunk_size=None, max_workers=1,
-                              eps=None, logger=None, compute_matrix_func=get_matrix)
-        finally:
-            for x in infiles:
-                x.close()
-    for x in infilenames:
-        os.unlink(x)
-
 def main(args):
+    cost_model = None
+    if args.calibrate:
+        cost_model = calibrate_cost_model()
+        print 'Cost model: %r' % cost_model
+    if args.native or args.regenerate is not None:
+        # Resumable; see wavemoth_precompute_resources
+        ms = None
+        if args.regenerate is not None:
+            ms = parse_m_list(args.regenerate)
+        compute_resources_native(args.target, args.Nside, args.lmax, args.chunk_size,
+                                 args.tolerance, args.memop_cost, args.parallel,
+                                 verbose=True, randomized=args.randomized, ms=ms,
+                                 cost_model=cost_model)
+        return
     comp = ResourceComputer(args.Nside, args.lmax, args.lmax, args.chunk_size, args.tolerance,
-                            args.memop_cost, PrintLogger())
+                            args.memop_cost, PrintLogger(), randomized=args.randomized,
+                            cost_model=cost_model)
     with file(args.target, 'w') as outfile:
         comp.compute(outfile, max_workers=args.parallel)
-        
+
+def parse_m_list(s):
+    # "0-15,100" -> [0, ..., 15, 100]
+    ms = []
+    for part in s.split(','):
+        lo, _, hi = part.partition('-')
+        ms.extend(range(int(lo), int(hi or lo) + 1))
+    return ms
+
 
 parser = argparse.ArgumentParser(description='Precomputation')
 parser.add_argument('-c', '--chunk-size', type=int, default=64,
                     help='chunk size in number of columns')
 parser.add_argument('-m', '--memop-cost', type=float, default=20,
                     help='cost to assign to memop vs. flop')
+parser.add_argument('-C', '--calibrate', action='store_true', default=False,
+                    help='measure the cost model on this host and use it '
+                    'instead of --memop-cost (such runs are not resumable)')
 parser.add_argument('-j', '--parallel', type=int, default=8,
                     help='how many processors to use for precomputation')
 parser.add_argument('--stride', type=int, default=1,
@@ -141,6 +72,13 @@ parser.add_argument('--stride', type=int, default=1,
                     'but useful for benchmarks.')
 parser.add_argument('-e', '--tolerance', type=float, default=1e-10,
                     help='tolerance')
+parser.add_argument('-r', '--randomized', action='store_true', default=False,
+                    help='use randomized interpolative decompositions (faster)')
+parser.add_argument('--native', action='store_true', default=False,
+                    help='use the native, resumable precomputation')
+parser.add_argument('--regenerate', metavar='M_LIST', default=None,
+                    help='recompute only these m (e.g. 0-15,100) of an existing '
+                    'target (implies --native)')
 parser.add_argument('-l', '--num-levels', type=int, default=None,
                     help='Number of levels of compression')
 parser.add_argument('-L', '--lmax', type=int, help='lmax parameter', default=None)
@@ -152,5 +90,3 @@ if args.lmax is None:
     args.lmax = 2 * args.Nside
 
 main(args)
-#compute_with_workers(args)
-#serialize_from_hdf_files(args, args.target)
@@ -0,0 +1,73 @@
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "arena.h"
+#include "hugepages.h"
+
+#define ARENA_CHUNK_SIZE (2 * 1024 * 1024)
+
+struct _wavemoth_arena_chunk {
+  struct _wavemoth_arena_chunk *next;
+  size_t mapped_size, used;
+};
+
+typedef struct _wavemoth_arena_chunk chunk_t;
+
+void wavemoth_arena_init(wavemoth_arena_t *arena, int node_id, int use_hugepages) {
+  arena->chunks = arena->current = NULL;
+  arena->node_id = node_id;
+  arena->use_hugepages = use_hugepages;
+  arena->allocated = 0;
+  pthread_mutex_init(&arena->lock, NULL);
+}
+
+static char *bump(chunk_t *chunk, size_t size, size_t align) {
+  size_t start;
+  if (chunk == NULL) return NULL;
+  start = ((size_t)chunk + chunk->used + align - 1) & ~(align - 1);
+  if (start + size > (size_t)chunk + chunk->mapped_size) return NULL;
+  chunk->used = start + size - (size_t)chunk;
+  return (char*)start;
+}
+
+static size_t remaining(chunk_t *chunk) {
+  return (chunk == NULL) ? 0 : chunk->mapped_size - chunk->used;
+}
+
+void *wavemoth_arena_alloc(wavemoth_arena_t *arena, size_t size, size_t align) {
+  char *p;
+  pthread_mutex_lock(&arena->lock);
+  p = bump(arena->current, size, align);
+  if (p == NULL) {
+    /* New chunk; large requests get a chunk of their own */
+    size_t need = sizeof(chunk_t) + size + align;
+    size_t mapped_size;
+    chunk_t *chunk = wavemoth_alloc_large(need < ARENA_CHUNK_SIZE ? ARENA_CHUNK_SIZE : need,
+                                          arena->node_id, arena->use_hugepages,
+                                          &mapped_size);
+    if (chunk != NULL) {
+      chunk->mapped_size = mapped_size;
+      chunk->used = sizeof(chunk_t);
+      chunk->next = arena->chunks;
+      arena->chunks = chunk;
+      arena->allocated += mapped_size;
+      p = bump(chunk, size, align);
+      /* Keep bumping in whichever chunk has more room left */
+      if (remaining(chunk) > remaining(arena->current)) arena->current = chunk;
+    }
+  }
+  pthread_mutex_unlock(&arena->lock);
+  return p;
+}
+
+void wavemoth_arena_release(wavemoth_arena_t *arena) {
+  chunk_t *chunk = arena->chunks;
+  while (chunk != NULL) {
+    chunk_t *next = chunk->next;
+    wavemoth_free_large(chunk, chunk->mapped_size);
+    chunk = next;
+  }
+  arena->chunks = arena->current = NULL;
+  arena->allocated = 0;
+  pthread_mutex_destroy(&arena->lock);
+}
@@ -0,0 +1,29 @@
+#ifndef _WAVEMOTH_ARENA_H_
+#define _WAVEMOTH_ARENA_H_
+
+#include <stddef.h>
+#include <pthread.h>
+
+/*
+Node-local bump allocator. All per-node memory of a plan is taken from
+one arena, which is released in one operation when the plan is
+destroyed. Memory comes in chunks from wavemoth_alloc_large (bound to
+the node, optionally huge-page backed); allocations are never freed
+individually. wavemoth_arena_alloc is thread-safe.
+*/
+
+struct _wavemoth_arena_chunk;
+
+typedef struct {
+  struct _wavemoth_arena_chunk *chunks, *current;
+  int node_id, use_hugepages;
+  size_t allocated; /* total mapped size of chunks */
+  pthread_mutex_t lock;
+} wavemoth_arena_t;
+
+void wavemoth_arena_init(wavemoth_arena_t *arena, int node_id, int use_hugepages);
+/* align must be a power of two; returns NULL if out of memory */
+void *wavemoth_arena_alloc(wavemoth_arena_t *arena, size_t size, size_t align);
+void wavemoth_arena_release(wavemoth_arena_t *arena);
+
+#endif
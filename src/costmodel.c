@@ -0,0 +1,174 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <malloc.h>
+#include <time.h>
+
+#include "costmodel.h"
+#include "butterfly.h"
+#include "blas.h"
+#include "legendre_transform.h"
+
+/* Interpolation blocks are streamed from a buffer this large, so that
+   they come from memory rather than cache */
+#define IP_BUFFER_SIZE (64 * 1024 * 1024)
+#define MIN_TIMING 0.02
+#define NTRIALS 3
+
+static double walltime(void) {
+  struct timespec tv;
+  clock_gettime(CLOCK_MONOTONIC, &tv);
+  return tv.tv_sec + 1e-9 * tv.tv_nsec;
+}
+
+void wavemoth_cost_model_from_memop(wavemoth_cost_model_t *model, double memop_cost) {
+  model->ip_element = 1;
+  model->ip_row = 1;
+  model->ip_block = 0;
+  model->residual_element = (5. / 2. + 1) / memop_cost;
+  model->residual_block = 0;
+}
+
+double wavemoth_ip_block_cost(const wavemoth_cost_model_t *model, size_t n, size_t k) {
+  return model->ip_element * k * (n - k) + model->ip_row * n + model->ip_block;
+}
+
+double wavemoth_residual_block_cost(const wavemoth_cost_model_t *model,
+                                    size_t nrows, size_t ncols) {
+  return model->residual_element * nrows * ncols + model->residual_block;
+}
+
+/*
+Seconds per interpolation block with n columns of which k are kept,
+applied as in transpose_apply_interpolation_block. Returns -1 if out
+of memory.
+*/
+static double time_ip_block(size_t n, size_t k, size_t nvecs) {
+  size_t mask_size = (n + 15) & ~(size_t)15;
+  size_t block_size = mask_size + sizeof(double[k * (n - k)]);
+  size_t nblocks = IP_BUFFER_SIZE / block_size, n_left = n / 2, n_right = n - n / 2;
+  char *data = memalign(4096, nblocks * block_size);
+  double *input = memalign(16, sizeof(double[k * nvecs]));
+  double *y = memalign(16, sizeof(double[(n - k) * nvecs]));
+  double *left = memalign(16, sizeof(double[n_left * nvecs]));
+  double *right = memalign(16, sizeof(double[n_right * nvecs]));
+  double best = -1;
+
+  if (!data || !input || !y || !left || !right) goto FINALLY;
+  for (size_t b = 0; b != nblocks; ++b) {
+    char *mask = data + b * block_size;
+    double *interpolant = (double*)(mask + mask_size);
+    /* The k kept columns spread evenly */
+    memset(mask, 1, n);
+    for (size_t i = 0; i != k; ++i) mask[i * n / k] = 0;
+    for (size_t i = 0; i != k * (n - k); ++i) interpolant[i] = 1e-3;
+  }
+  for (size_t i = 0; i != k * nvecs; ++i) input[i] = 1;
+
+  for (int trial = 0; trial != NTRIALS; ++trial) {
+    size_t nsweeps = 0;
+    double t0 = walltime(), dt;
+    do {
+      for (size_t b = 0; b != nblocks; ++b) {
+        char *mask = data + b * block_size;
+        double *interpolant = (double*)(mask + mask_size);
+        bfm_scatter(mask, left, right, input, n_left, n_right, nvecs, 0, 0);
+        dgemm_ccc(input, interpolant, y, nvecs, n - k, k, 0.0);
+        bfm_scatter(mask, left, right, y, n_left, n_right, nvecs, 1, 1);
+      }
+      ++nsweeps;
+      dt = walltime() - t0;
+    } while (dt < MIN_TIMING);
+    dt /= nsweeps * nblocks;
+    if (best < 0 || dt < best) best = dt;
+  }
+ FINALLY:
+  free(data);
+  free(input);
+  free(y);
+  free(left);
+  free(right);
+  return best;
+}
+
+/*
+Seconds for the Legendre recurrence of a strip of nk rows and nx
+columns, packing the input as in pull_a_through_legendre_block.
+Returns -1 if out of memory.
+*/
+static double time_legendre_strip(size_t nk, size_t nx, size_t nvecs) {
+  double *input = memalign(16, sizeof(double[2 * nk * nvecs]));
+  double *packed = memalign(16, sizeof(double[nk * nvecs]));
+  double *y = memalign(16, sizeof(double[nx * nvecs]));
+  double *x_squared = memalign(16, sizeof(double[nx]));
+  double *P0 = memalign(16, sizeof(double[nx]));
+  double *P1 = memalign(16, sizeof(double[nx]));
+  double *auxdata = malloc(sizeof(double[3 * (nk - 2)]));
+  char *work = memalign(16, wavemoth_legendre_transform_sse_query_work(nvecs));
+  double best = -1;
+
+  if (!input || !packed || !y || !x_squared || !P0 || !P1 || !auxdata || !work) {
+    goto FINALLY;
+  }
+  for (size_t i = 0; i != 2 * nk * nvecs; ++i) input[i] = 1;
+  for (size_t j = 0; j != nx; ++j) {
+    x_squared[j] = (j + 0.5) / nx;
+    P0[j] = P1[j] = 1e-3;
+  }
+  wavemoth_legendre_transform_auxdata(0, 0, nk, auxdata);
+
+  for (int trial = 0; trial != NTRIALS; ++trial) {
+    size_t nrepeats = 0;
+    double t0 = walltime(), dt;
+    do {
+      wavemoth_legendre_transform_pack(nk, nvecs, input, packed);
+      wavemoth_legendre_transform_sse(nx, nk, nvecs, packed, y, x_squared, auxdata,
+                                      P0, P1, work);
+      ++nrepeats;
+      dt = walltime() - t0;
+    } while (dt < MIN_TIMING);
+    dt /= nrepeats;
+    if (best < 0 || dt < best) best = dt;
+  }
+ FINALLY:
+  free(input);
+  free(packed);
+  free(y);
+  free(x_squared);
+  free(P0);
+  free(P1);
+  free(auxdata);
+  free(work);
+  return best;
+}
+
+static double nonnegative(double x) {
+  return (x > 0) ? x : 0;
+}
+
+/*
+The coefficients are solved for from a few shapes: two blocks of equal
+n and different k give ip_element, and a small block then splits the
+rest into ip_row and ip_block. Likewise a large and a minimal strip
+give residual_element and residual_block.
+*/
+int wavemoth_calibrate_cost_model(wavemoth_cost_model_t *model, size_t nvecs) {
+  double t_small = time_ip_block(8, 4, nvecs);
+  double t_thin = time_ip_block(128, 8, nvecs);
+  double t_wide = time_ip_block(128, 64, nvecs);
+  double t_strip_small = time_legendre_strip(6, 2, nvecs);
+  double t_strip_large = time_legendre_strip(512, 60, nvecs);
+  double rest_small, rest_thin;
+
+  if (t_small < 0 || t_thin < 0 || t_wide < 0 || t_strip_small < 0 || t_strip_large < 0) {
+    return -1;
+  }
+  model->ip_element = nonnegative((t_wide - t_thin) / (64 * 64 - 8 * 120));
+  rest_small = t_small - model->ip_element * 4 * 4;
+  rest_thin = t_thin - model->ip_element * 8 * 120;
+  model->ip_row = nonnegative((rest_thin - rest_small) / (128 - 8));
+  model->ip_block = nonnegative(rest_small - model->ip_row * 8);
+  model->residual_element = nonnegative((t_strip_large - t_strip_small) / (512 * 60 - 6 * 2));
+  model->residual_block = nonnegative(t_strip_small - model->residual_element * 6 * 2);
+  return 0;
+}
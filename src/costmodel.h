@@ -0,0 +1,46 @@
+#ifndef _WAVEMOTH_COSTMODEL_H_
+#define _WAVEMOTH_COSTMODEL_H_
+
+#include <stddef.h>
+
+/*
+Cost model used by the precomputation (precompute.h) to choose how
+many levels of butterfly compression to keep for each matrix. The
+estimated time to apply a matrix is
+
+    sum over interpolation blocks (n columns, k of them kept) of
+        ip_element * k * (n - k) + ip_row * n + ip_block
+  + sum over residual blocks (nrows x ncols) of
+        residual_element * nrows * ncols + residual_block
+
+i.e. the dgemm and the scatters of transpose_apply_interpolation_block
+in butterfly.c, and the Legendre recurrence of
+pull_a_through_legendre_block in wavemoth.c. Only the ratios matter.
+*/
+
+typedef struct {
+  double ip_element, ip_row, ip_block;
+  double residual_element, residual_block;
+} wavemoth_cost_model_t;
+
+/*
+The hand-set model of ResourceComputer, where an interpolation
+matrix element (or filter entry) costs 1 and a residual element
+3.5 / memop_cost.
+*/
+void wavemoth_cost_model_from_memop(wavemoth_cost_model_t *model, double memop_cost);
+
+/*
+Measure the model on this host, in seconds, by timing the kernels
+applied at runtime with nvecs vectors (even; 2 * nmaps in wavemoth.c).
+The interpolation matrices are streamed from a buffer larger than the
+caches, as they are when applying a resource file. Takes about a
+second. Returns -1 if out of memory.
+*/
+int wavemoth_calibrate_cost_model(wavemoth_cost_model_t *model, size_t nvecs);
+
+double wavemoth_ip_block_cost(const wavemoth_cost_model_t *model, size_t n, size_t k);
+double wavemoth_residual_block_cost(const wavemoth_cost_model_t *model,
+                                    size_t nrows, size_t ncols);
+
+#endif
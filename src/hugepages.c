@@ -0,0 +1,77 @@
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <numa.h>
+
+#include "hugepages.h"
+
+#ifndef MAP_HUGE_SHIFT
+#define MAP_HUGE_SHIFT 26
+#endif
+#ifndef MAP_HUGE_2MB
+#define MAP_HUGE_2MB (21 << MAP_HUGE_SHIFT)
+#endif
+#ifndef MAP_HUGE_1GB
+#define MAP_HUGE_1GB (30 << MAP_HUGE_SHIFT)
+#endif
+
+#define HUGE_2MB ((size_t)1 << 21)
+#define HUGE_1GB ((size_t)1 << 30)
+
+static size_t round_up(size_t size, size_t align) {
+  return (size + align - 1) & ~(align - 1);
+}
+
+static void *map_anonymous(size_t size, int extra_flags) {
+  void *p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS | extra_flags, -1, 0);
+  return (p == MAP_FAILED) ? NULL : p;
+}
+
+/* Anonymous mapping aligned to 2 MB, so that THP can back all of it */
+static void *map_thp(size_t size) {
+  char *p = map_anonymous(size + HUGE_2MB, 0), *aligned;
+  if (p == NULL) return NULL;
+  aligned = (char*)round_up((size_t)p, HUGE_2MB);
+  if (aligned != p) munmap(p, aligned - p);
+  munmap(aligned + size, (p + size + HUGE_2MB) - (aligned + size));
+#ifdef MADV_HUGEPAGE
+  madvise(aligned, size, MADV_HUGEPAGE);
+#endif
+  return aligned;
+}
+
+void *wavemoth_alloc_large(size_t size, int node_id, int use_hugepages,
+                           size_t *mapped_size) {
+  void *p = NULL;
+  if (size == 0) size = 1;
+  if (use_hugepages) {
+    if (size >= HUGE_1GB) {
+      *mapped_size = round_up(size, HUGE_1GB);
+      p = map_anonymous(*mapped_size, MAP_HUGETLB | MAP_HUGE_1GB);
+    }
+    if (p == NULL) {
+      *mapped_size = round_up(size, HUGE_2MB);
+      p = map_anonymous(*mapped_size, MAP_HUGETLB | MAP_HUGE_2MB);
+    }
+    if (p == NULL) {
+      *mapped_size = round_up(size, HUGE_2MB);
+      p = map_thp(*mapped_size);
+    }
+  } else {
+    *mapped_size = round_up(size, getpagesize());
+    p = map_anonymous(*mapped_size, 0);
+  }
+  if (p != NULL && node_id >= 0) {
+    /* Pages are not faulted yet, so they will be placed on the node */
+    numa_tonode_memory(p, *mapped_size, node_id);
+  }
+  return p;
+}
+
+void wavemoth_free_large(void *ptr, size_t mapped_size) {
+  if (ptr != NULL) munmap(ptr, mapped_size);
+}
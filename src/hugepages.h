@@ -0,0 +1,26 @@
+#ifndef _WAVEMOTH_HUGEPAGES_H_
+#define _WAVEMOTH_HUGEPAGES_H_
+
+#include <stddef.h>
+
+/*
+Allocation of large, long-lived buffers (resource copies, work
+buffers). With use_hugepages, explicit hugetlbfs pages are tried first
+(1 GB pages for buffers of at least 1 GB, then 2 MB pages); these must
+have been reserved by the administrator, see
+/proc/sys/vm/nr_hugepages. If none are available we fall back to an
+anonymous mapping aligned to 2 MB and marked MADV_HUGEPAGE, so that
+transparent huge pages can back it.
+
+Without use_hugepages, a plain anonymous mapping is used.
+
+If node_id >= 0 the memory is bound to that NUMA node. The result is
+aligned to at least the page size, and must be released with
+wavemoth_free_large passing the size returned in *mapped_size. Returns
+NULL on failure.
+*/
+void *wavemoth_alloc_large(size_t size, int node_id, int use_hugepages,
+                           size_t *mapped_size);
+void wavemoth_free_large(void *ptr, size_t mapped_size);
+
+#endif
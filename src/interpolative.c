@@ -0,0 +1,330 @@
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "interpolative.h"
+#include "blas.h"
+
+/*
+Port of libidlight (idd_house.f, idd_qrpiv.f, idd_id.f). Matrices are
+column-major; A(i, j) is a[i + j * m].
+*/
+
+/*
+idd_house: Householder reflection taking x to (rss, 0, ..., 0). On
+return x[0] holds rss and x[1:] the normalized reflector vn (with an
+implied leading 1).
+*/
+static void house(int n, double *x, double *scal) {
+  double x1 = x[0], sum = 0, rss, v1;
+  if (n == 1) {
+    *scal = 0;
+    return;
+  }
+  for (int k = 1; k != n; ++k) sum += x[k] * x[k];
+  if (sum == 0) {
+    *scal = 0;
+    return;
+  }
+  rss = sqrt(x1 * x1 + sum);
+  v1 = (x1 <= 0) ? x1 - rss : -sum / (x1 + rss);
+  for (int k = 1; k != n; ++k) x[k] /= v1;
+  *scal = 2 * v1 * v1 / (v1 * v1 + sum);
+  x[0] = rss;
+}
+
+/* idd_houseapp, in place and with a given scal */
+static void houseapp(int n, const double *vn, double *u, double scal) {
+  double fact;
+  if (n == 1) return;
+  fact = u[0];
+  for (int k = 1; k != n; ++k) fact += vn[k - 1] * u[k];
+  fact *= scal;
+  u[0] -= fact;
+  for (int k = 1; k != n; ++k) u[k] -= fact * vn[k - 1];
+}
+
+static void swap_columns(int m, double *a, int i, int j) {
+  double *ci = a + (size_t)i * m, *cj = a + (size_t)j * m;
+  for (int r = 0; r != m; ++r) {
+    double t = ci[r];
+    ci[r] = cj[r];
+    cj[r] = t;
+  }
+}
+
+/* iddp_qrpiv: pivoted QR, stopping at relative precision eps */
+static int qrpiv(double eps, int m, int n, double *a, int *ind, double *ss) {
+  const double feps = 1e-17;
+  double ssmax = 0, ssmaxin, scal, t;
+  int kpiv = 0, krank = 0, nupdate = 0;
+
+  for (int k = 0; k != n; ++k) {
+    double *col = a + (size_t)k * m;
+    ss[k] = 0;
+    for (int j = 0; j != m; ++j) ss[k] += col[j] * col[j];
+    if (ss[k] > ssmax) {
+      ssmax = ss[k];
+      kpiv = k;
+    }
+  }
+  ssmaxin = ssmax;
+
+  while (!(ssmax <= eps * eps * ssmaxin || krank >= m || krank >= n)) {
+    int r = krank++;
+    int mm = m - r;
+    ind[r] = kpiv;
+    swap_columns(m, a, r, kpiv);
+    t = ss[r];
+    ss[r] = ss[kpiv];
+    ss[kpiv] = t;
+    if (krank < m) {
+      double *diag = a + r + (size_t)r * m;
+      house(mm, diag, &scal);
+      for (int k = r + 1; k < n; ++k) {
+        houseapp(mm, diag + 1, a + r + (size_t)k * m, scal);
+      }
+      for (int k = r; k < n; ++k) {
+        double x = a[r + (size_t)k * m];
+        ss[k] -= x * x;
+      }
+      ssmax = 0;
+      kpiv = r + 1;
+      for (int k = r + 1; k < n; ++k) {
+        if (ss[k] > ssmax) {
+          ssmax = ss[k];
+          kpiv = k;
+        }
+      }
+      /* Recompute the norms when cancellation has eaten the precision */
+      if ((ssmax < 1000 * feps * ssmaxin && nupdate == 0) ||
+          (ssmax < (1000 * feps) * (1000 * feps) * ssmaxin && nupdate == 1)) {
+        nupdate++;
+        ssmax = 0;
+        kpiv = r + 1;
+        for (int k = r + 1; k < n; ++k) {
+          double *col = a + (size_t)k * m;
+          ss[k] = 0;
+          for (int j = r + 1; j < m; ++j) ss[k] += col[j] * col[j];
+          if (ss[k] > ssmax) {
+            ssmax = ss[k];
+            kpiv = k;
+          }
+        }
+      }
+    }
+  }
+  return krank;
+}
+
+/* idd_lssolve followed by idd_moverup */
+static void lssolve(int m, int n, double *a, int krank) {
+  for (int k = 0; k != n - krank; ++k) {
+    double *col = a + (size_t)(krank + k) * m;
+    for (int j = krank - 1; j >= 0; --j) {
+      double sum = 0;
+      for (int l = j + 1; l < krank; ++l) sum += a[j + (size_t)l * m] * col[l];
+      col[j] -= sum;
+      double diag = a[j + (size_t)j * m];
+      if (fabs(col[j]) < 1048576.0 * fabs(diag)) {
+        col[j] /= diag;
+      } else {
+        col[j] = 0;
+      }
+    }
+  }
+  for (int k = 0; k != n - krank; ++k) {
+    for (int j = 0; j != krank; ++j) {
+      a[j + (size_t)krank * k] = a[j + (size_t)m * (krank + k)];
+    }
+  }
+}
+
+int wavemoth_iddp_id(double eps, int m, int n, double *a, int *list, double *rnorms) {
+  int krank = qrpiv(eps, m, n, a, list, rnorms);
+  /* Turn the pivots into a permutation; rnorms is scratch space */
+  for (int k = 0; k != n; ++k) rnorms[k] = k;
+  for (int k = 0; k != krank; ++k) {
+    double t = rnorms[k];
+    rnorms[k] = rnorms[list[k]];
+    rnorms[list[k]] = t;
+  }
+  for (int k = 0; k != n; ++k) list[k] = (int)rnorms[k];
+  for (int k = 0; k != krank; ++k) rnorms[k] = a[k + (size_t)k * m];
+  if (krank > 0) lssolve(m, n, a, krank);
+  return krank;
+}
+
+int wavemoth_sparse_id(double eps, int m, int n, double *a, int *iden_list,
+                       int *ipol_list, double *A_ip) {
+  int krank, *list, *rank;
+  double *rnorms;
+  char *selected;
+  if (n == 0) return 0;
+  list = malloc(sizeof(int[n]));
+  rank = malloc(sizeof(int[n]));
+  selected = malloc(n);
+  rnorms = malloc(sizeof(double[n]));
+  if (list == NULL || rank == NULL || selected == NULL || rnorms == NULL) {
+    krank = -1;
+    goto FINALLY;
+  }
+  krank = wavemoth_iddp_id(eps, m, n, a, list, rnorms);
+
+  /* Sort both index lists by marking the selected columns, and permute
+     the rows and columns of the interpolation matrix accordingly */
+  memset(selected, 0, n);
+  for (int k = 0; k != krank; ++k) selected[list[k]] = 1;
+  for (int j = 0, ki = 0, kp = 0; j != n; ++j) {
+    if (selected[j]) {
+      iden_list[ki] = j;
+      rank[j] = ki++;
+    } else {
+      ipol_list[kp] = j;
+      rank[j] = kp++;
+    }
+  }
+  for (int j = 0; j != n - krank; ++j) {
+    int dst_col = rank[list[krank + j]];
+    for (int i = 0; i != krank; ++i) {
+      A_ip[rank[list[i]] + (size_t)dst_col * krank] = a[i + (size_t)j * krank];
+    }
+  }
+ FINALLY:
+  free(list);
+  free(rank);
+  free(selected);
+  free(rnorms);
+  return krank;
+}
+
+/*
+Randomized ID
+*/
+
+#define RID_MIN_SKETCH 32
+#define RID_OVERSAMPLING 8
+#define RID_SKETCH_NNZ 8
+/* The sketch is decomposed at eps / RID_SKETCH_MARGIN, so that the
+   residual check of A rarely fails */
+#define RID_SKETCH_MARGIN 2.0
+
+static int imax(int a, int b) {
+  return (a > b) ? a : b;
+}
+
+static uint64_t splitmix64(uint64_t *state) {
+  uint64_t z = (*state += 0x9E3779B97F4A7C15ULL);
+  z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+  z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+  return z ^ (z >> 31);
+}
+
+/*
+Sketch Y = Omega * A, Omega (l-by-m) being a sparse sign matrix with
+RID_SKETCH_NNZ random signs in each column at random rows, which
+costs RID_SKETCH_NNZ * m * n flops rather than the l * m * n of a
+dense projection.
+*/
+static void sparse_sign_sketch(uint64_t *state, int l, int m, int n, const double *a,
+                               double *Y, int *rows, double *signs) {
+  /* l >= RID_OVERSAMPLING + 1 > RID_SKETCH_NNZ; the inner loop has a fixed
+     trip count and is unrolled */
+  for (int i = 0; i != m; ++i) {
+    uint64_t bits = splitmix64(state);
+    for (int t = 0; t != RID_SKETCH_NNZ; ++t) {
+      rows[i * RID_SKETCH_NNZ + t] = splitmix64(state) % l;
+      signs[i * RID_SKETCH_NNZ + t] = (bits >> t) & 1 ? 1.0 : -1.0;
+    }
+  }
+  memset(Y, 0, sizeof(double[(size_t)l * n]));
+  for (int j = 0; j != n; ++j) {
+    const double *col = a + (size_t)j * m;
+    double *y = Y + (size_t)j * l;
+    for (int i = 0; i != m; ++i) {
+      const int *r = rows + i * RID_SKETCH_NNZ;
+      const double *s = signs + i * RID_SKETCH_NNZ;
+      double x = col[i];
+      for (int t = 0; t != RID_SKETCH_NNZ; ++t) y[r[t]] += s[t] * x;
+    }
+  }
+}
+
+/*
+Check the ID against the bound of the deterministic ID: every column
+of A[:, ipol] - A[:, iden] * A_ip must have norm below eps times the
+largest column of A. Computed exactly (one dgemm of m * k * (n - k)
+flops), so that a randomized ID is never accepted with a larger
+residual than wavemoth_sparse_id would leave. work needs room for
+m * n elements.
+*/
+static int residual_within(double eps, int m, int n, const double *a, int k,
+                           const int *iden_list, const int *ipol_list,
+                           double *A_ip, double max_norm2, double *work) {
+  double *Ak = work, *R = work + (size_t)m * k;
+  if (k == n) return 1;
+  for (int i = 0; i != k; ++i) {
+    memcpy(Ak + (size_t)i * m, a + (size_t)iden_list[i] * m, sizeof(double[m]));
+  }
+  for (int j = 0; j != n - k; ++j) {
+    memcpy(R + (size_t)j * m, a + (size_t)ipol_list[j] * m, sizeof(double[m]));
+  }
+  if (k > 0) dgemm('N', 'N', m, n - k, k, -1.0, Ak, m, A_ip, k, 1.0, R, m);
+  for (int j = 0; j != n - k; ++j) {
+    double s = 0;
+    for (int i = 0; i != m; ++i) s += R[i + (size_t)j * m] * R[i + (size_t)j * m];
+    if (s > eps * eps * max_norm2) return 0;
+  }
+  return 1;
+}
+
+int wavemoth_sparse_id_randomized(double eps, int m, int n, double *a, int *iden_list,
+                                  int *ipol_list, double *A_ip, int rank_hint,
+                                  uint64_t *rng_state) {
+  double *signs = NULL, *sketch = NULL, *work = NULL, max_norm2 = 0;
+  int *rows = NULL;
+  int l, l_max = n + RID_OVERSAMPLING, krank = -1;
+
+  if (n == 0) return 0;
+  l = rank_hint + RID_OVERSAMPLING;
+  if (l < RID_MIN_SKETCH) l = RID_MIN_SKETCH;
+  if (l > l_max) l = l_max;
+  if (2 * l > m) return wavemoth_sparse_id(eps, m, n, a, iden_list, ipol_list, A_ip);
+  work = malloc(sizeof(double[(size_t)m * n]));
+  rows = malloc(sizeof(int[(size_t)m * RID_SKETCH_NNZ]));
+  signs = malloc(sizeof(double[(size_t)m * RID_SKETCH_NNZ]));
+  if (work == NULL || rows == NULL || signs == NULL) goto FINALLY;
+  for (int j = 0; j != n; ++j) {
+    double s = 0;
+    for (int i = 0; i != m; ++i) s += a[i + (size_t)j * m] * a[i + (size_t)j * m];
+    if (s > max_norm2) max_norm2 = s;
+  }
+
+  while (2 * l <= m) {
+    sketch = malloc(sizeof(double[(size_t)l * n]));
+    if (sketch == NULL) goto FINALLY;
+    sparse_sign_sketch(rng_state, l, m, n, a, sketch, rows, signs);
+    krank = wavemoth_sparse_id(eps / RID_SKETCH_MARGIN, l, n, sketch, iden_list, ipol_list,
+                               A_ip);
+    free(sketch);
+    sketch = NULL;
+    if (krank < 0) goto FINALLY;
+    /* The rank must not be limited by the sketch size, and the
+       residual must be within the bound of the deterministic ID */
+    if ((krank + RID_OVERSAMPLING <= l || krank == n) &&
+        residual_within(eps, m, n, a, krank, iden_list, ipol_list, A_ip, max_norm2, work)) {
+      goto FINALLY;
+    }
+    if (l == l_max) break;
+    l = imax(l + l / 2, krank + 2 * RID_OVERSAMPLING);
+    if (l > l_max) l = l_max;
+  }
+  /* The sketch would not be much smaller than the matrix */
+  krank = wavemoth_sparse_id(eps, m, n, a, iden_list, ipol_list, A_ip);
+ FINALLY:
+  free(sketch);
+  free(rows);
+  free(signs);
+  free(work);
+  return krank;
+}
@@ -0,0 +1,57 @@
+#ifndef _WAVEMOTH_INTERPOLATIVE_H_
+#define _WAVEMOTH_INTERPOLATIVE_H_
+
+#include <stdint.h>
+
+/*
+Interpolative decomposition (ID) of a matrix; a C port of iddp_id
+from libidlight. The Fortran routines keep their locals in static
+storage (SAVE), so they can not be called from several threads at
+once; these can.
+
+All matrices are column-major.
+*/
+
+/*
+Same contract as iddp_id, except that indices are 0-based: a is the
+m-by-n matrix to decompose (destroyed). On return, list[:krank] are
+the columns selected, and the first krank*(n-krank) elements of a hold
+the krank-by-(n-krank) interpolation matrix expressing columns
+list[krank:] in terms of them. rnorms must have room for n elements.
+Returns krank.
+*/
+int wavemoth_iddp_id(double eps, int m, int n, double *a, int *list, double *rnorms);
+
+/*
+The sparse form used by the butterfly compression (see
+sparse_interpolative_decomposition in interpolative_decomposition.pyx):
+
+    A[:, ipol_list] ~= A[:, iden_list] * A_ip
+
+with iden_list (krank entries) and ipol_list (n - krank entries) in
+increasing order. a is destroyed; A_ip is krank-by-(n-krank) and must
+have room for n * n / 4 elements. Returns krank, or -1 if out of
+memory.
+*/
+int wavemoth_sparse_id(double eps, int m, int n, double *a, int *iden_list,
+                       int *ipol_list, double *A_ip);
+
+/*
+Randomized variant of wavemoth_sparse_id, for tall matrices of low
+rank: the ID is computed from the sketch Omega * A, Omega being a
+sparse l-by-m matrix with a few random signs per column. l starts at
+rank_hint + 8 (at least 32) and grows by half until the rank found
+leaves enough oversampling and every residual column is within the
+bound of the deterministic ID (norm below eps times the largest column
+of a), which is checked exactly.
+When the sketch would not be much smaller than a, falls back to
+wavemoth_sparse_id. Output as for wavemoth_sparse_id; a is destroyed.
+
+*rng_state is the state of the random number generator (any seed),
+updated on return, so that results are reproducible.
+*/
+int wavemoth_sparse_id_randomized(double eps, int m, int n, double *a, int *iden_list,
+                                  int *ipol_list, double *A_ip, int rank_hint,
+                                  uint64_t *rng_state);
+
+#endif
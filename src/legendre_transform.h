@@ -16,6 +16,9 @@ even or odd l's.
 void wavemoth_legendre_transform_auxdata(size_t m, size_t lmin, size_t nk,
                                         double *auxdata);
 
+void wavemoth_legendre_transform_first_step(size_t m, size_t lmin,
+                                           double *alpha, double *beta);
+
 void wavemoth_legendre_transform(size_t nx, size_t nl,
                                 size_t nvecs,
                                 double *a_l,
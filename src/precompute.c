@@ -0,0 +1,1599 @@
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <malloc.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#include <emmintrin.h>
+
+#include "precompute.h"
+#include "costmodel.h"
+#include "interpolative.h"
+#include "taskpool.h"
+#include "legendre_transform.h"
+#include "ylmgen_c.h"
+
+/* Thresholds of the Legendre payloads, as in LegendreMatrixProvider */
+#define BLOCK_EPS 1e-30
+#define PAYLOAD_EPS 1e-300
+#define STRIP_INCLUDE_ABOVE 1e-30
+#define STRIP_EXCLUDE_BELOW 1e-250
+#define STRIP_COL_DIVISOR 6
+/* Strip cost model, see strip_cost */
+#define STRIP_CALL_COST 50.0
+#define STRIP_PACK_COST 0.5
+#define MAX_STABILITY_ERROR 1e-9
+/* Columns of the Legendre matrix per task; even, to keep SSE2 ring pairs */
+#define LEGENDRE_TASK_COLS 256
+
+static double walltime(void) {
+  struct timespec tv;
+  clock_gettime(CLOCK_REALTIME, &tv);
+  return tv.tv_sec + 1e-9 * tv.tv_nsec;
+}
+
+void wavemoth_precompute_default_options(wavemoth_precompute_options_t *opts, int Nside) {
+  opts->Nside = Nside;
+  opts->lmax = opts->mmax = 2 * Nside;
+  opts->chunk_size = 64;
+  opts->eps = 1e-10;
+  opts->memop_cost = 20;
+  opts->cost_model = NULL;
+  opts->randomized = 0;
+  opts->m_stride = 1;
+  opts->nthreads = 0;
+  opts->verbose = 0;
+}
+
+/*
+Output stream. Alignment (pad128) is relative to the start of the
+stream, which is placed on a 16-byte boundary in the file.
+*/
+typedef struct {
+  char *data;
+  size_t len, cap;
+  int failed;
+} stream_t;
+
+static void stream_write(stream_t *s, const void *src, size_t n) {
+  if (s->failed) return;
+  if (s->len + n > s->cap) {
+    size_t cap = s->cap * 2 + n + 4096;
+    char *data = realloc(s->data, cap);
+    if (data == NULL) {
+      s->failed = 1;
+      return;
+    }
+    s->data = data;
+    s->cap = cap;
+  }
+  memcpy(s->data + s->len, src, n);
+  s->len += n;
+}
+
+static void stream_pad128(stream_t *s) {
+  static const char zeros[16];
+  if (s->len % 16 != 0) stream_write(s, zeros, 16 - s->len % 16);
+}
+
+static void stream_int32(stream_t *s, int32_t x) {
+  stream_write(s, &x, sizeof(x));
+}
+
+static void stream_int64(stream_t *s, int64_t x) {
+  stream_write(s, &x, sizeof(x));
+}
+
+static void stream_patch_int64(stream_t *s, size_t pos, int64_t x) {
+  if (!s->failed) memcpy(s->data + pos, &x, sizeof(x));
+}
+
+static void stream_aligned_array(stream_t *s, const double *x, size_t n) {
+  stream_pad128(s);
+  stream_write(s, x, sizeof(double[n]));
+}
+
+/*
+The Legendre matrix of one (m, odd), computed once with eps=1e-300
+and kept column-major. Blocks used for compression are truncated at
+1e-30 as if computed with that eps: entries for l below the first l
+(of either parity) where the column exceeds 1e-30 are zero.
+*/
+typedef struct {
+  int m, odd, lmax;
+  size_t nk, ncols;
+  double *thetas, *x_squared; /* [ncols] */
+  double *Lambda; /* [nk, ncols] */
+  int *firstl_block; /* [ncols] */
+} legendre_matrix_t;
+
+static size_t row_to_l(legendre_matrix_t *L, size_t row) {
+  return L->m + 2 * row + L->odd;
+}
+
+/* Rings on the northern hemisphere, starting at the equator */
+static double healpix_ring_theta(int Nside, size_t j) {
+  size_t i = 2 * Nside - j;
+  double z;
+  if (i <= (size_t)Nside) {
+    z = 1 - (double)(i * i) / (3.0 * Nside * Nside);
+  } else {
+    z = 4.0 / 3.0 - (2.0 * i) / (3.0 * Nside);
+  }
+  return acos(z);
+}
+
+static void healpix_ring_thetas(int Nside, double *thetas) {
+  for (size_t j = 0; j != 2 * (size_t)Nside; ++j) thetas[j] = healpix_ring_theta(Nside, j);
+}
+
+void wavemoth_precompute_ring_x_squared(int Nside, double *x_squared) {
+  for (size_t j = 0; j != 2 * (size_t)Nside; ++j) {
+    double x = cos(healpix_ring_theta(Nside, j));
+    x_squared[j] = x * x;
+  }
+}
+
+static void store_column(legendre_matrix_t *L, size_t col, const double *ylm, int firstl) {
+  /* Per column, what the scalar recurrence would give: zero below
+     the first l exceeding eps */
+  int lmax = L->lmax, l, first_payload = lmax + 1, first_block = lmax + 1;
+  for (l = (firstl > L->m) ? firstl : L->m; l <= lmax; ++l) {
+    if (fabs(ylm[l]) > PAYLOAD_EPS) {
+      first_payload = l;
+      break;
+    }
+  }
+  for (; l <= lmax; ++l) {
+    if (fabs(ylm[l]) > BLOCK_EPS) {
+      first_block = l;
+      break;
+    }
+  }
+  L->firstl_block[col] = first_block;
+  for (size_t k = 0; k != L->nk; ++k) {
+    int lk = row_to_l(L, k);
+    L->Lambda[k + col * L->nk] = (lk < first_payload) ? 0 : ylm[lk];
+  }
+}
+
+typedef struct {
+  legendre_matrix_t *L;
+  size_t start, stop;
+  int failed;
+} legendre_task_t;
+
+/* Columns [start, stop) of L; start is even */
+static void legendre_columns_task(void *arg) {
+  legendre_task_t *task = arg;
+  legendre_matrix_t *L = task->L;
+  int lmax = L->lmax;
+  Ylmgen_C gen;
+  double *ylm[2];
+  ylm[0] = malloc(sizeof(double[lmax + 1]));
+  ylm[1] = malloc(sizeof(double[lmax + 1]));
+  if (ylm[0] == NULL || ylm[1] == NULL) {
+    task->failed = 1;
+    goto FINALLY;
+  }
+  /* Two rings at a time with the SSE2 recurrence */
+  Ylmgen_init(&gen, lmax, lmax, 0, 0, PAYLOAD_EPS);
+  Ylmgen_set_theta(&gen, L->thetas + task->start, task->stop - task->start);
+  for (size_t j = task->start; j < task->stop; j += 2) {
+    size_t j2 = (j + 1 < task->stop) ? j + 1 : j;
+    Ylmgen_prepare_sse2(&gen, j - task->start, j2 - task->start, L->m);
+    Ylmgen_recalc_Ylm_sse2(&gen);
+    int firstl = gen.firstl[0];
+    for (int l = firstl; l <= lmax; ++l) {
+      double pair[2];
+      _mm_storeu_pd(pair, gen.ylm_sse2[l]);
+      ylm[0][l] = pair[0];
+      ylm[1][l] = pair[1];
+    }
+    store_column(L, j, ylm[0], firstl);
+    if (j2 != j) store_column(L, j2, ylm[1], firstl);
+  }
+  Ylmgen_destroy(&gen);
+ FINALLY:
+  free(ylm[0]);
+  free(ylm[1]);
+}
+
+static int compute_legendre_matrix(legendre_matrix_t *L, wavemoth_taskpool_t *pool,
+                                   int Nside, int lmax, int m, int odd) {
+  wavemoth_taskgroup_t group = {0};
+  legendre_task_t *tasks;
+  size_t ntasks;
+  int ret = 0;
+  L->m = m;
+  L->odd = odd;
+  L->lmax = lmax;
+  L->nk = (lmax - m - odd < 0) ? 0 : (lmax - m - odd) / 2 + 1;
+  L->ncols = 2 * Nside;
+  L->thetas = malloc(sizeof(double[L->ncols]));
+  L->x_squared = malloc(sizeof(double[L->ncols]));
+  L->Lambda = malloc(sizeof(double[L->nk * L->ncols + 1]));
+  L->firstl_block = malloc(sizeof(int[L->ncols]));
+  ntasks = (L->ncols + LEGENDRE_TASK_COLS - 1) / LEGENDRE_TASK_COLS;
+  tasks = malloc(sizeof(legendre_task_t[ntasks]));
+  if (!L->thetas || !L->x_squared || !L->Lambda || !L->firstl_block || !tasks) {
+    free(tasks);
+    return -1;
+  }
+  healpix_ring_thetas(Nside, L->thetas);
+  wavemoth_precompute_ring_x_squared(Nside, L->x_squared);
+
+  for (size_t i = 0; i != ntasks; ++i) {
+    size_t stop = (i + 1) * LEGENDRE_TASK_COLS;
+    tasks[i] = (legendre_task_t){L, i * LEGENDRE_TASK_COLS,
+                                 (stop < L->ncols) ? stop : L->ncols, 0};
+    wavemoth_taskpool_spawn(pool, &group, legendre_columns_task, &tasks[i]);
+  }
+  wavemoth_taskpool_wait(pool, &group);
+  for (size_t i = 0; i != ntasks; ++i) {
+    if (tasks[i].failed) ret = -1;
+  }
+  free(tasks);
+  return ret;
+}
+
+static void free_legendre_matrix(legendre_matrix_t *L) {
+  free(L->thetas);
+  free(L->x_squared);
+  free(L->Lambda);
+  free(L->firstl_block);
+}
+
+/* out[rows, ncols] = block of Lambda as used for compression */
+static void get_block(legendre_matrix_t *L, size_t row_start, size_t row_stop,
+                      const int *cols, size_t ncols, double *out) {
+  size_t nrows = row_stop - row_start;
+  for (size_t j = 0; j != ncols; ++j) {
+    double *src = L->Lambda + cols[j] * L->nk;
+    for (size_t k = row_start; k != row_stop; ++k) {
+      out[(k - row_start) + j * nrows] =
+        ((int)row_to_l(L, k) < L->firstl_block[cols[j]]) ? 0 : src[k];
+    }
+  }
+}
+
+/*
+Butterfly tree, as the InnerNode/IdentityNode of butterfly.pyx. Leaves
+have one block (of height ncols) and no interpolation blocks. The
+remainder blocks partition the rows; those of the roots chosen for
+serialization become the residual payloads.
+*/
+typedef struct {
+  size_t row_start, row_stop, ncols;
+  int *cols;
+} remainder_t;
+
+typedef struct {
+  size_t n, k;
+  char *filter;
+  double *interpolant; /* [k, n - k] */
+} ip_block_t;
+
+typedef struct _tree_node {
+  size_t ncols;
+  size_t nblocks;
+  size_t *block_heights;
+  remainder_t *remainders;
+  ip_block_t *blocks; /* [nblocks], NULL for leaves */
+  struct _tree_node *children[2];
+} tree_node_t;
+
+static void free_tree(tree_node_t *node) {
+  if (node == NULL) return;
+  for (size_t i = 0; i != node->nblocks; ++i) {
+    free(node->remainders[i].cols);
+    if (node->blocks != NULL) {
+      free(node->blocks[i].filter);
+      free(node->blocks[i].interpolant);
+    }
+  }
+  free(node->block_heights);
+  free(node->remainders);
+  free(node->blocks);
+  free_tree(node->children[0]);
+  free_tree(node->children[1]);
+  free(node);
+}
+
+static tree_node_t *alloc_node(size_t nblocks, int is_leaf) {
+  tree_node_t *node = calloc(1, sizeof(tree_node_t));
+  if (node == NULL) return NULL;
+  node->nblocks = nblocks;
+  node->block_heights = calloc(nblocks, sizeof(size_t));
+  node->remainders = calloc(nblocks, sizeof(remainder_t));
+  node->blocks = is_leaf ? NULL : calloc(nblocks, sizeof(ip_block_t));
+  if (node->block_heights == NULL || node->remainders == NULL ||
+      (!is_leaf && node->blocks == NULL)) {
+    free_tree(node);
+    return NULL;
+  }
+  return node;
+}
+
+typedef struct {
+  legendre_matrix_t *L;
+  wavemoth_taskpool_t *pool;
+  double eps;
+  int randomized;
+  uint64_t seed;
+} compress_ctx_t;
+
+static tree_node_t *butterfly_core(compress_ctx_t *ctx, size_t col, size_t nrows,
+                                   const size_t *partition, size_t npartition,
+                                   double ***residuals);
+
+/* butterfly_core of one child, as a task */
+typedef struct {
+  compress_ctx_t *ctx;
+  size_t col, nrows;
+  const size_t *partition;
+  size_t npartition;
+  tree_node_t *node;
+  double **residuals;
+} core_task_t;
+
+static void butterfly_core_task(void *arg) {
+  core_task_t *task = arg;
+  task->node = butterfly_core(task->ctx, task->col, task->nrows, task->partition,
+                              task->npartition, &task->residuals);
+}
+
+/*
+Join remainder blocks i of the two children of node and compress the
+top and bottom halves, as a task. res_left[i] and res_right[i] are
+consumed; the results go to blocks/remainders 2 * i and 2 * i + 1 of
+node, and to res[2 * i] and res[2 * i + 1].
+*/
+typedef struct {
+  compress_ctx_t *ctx;
+  tree_node_t *node;
+  double **res_left, **res_right, **res;
+  size_t i;
+  uint64_t rng_state;
+  int failed;
+} pair_task_t;
+
+static void compress_pair_task(void *arg) {
+  pair_task_t *task = arg;
+  compress_ctx_t *ctx = task->ctx;
+  tree_node_t *node = task->node;
+  size_t i = task->i;
+  remainder_t *rl = &node->children[0]->remainders[i];
+  remainder_t *rr = &node->children[1]->remainders[i];
+  size_t rows = rl->row_stop - rl->row_start;
+  size_t n = rl->ncols + rr->ncols;
+  double *X, *Xid, *A_ip;
+  int *iden, *ipol, *lr_cols;
+
+  /* Horizontal join of the two residuals */
+  X = malloc(sizeof(double[rows * n + 1]));
+  Xid = malloc(sizeof(double[rows * n + 1]));
+  A_ip = malloc(sizeof(double[n * n / 4 + 1]));
+  iden = malloc(sizeof(int[n + 1]));
+  ipol = malloc(sizeof(int[n + 1]));
+  lr_cols = malloc(sizeof(int[n + 1]));
+  if (!X || !Xid || !A_ip || !iden || !ipol || !lr_cols) goto ERROR;
+  memcpy(X, task->res_left[i], sizeof(double[rows * rl->ncols]));
+  memcpy(X + rows * rl->ncols, task->res_right[i], sizeof(double[rows * rr->ncols]));
+  memcpy(lr_cols, rl->cols, sizeof(int[rl->ncols]));
+  memcpy(lr_cols + rl->ncols, rr->cols, sizeof(int[rr->ncols]));
+  free(task->res_left[i]);
+  free(task->res_right[i]);
+  task->res_left[i] = task->res_right[i] = NULL;
+
+  /* Vertical split and compress */
+  size_t vmid = rows / 2;
+  for (int half = 0; half != 2; ++half) {
+    size_t r0 = half ? vmid : 0, hr = half ? rows - vmid : vmid;
+    size_t idx = 2 * i + half;
+    for (size_t j = 0; j != n; ++j) {
+      memcpy(Xid + j * hr, X + j * rows + r0, sizeof(double[hr]));
+    }
+    int k = ctx->randomized ?
+      wavemoth_sparse_id_randomized(ctx->eps, hr, n, Xid, iden, ipol, A_ip,
+                                    (rl->ncols > rr->ncols) ? rl->ncols : rr->ncols,
+                                    &task->rng_state) :
+      wavemoth_sparse_id(ctx->eps, hr, n, Xid, iden, ipol, A_ip);
+    if (k < 0) goto ERROR;
+    ip_block_t *block = &node->blocks[idx];
+    block->n = n;
+    block->k = k;
+    block->filter = malloc(n + 1);
+    block->interpolant = malloc(sizeof(double[k * (n - k) + 1]));
+    remainder_t *rem = &node->remainders[idx];
+    rem->row_start = rl->row_start + r0;
+    rem->row_stop = rem->row_start + hr;
+    rem->ncols = k;
+    rem->cols = malloc(sizeof(int[k + 1]));
+    task->res[idx] = malloc(sizeof(double[hr * k + 1]));
+    if (!block->filter || !block->interpolant || !rem->cols || !task->res[idx]) goto ERROR;
+    memset(block->filter, 1, n);
+    for (int j = 0; j != k; ++j) {
+      block->filter[iden[j]] = 0;
+      rem->cols[j] = lr_cols[iden[j]];
+      memcpy(task->res[idx] + j * hr, X + iden[j] * rows + r0, sizeof(double[hr]));
+    }
+    memcpy(block->interpolant, A_ip, sizeof(double[k * (n - k)]));
+    node->block_heights[idx] = k;
+  }
+  goto FINALLY;
+ ERROR:
+  task->failed = 1;
+ FINALLY:
+  free(X);
+  free(Xid);
+  free(A_ip);
+  free(iden);
+  free(ipol);
+  free(lr_cols);
+}
+
+/*
+butterfly_core of butterfly.pyx. partition holds the end column of
+each leaf. On return, residuals[i] is the (rows x k) block of Lambda
+for remainder block i (column-major), to be freed by the caller.
+
+The two children are built concurrently, and so are the IDs of the
+remainder block pairs, as tasks in ctx->pool. With randomized IDs,
+each pair has its own random state derived from its position in the
+tree, so the result does not depend on the scheduling.
+*/
+static tree_node_t *butterfly_core(compress_ctx_t *ctx, size_t col, size_t nrows,
+                                   const size_t *partition, size_t npartition,
+                                   double ***residuals) {
+  wavemoth_taskgroup_t group = {0};
+  core_task_t left_task;
+  pair_task_t *pairs = NULL;
+  tree_node_t *node = NULL, *left = NULL, *right = NULL;
+  double **res_left = NULL, **res_right = NULL, **res = NULL;
+  *residuals = NULL;
+
+  if (npartition == 1) {
+    size_t ncols = partition[0] - col;
+    node = alloc_node(1, 1);
+    res = malloc(sizeof(double*[1]));
+    if (node == NULL || res == NULL) goto ERROR;
+    node->ncols = ncols;
+    node->block_heights[0] = ncols;
+    node->remainders[0] = (remainder_t){0, nrows, ncols, malloc(sizeof(int[ncols + 1]))};
+    res[0] = malloc(sizeof(double[nrows * ncols + 1]));
+    if (node->remainders[0].cols == NULL || res[0] == NULL) goto ERROR;
+    for (size_t j = 0; j != ncols; ++j) node->remainders[0].cols[j] = col + j;
+    get_block(ctx->L, 0, nrows, node->remainders[0].cols, ncols, res[0]);
+    *residuals = res;
+    return node;
+  }
+
+  size_t mid = npartition / 2;
+  left_task = (core_task_t){ctx, col, nrows, partition, mid, NULL, NULL};
+  wavemoth_taskpool_spawn(ctx->pool, &group, butterfly_core_task, &left_task);
+  right = butterfly_core(ctx, partition[mid - 1], nrows, partition + mid, npartition - mid,
+                         &res_right);
+  wavemoth_taskpool_wait(ctx->pool, &group);
+  left = left_task.node;
+  res_left = left_task.residuals;
+  if (left == NULL || right == NULL) goto ERROR;
+
+  size_t nb = left->nblocks;
+  node = alloc_node(2 * nb, 0);
+  if (node == NULL) goto ERROR;
+  node->ncols = left->ncols + right->ncols;
+  node->children[0] = left;
+  node->children[1] = right;
+  res = calloc(2 * nb, sizeof(double*));
+  pairs = malloc(sizeof(pair_task_t[nb]));
+  if (res == NULL || pairs == NULL) goto ERROR;
+
+  for (size_t i = 0; i != nb; ++i) {
+    uint64_t rng_state = ctx->seed;
+    rng_state = rng_state * 0x9E3779B97F4A7C15ULL + col;
+    rng_state = rng_state * 0x9E3779B97F4A7C15ULL + npartition;
+    rng_state = rng_state * 0x9E3779B97F4A7C15ULL + i;
+    pairs[i] = (pair_task_t){ctx, node, res_left, res_right, res, i, rng_state, 0};
+    wavemoth_taskpool_spawn(ctx->pool, &group, compress_pair_task, &pairs[i]);
+  }
+  wavemoth_taskpool_wait(ctx->pool, &group);
+  for (size_t i = 0; i != nb; ++i) {
+    if (pairs[i].failed) goto ERROR;
+  }
+  free(pairs);
+  free(res_left);
+  free(res_right);
+  *residuals = res;
+  return node;
+
+ ERROR:
+  free(pairs);
+  if (res_left != NULL) {
+    for (size_t i = 0; i != left->nblocks; ++i) free(res_left[i]);
+    free(res_left);
+  }
+  if (res_right != NULL) {
+    for (size_t i = 0; i != right->nblocks; ++i) free(res_right[i]);
+    free(res_right);
+  }
+  if (res != NULL) {
+    for (size_t i = 0; i != ((node != NULL) ? node->nblocks : 1); ++i) free(res[i]);
+    free(res);
+  }
+  if (node != NULL) {
+    free_tree(node);
+  } else {
+    free_tree(left);
+    free_tree(right);
+  }
+  return NULL;
+}
+
+/* make_partition followed by pad_with_empty_columns */
+static size_t make_partition(size_t ncols, size_t chunk_size, size_t **out) {
+  size_t n = 0, target = 1, to_add;
+  size_t *chunks = malloc(sizeof(size_t[ncols / chunk_size + 2]));
+  if (chunks == NULL) return 0;
+  for (size_t idx = chunk_size; idx < ncols; idx += chunk_size) chunks[n++] = idx;
+  if (n == 0 || chunks[n - 1] != ncols) chunks[n++] = ncols;
+  while (n > target) target *= 2;
+  to_add = target - n;
+  *out = malloc(sizeof(size_t[target]));
+  if (*out == NULL) {
+    free(chunks);
+    return 0;
+  }
+  for (size_t i = 0, j = 0; i != n; ++i) {
+    (*out)[j++] = chunks[i];
+    if (to_add > 0) {
+      (*out)[j++] = chunks[i];
+      --to_add;
+    }
+  }
+  free(chunks);
+  return target;
+}
+
+/*
+Tree statistics (get_stats of butterfly.pyx)
+*/
+
+static size_t tree_depth(tree_node_t *node) {
+  if (node->children[0] == NULL) return 0;
+  size_t a = tree_depth(node->children[0]), b = tree_depth(node->children[1]);
+  return 1 + ((a > b) ? a : b);
+}
+
+static size_t tree_size(tree_node_t *node) {
+  size_t size = 0;
+  if (node->children[0] == NULL) return 0;
+  for (size_t i = 0; i != node->nblocks; ++i) {
+    ip_block_t *b = &node->blocks[i];
+    size += b->k * (b->n - b->k) + b->n;
+  }
+  return size + tree_size(node->children[0]) + tree_size(node->children[1]);
+}
+
+static size_t tree_k_max(tree_node_t *node) {
+  size_t k_max = 0;
+  if (node->children[0] == NULL) return node->ncols;
+  for (size_t i = 0; i != node->nblocks; ++i) {
+    if (node->block_heights[i] > k_max) k_max = node->block_heights[i];
+  }
+  for (int c = 0; c != 2; ++c) {
+    size_t k = tree_k_max(node->children[c]);
+    if (k > k_max) k_max = k;
+  }
+  return k_max;
+}
+
+static size_t tree_nrows(tree_node_t *node) {
+  size_t nrows = 0;
+  for (size_t i = 0; i != node->nblocks; ++i) {
+    nrows += node->remainders[i].row_stop - node->remainders[i].row_start;
+  }
+  return nrows;
+}
+
+/* Collect the nodes at the given depth, left to right */
+static void nodes_at_level(tree_node_t *node, size_t level, tree_node_t **out, size_t *n) {
+  if (level == 0) {
+    out[(*n)++] = node;
+  } else {
+    nodes_at_level(node->children[0], level - 1, out, n);
+    nodes_at_level(node->children[1], level - 1, out, n);
+  }
+}
+
+/* Estimated time of applying the interpolation blocks of the subtree */
+static double tree_cost(tree_node_t *node, const wavemoth_cost_model_t *model) {
+  double cost = 0;
+  if (node->children[0] == NULL) return 0;
+  for (size_t i = 0; i != node->nblocks; ++i) {
+    cost += wavemoth_ip_block_cost(model, node->blocks[i].n, node->blocks[i].k);
+  }
+  return cost + tree_cost(node->children[0], model) + tree_cost(node->children[1], model);
+}
+
+/* Number of compression levels minimizing the cost; see costmodel.h */
+static size_t choose_level(tree_node_t *root, const wavemoth_cost_model_t *model) {
+  size_t depth = tree_depth(root), nrows = tree_nrows(root), best_level = 0;
+  double best_cost = 0;
+  tree_node_t **nodes = malloc(sizeof(tree_node_t*[(size_t)1 << depth]));
+  if (nodes == NULL) return 0;
+  for (size_t level = 0; level <= depth; ++level) {
+    double cost = 0;
+    if (nrows == 0 || root->ncols == 0) {
+      cost = 0;
+    } else if (level == 0) {
+      cost = wavemoth_residual_block_cost(model, nrows, root->ncols);
+    } else {
+      size_t n = 0;
+      nodes_at_level(root, depth - level, nodes, &n);
+      for (size_t i = 0; i != n; ++i) {
+        for (size_t j = 0; j != nodes[i]->nblocks; ++j) {
+          remainder_t *r = &nodes[i]->remainders[j];
+          cost += wavemoth_residual_block_cost(model, r->row_stop - r->row_start, r->ncols);
+        }
+        cost += tree_cost(nodes[i], model);
+      }
+    }
+    if (level == 0 || cost < best_cost) {
+      best_cost = cost;
+      best_level = level;
+    }
+  }
+  free(nodes);
+  return best_level;
+}
+
+/*
+stripify of lib.pyx: partitions the columns of A (nrows x ncols,
+column-major) into strips (row_start, row_stop, col_start, col_stop)
+so that elements below exclude_below are excluded and those above
+include_above included, minimizing the total strip_cost by dynamic
+programming. Strip boundaries are restricted to columns divisible by
+STRIP_COL_DIVISOR, except where a column can not share a strip with
+the preceding ones. strips must have room for ncols + 1 entries.
+Returns the number of strips, or -1 if out of memory or a column is
+not increasing in magnitude regularly enough.
+*/
+typedef struct {
+  ptrdiff_t row_start, row_stop, col_start, col_stop;
+} strip_t;
+
+/*
+Cost of a strip in pull_a_through_legendre_block, in units of the
+recurrence on one element (measured with nvecs = 2): the recurrence,
+a lone odd column running in both SSE lanes, packing the input rows
+for the strip, and the call and setup of the first two rows.
+*/
+static double strip_cost(ptrdiff_t nrows, ptrdiff_t ncols) {
+  return nrows * (ncols + (ncols % 2) + STRIP_PACK_COST) + STRIP_CALL_COST;
+}
+
+static ptrdiff_t stripify(const double *A, ptrdiff_t nrows, ptrdiff_t ncols,
+                          strip_t *strips) {
+  /* Segments between candidate boundaries, with the max first row to
+     exclude and min first row to include of their columns */
+  ptrdiff_t *seg_start = malloc(sizeof(ptrdiff_t[ncols + 1]));
+  ptrdiff_t *seg_a = malloc(sizeof(ptrdiff_t[ncols + 1]));
+  ptrdiff_t *seg_b = malloc(sizeof(ptrdiff_t[ncols + 1]));
+  ptrdiff_t *prev = malloc(sizeof(ptrdiff_t[ncols + 1]));
+  double *best = malloc(sizeof(double[ncols + 1]));
+  ptrdiff_t nseg = 0, nstrips = -1;
+
+  if (!seg_start || !seg_a || !seg_b || !prev || !best) goto FINALLY;
+  for (ptrdiff_t col = 0; col != ncols; ++col) {
+    const double *x = A + col * nrows;
+    ptrdiff_t a, b;
+    for (a = 0; a != nrows && !(fabs(x[a]) >= STRIP_EXCLUDE_BELOW); ++a);
+    for (b = 0; b != nrows && !(fabs(x[b]) >= STRIP_INCLUDE_ABOVE); ++b);
+    for (ptrdiff_t r = a; r != nrows; ++r) {
+      if (!(fabs(x[r]) >= STRIP_EXCLUDE_BELOW)) goto FINALLY;
+    }
+    if (nseg == 0 || col % STRIP_COL_DIVISOR == 0 ||
+        a > seg_b[nseg - 1] || b < seg_a[nseg - 1]) {
+      seg_start[nseg] = col;
+      seg_a[nseg] = a;
+      seg_b[nseg] = b;
+      ++nseg;
+    } else {
+      if (a > seg_a[nseg - 1]) seg_a[nseg - 1] = a;
+      if (b < seg_b[nseg - 1]) seg_b[nseg - 1] = b;
+    }
+  }
+  seg_start[nseg] = ncols;
+
+  /* best[j]: cost of the columns before segment j; a strip covering
+     segments i..j-1 starts at the min include row, and is only
+     possible if that is not above the max exclude row */
+  best[0] = 0;
+  for (ptrdiff_t j = 1; j <= nseg; ++j) {
+    ptrdiff_t max_a = -1, min_b = nrows;
+    best[j] = INFINITY;
+    for (ptrdiff_t i = j - 1; i >= 0; --i) {
+      if (seg_a[i] > max_a) max_a = seg_a[i];
+      if (seg_b[i] < min_b) min_b = seg_b[i];
+      if (max_a > min_b) break;
+      double cost = best[i] + strip_cost(nrows - min_b, seg_start[j] - seg_start[i]);
+      if (cost < best[j]) {
+        best[j] = cost;
+        prev[j] = i;
+      }
+    }
+  }
+
+  /* Backtrack; the strips come out in reverse order */
+  nstrips = 0;
+  for (ptrdiff_t j = nseg; j > 0; j = prev[j]) {
+    ptrdiff_t min_b = nrows;
+    for (ptrdiff_t i = prev[j]; i != j; ++i) {
+      if (seg_b[i] < min_b) min_b = seg_b[i];
+    }
+    strips[nstrips++] = (strip_t){min_b, nrows, seg_start[prev[j]], seg_start[j]};
+  }
+  for (ptrdiff_t i = 0; i != nstrips / 2; ++i) {
+    strip_t t = strips[i];
+    strips[i] = strips[nstrips - 1 - i];
+    strips[nstrips - 1 - i] = t;
+  }
+ FINALLY:
+  free(seg_start);
+  free(seg_a);
+  free(seg_b);
+  free(prev);
+  free(best);
+  return nstrips;
+}
+
+/*
+Use the SSE Legendre transform to compute the last row of a strip
+from its first two, to make sure the recurrence is numerically stable
+for these starting values. Returns the relative error.
+*/
+static double strip_stability_error(int m, size_t lmin, size_t nk, size_t nx,
+                                    const double *x_squared, const double *P0,
+                                    const double *P1, const double *last_row) {
+  double *a = memalign(16, sizeof(double[2 * nk]));
+  double *y = memalign(16, sizeof(double[2 * nx + 2]));
+  double *buf = memalign(16, sizeof(double[3 * nx + 3]));
+  double *auxdata = malloc(sizeof(double[3 * (nk - 2)]));
+  double err = INFINITY, dy = 0, ny = 0;
+  if (!a || !y || !buf || !auxdata) goto FINALLY;
+  /* nvecs == 2; the packed format is then simply row-major */
+  memset(a, 0, sizeof(double[2 * nk]));
+  a[2 * nk - 2] = a[2 * nk - 1] = 1;
+  memcpy(buf, x_squared, sizeof(double[nx]));
+  memcpy(buf + nx + nx % 2, P0, sizeof(double[nx]));
+  memcpy(buf + 2 * (nx + nx % 2), P1, sizeof(double[nx]));
+  wavemoth_legendre_transform_auxdata(m, lmin, nk, auxdata);
+  wavemoth_legendre_transform_sse(nx, nk, 2, a, y, buf, auxdata,
+                                  buf + nx + nx % 2, buf + 2 * (nx + nx % 2), NULL);
+  for (size_t j = 0; j != nx; ++j) {
+    dy += (y[2 * j] - last_row[j]) * (y[2 * j] - last_row[j]);
+    ny += y[2 * j] * y[2 * j];
+  }
+  /* As in lib.pyx, an all-zero result gives NaN and passes */
+  err = sqrt(dy) / sqrt(ny);
+ FINALLY:
+  free(a);
+  free(y);
+  free(buf);
+  free(auxdata);
+  return err;
+}
+
+/*
+serialize_block_payload of LegendreMatrixProvider. The recurrence
+coefficients and x^2 of the strips are not stored here; see
+serialize_matrix_record.
+*/
+static int write_block_payload(stream_t *s, legendre_matrix_t *L, size_t row_start,
+                               size_t row_stop, const int *cols, size_t ncols) {
+  double *A = NULL, *strip_buf = NULL;
+  strip_t *strips = NULL;
+  ptrdiff_t nstrips;
+  size_t nrows = row_stop - row_start, min_rstart = SIZE_MAX, nk;
+  int ret = -1, contiguous;
+
+  if (ncols == 0 || nrows == 0) {
+    stream_pad128(s);
+    stream_int64(s, 0);
+    stream_int64(s, 0);
+    return 0;
+  }
+
+  A = malloc(sizeof(double[nrows * ncols]));
+  strip_buf = malloc(sizeof(double[3 * ncols]));
+  strips = malloc(sizeof(strip_t[ncols + 1]));
+  if (!A || !strip_buf || !strips) goto FINALLY;
+  for (size_t j = 0; j != ncols; ++j) {
+    memcpy(A + j * nrows, L->Lambda + cols[j] * L->nk + row_start, sizeof(double[nrows]));
+  }
+  nstrips = stripify(A, nrows, ncols, strips);
+  if (nstrips < 0) {
+    fprintf(stderr, "m=%d: Magnitude of column not increasing regularly enough\n", L->m);
+    goto FINALLY;
+  }
+
+  /* Skip rows that are not used by any strip */
+  for (ptrdiff_t i = 0; i != nstrips; ++i) {
+    if ((size_t)strips[i].row_start < min_rstart) min_rstart = strips[i].row_start;
+  }
+  for (ptrdiff_t i = 0; i != nstrips; ++i) {
+    strips[i].row_start -= min_rstart;
+    strips[i].row_stop -= min_rstart;
+  }
+  row_start += min_rstart;
+  nk = row_stop - row_start;
+  stream_pad128(s);
+  stream_int64(s, row_start);
+  stream_int64(s, row_stop);
+  if (nk <= 4) {
+    /* Applied with dgemm */
+    stream_pad128(s);
+    for (size_t j = 0; j != ncols; ++j) {
+      stream_write(s, A + j * nrows + min_rstart, sizeof(double[nk]));
+    }
+    ret = 0;
+    goto FINALLY;
+  }
+
+  stream_int64(s, nstrips);
+  /* The rings of the columns: a first ring if consecutive, otherwise -1
+     and the list of rings */
+  contiguous = 1;
+  for (size_t j = 1; j != ncols; ++j) {
+    if (cols[j] != cols[0] + (int)j) contiguous = 0;
+  }
+  if (contiguous) {
+    stream_int64(s, cols[0]);
+  } else {
+    stream_int64(s, -1);
+    stream_pad128(s);
+    for (size_t j = 0; j != ncols; ++j) {
+      int32_t col = cols[j];
+      stream_write(s, &col, sizeof(col));
+    }
+  }
+
+  for (ptrdiff_t i = 0; i != nstrips; ++i) {
+    size_t rstart = strips[i].row_start, cstart = strips[i].col_start;
+    size_t cstop = strips[i].col_stop, nx = cstop - cstart;
+    stream_int64(s, rstart);
+    stream_int64(s, cstop);
+    if (nk - rstart <= 4) {
+      stream_pad128(s);
+      for (size_t j = cstart; j != cstop; ++j) {
+        stream_write(s, A + j * nrows + min_rstart + rstart, sizeof(double[nk - rstart]));
+      }
+    } else {
+      double *x_squared = strip_buf, *P0 = strip_buf + nx, *P1 = strip_buf + 2 * nx;
+      double last_row[nx];
+      for (size_t j = 0; j != nx; ++j) {
+        const double *col = A + (cstart + j) * nrows + min_rstart;
+        x_squared[j] = L->x_squared[cols[cstart + j]];
+        P0[j] = col[rstart];
+        P1[j] = col[rstart + 1];
+        last_row[j] = col[nk - 1];
+      }
+      stream_aligned_array(s, P0, nx);
+      if (row_start + rstart == 0) {
+        /* P1 follows from P0 at the first row of the matrix; checked
+           below as computed in pull_a_through_legendre_block */
+        double alpha, beta;
+        wavemoth_legendre_transform_first_step(L->m, row_to_l(L, 0), &alpha, &beta);
+        for (size_t j = 0; j != nx; ++j) {
+          P1[j] = (x_squared[j] + alpha) * beta * P0[j];
+        }
+      } else {
+        stream_aligned_array(s, P1, nx);
+      }
+      double err = strip_stability_error(L->m, row_to_l(L, row_start + rstart),
+                                         nk - rstart, nx, x_squared, P0, P1, last_row);
+      if (err > MAX_STABILITY_ERROR) {
+        fprintf(stderr, "m=%d: Appears to have hit a numerically unstable case "
+                "(relative error %e)\n", L->m, err);
+        goto FINALLY;
+      }
+    }
+  }
+  ret = 0;
+ FINALLY:
+  free(A);
+  free(strip_buf);
+  free(strips);
+  return ret;
+}
+
+static void serialize_node(stream_t *s, tree_node_t *node) {
+  if (node->children[0] == NULL) {
+    stream_int32(s, 0);
+    stream_int32(s, node->ncols);
+    return;
+  }
+  stream_int32(s, node->nblocks);
+  for (size_t i = 0; i != node->nblocks; ++i) stream_int32(s, node->block_heights[i]);
+  for (size_t i = 0; i != node->nblocks; ++i) {
+    ip_block_t *b = &node->blocks[i];
+    stream_write(s, b->filter, b->n);
+    stream_aligned_array(s, b->interpolant, b->k * (b->n - b->k));
+  }
+}
+
+static void heapify(tree_node_t *node, size_t first_idx, size_t idx, tree_node_t **heap) {
+  heap[idx - first_idx] = node;
+  if (node->children[0] != NULL) {
+    heapify(node->children[0], first_idx, 2 * idx, heap);
+    heapify(node->children[1], first_idx, 2 * idx + 1, heap);
+  }
+}
+
+/* serialize_butterfly_matrix of butterfly.pyx, keeping num_levels levels */
+static int serialize_butterfly_matrix(stream_t *s, tree_node_t *root, size_t num_levels,
+                                      legendre_matrix_t *L) {
+  tree_node_t *identity = NULL, **forest = NULL, **heap = NULL;
+  size_t depth = tree_depth(root), element_count = tree_size(root);
+  size_t root_count, heap_size, k_max = 0, nblocks_max = 0, nrows = tree_nrows(root);
+  size_t residual_pos, heap_pos;
+  int ret = -1;
+
+  if (num_levels == 0) {
+    /* Construct a noop tree */
+    identity = alloc_node(1, 1);
+    if (identity == NULL) goto FINALLY;
+    identity->ncols = root->ncols;
+    identity->block_heights[0] = root->ncols;
+    identity->remainders[0] = (remainder_t){0, nrows, root->ncols,
+                                            malloc(sizeof(int[root->ncols + 1]))};
+    if (identity->remainders[0].cols == NULL) goto FINALLY;
+    for (size_t j = 0; j != root->ncols; ++j) identity->remainders[0].cols[j] = j;
+    root = identity;
+    depth = element_count = 0;
+  }
+  root_count = (size_t)1 << (depth - num_levels);
+  heap_size = ((size_t)2 << depth) - root_count;
+  forest = malloc(sizeof(tree_node_t*[root_count]));
+  heap = malloc(sizeof(tree_node_t*[heap_size]));
+  if (forest == NULL || heap == NULL) goto FINALLY;
+  root_count = 0;
+  nodes_at_level(root, depth - num_levels, forest, &root_count);
+  for (size_t i = 0; i != root_count; ++i) {
+    size_t k = tree_k_max(forest[i]);
+    if (depth > 0 && k > k_max) k_max = k;
+    if (forest[i]->nblocks > nblocks_max) nblocks_max = forest[i]->nblocks;
+    heapify(forest[i], root_count, root_count + i, heap);
+  }
+
+  stream_int32(s, tree_nrows(forest[0]));
+  stream_int32(s, root->ncols);
+  stream_int32(s, k_max);
+  stream_int32(s, nblocks_max);
+  stream_int64(s, element_count);
+  stream_int32(s, root_count);
+  stream_int32(s, heap_size);
+  stream_int32(s, root_count);
+  stream_int32(s, 0);
+  residual_pos = s->len;
+  for (size_t i = 0; i != root_count; ++i) stream_int64(s, 0);
+  heap_pos = s->len;
+  for (size_t i = 0; i != heap_size; ++i) stream_int64(s, 0);
+
+  /* Residual matrix payloads, with a table of offsets to each block
+     of length nblocks + 1 */
+  for (size_t i = 0; i != root_count; ++i) {
+    tree_node_t *node = forest[i];
+    size_t offsets_pos;
+    stream_patch_int64(s, residual_pos + 8 * i, s->len);
+    stream_int64(s, node->nblocks);
+    offsets_pos = s->len;
+    for (size_t j = 0; j != node->nblocks + 1; ++j) stream_int64(s, 0);
+    for (size_t j = 0; j != node->nblocks; ++j) {
+      remainder_t *r = &node->remainders[j];
+      stream_patch_int64(s, offsets_pos + 8 * j, s->len);
+      if (write_block_payload(s, L, r->row_start, r->row_stop, r->cols, r->ncols) != 0) {
+        goto FINALLY;
+      }
+    }
+    stream_patch_int64(s, offsets_pos + 8 * node->nblocks, s->len);
+  }
+
+  for (size_t i = 0; i != heap_size; ++i) {
+    stream_pad128(s);
+    stream_patch_int64(s, heap_pos + 8 * i, s->len);
+    serialize_node(s, heap[i]);
+  }
+  ret = s->failed ? -1 : 0;
+ FINALLY:
+  free(forest);
+  free(heap);
+  free_tree(identity);
+  return ret;
+}
+
+/*
+Each matrix of a resource file is stored as
+
+    int64 nk, int64 offset of the butterfly matrix data
+    double auxdata[3 * (nk - 2)], 16-byte aligned
+    butterfly matrix data (serialize_butterfly_matrix), 16-byte aligned
+
+where auxdata are the recurrence coefficients of all nk rows
+(wavemoth_legendre_transform_auxdata with lmin = m + odd). Those of a
+residual block or strip starting at row r are auxdata + 3 * r, so the
+blocks share this one copy; likewise, they refer to the x^2 table of
+the file header by ring.
+*/
+static int serialize_matrix_record(stream_t *s, tree_node_t *root, size_t num_levels,
+                                   legendre_matrix_t *L) {
+  stream_t bfm = {0};
+  size_t naux = (L->nk > 2) ? 3 * (L->nk - 2) : 0, offset_pos;
+  double *auxdata = malloc(sizeof(double[naux + 1]));
+  int ret = -1;
+
+  if (auxdata == NULL) goto FINALLY;
+  if (serialize_butterfly_matrix(&bfm, root, num_levels, L) != 0) goto FINALLY;
+  if (naux > 0) wavemoth_legendre_transform_auxdata(L->m, row_to_l(L, 0), L->nk, auxdata);
+  stream_int64(s, L->nk);
+  offset_pos = s->len;
+  stream_int64(s, 0);
+  stream_aligned_array(s, auxdata, naux);
+  stream_pad128(s);
+  stream_patch_int64(s, offset_pos, s->len);
+  stream_write(s, bfm.data, bfm.len);
+  ret = s->failed ? -1 : 0;
+ FINALLY:
+  free(bfm.data);
+  free(auxdata);
+  return ret;
+}
+
+static int compute_matrix(const wavemoth_precompute_options_t *opts,
+                          wavemoth_taskpool_t *pool, int m, int odd,
+                          char **out_data, size_t *out_len) {
+  legendre_matrix_t L = {0};
+  compress_ctx_t ctx;
+  wavemoth_cost_model_t model;
+  stream_t s = {0};
+  tree_node_t *root = NULL;
+  double **residuals = NULL;
+  size_t *partition = NULL, npartition, level;
+  int ret = -1;
+
+  if (compute_legendre_matrix(&L, pool, opts->Nside, opts->lmax, m, odd) != 0) goto FINALLY;
+  npartition = make_partition(L.ncols, opts->chunk_size, &partition);
+  if (npartition == 0) goto FINALLY;
+  ctx.L = &L;
+  ctx.pool = pool;
+  ctx.eps = opts->eps;
+  ctx.randomized = opts->randomized;
+  /* Seeded by the matrix, so that the output does not depend on threading */
+  ctx.seed = 2 * (uint64_t)m + odd;
+  root = butterfly_core(&ctx, 0, L.nk, partition, npartition, &residuals);
+  if (root == NULL) goto FINALLY;
+  for (size_t i = 0; i != root->nblocks; ++i) free(residuals[i]);
+  free(residuals);
+
+  /* Drop levels of compression where the residual is cheaper */
+  if (opts->cost_model != NULL) {
+    model = *opts->cost_model;
+  } else {
+    wavemoth_cost_model_from_memop(&model, opts->memop_cost);
+  }
+  level = choose_level(root, &model);
+  if (opts->verbose) {
+    fprintf(stderr, "Computed m=%d of %d, odd=%d, level=%d: %zu interpolation elements\n",
+            m, opts->lmax, odd, (int)level, tree_size(root));
+  }
+  if (serialize_matrix_record(&s, root, level, &L) != 0) goto FINALLY;
+
+  *out_data = memalign(16, s.len + 1);
+  if (*out_data == NULL) goto FINALLY;
+  memcpy(*out_data, s.data, s.len);
+  *out_len = s.len;
+  ret = 0;
+ FINALLY:
+  free(s.data);
+  free(partition);
+  free_tree(root);
+  free_legendre_matrix(&L);
+  return ret;
+}
+
+int wavemoth_precompute_uncompressed_matrix(int Nside, int lmax, int m, int odd,
+                                            char **out_data, size_t *out_len) {
+  legendre_matrix_t L = {0};
+  stream_t s = {0};
+  tree_node_t *root = NULL;
+  int ret = -1;
+
+  if (compute_legendre_matrix(&L, NULL, Nside, lmax, m, odd) != 0) goto FINALLY;
+  /* A single leaf spanning all columns; serialized with no levels it
+     becomes one residual block */
+  root = alloc_node(1, 1);
+  if (root == NULL) goto FINALLY;
+  root->ncols = L.ncols;
+  root->block_heights[0] = L.ncols;
+  root->remainders[0] = (remainder_t){0, L.nk, L.ncols, NULL};
+  if (serialize_matrix_record(&s, root, 0, &L) != 0) goto FINALLY;
+
+  *out_data = memalign(16, s.len + 1);
+  if (*out_data == NULL) goto FINALLY;
+  memcpy(*out_data, s.data, s.len);
+  *out_len = s.len;
+  ret = 0;
+ FINALLY:
+  free(s.data);
+  free_tree(root);
+  free_legendre_matrix(&L);
+  return ret;
+}
+
+static int get_nthreads(const wavemoth_precompute_options_t *opts) {
+  return (opts->nthreads <= 0) ? (int)sysconf(_SC_NPROCESSORS_ONLN) : opts->nthreads;
+}
+
+int wavemoth_precompute_matrix(const wavemoth_precompute_options_t *opts, int m, int odd,
+                               char **out_data, size_t *out_len) {
+  wavemoth_taskpool_t *pool = NULL;
+  int nthreads = get_nthreads(opts), ret;
+  if (nthreads > 1 && (pool = wavemoth_taskpool_create(nthreads)) == NULL) return -1;
+  ret = compute_matrix(opts, pool, m, odd, out_data, out_len);
+  wavemoth_taskpool_destroy(pool);
+  return ret;
+}
+
+/*
+Resource file writer. Each (m, odd) is a task in a work-stealing pool
+(see taskpool.h), and so are the parts of the compression of each
+matrix, so that the large matrices of small m are done by all threads
+rather than being a single-threaded tail. The tasks of small m are
+queued first.
+
+The file is built as <filename>.partial, with the header slots
+(lmax, mmax, Nside and the offset and length of each matrix) and the
+table of x^2 of the 2 * Nside rings reserved at the start. Matrices
+are appended at 16-byte aligned offsets as they complete (in
+whatever order the threads finish them), and each is recorded in the
+journal <filename>.partial.journal with its offset, length and
+CRC-32. The header is written last, after which the file is renamed
+to filename and the journal to filename.journal.
+
+If a run is interrupted, the next run with the same parameters finds
+the partial file and its journal, keeps every matrix whose checksum
+verifies, and only computes the rest. Matrices that did not make it to
+disk intact simply fail verification, so the journal is not synced.
+
+Journal format (text), where 3 is JOURNAL_VERSION and the first line
+continues up to the model coefficients:
+
+    wavemoth-journal 3 Nside lmax mmax chunk_size eps memop_cost ...
+        ... randomized [model ...]
+    m odd offset length crc32
+    ...
+*/
+
+#define JOURNAL_MAGIC "wavemoth-journal"
+#define JOURNAL_VERSION 3
+
+typedef struct {
+  const wavemoth_precompute_options_t *opts;
+  wavemoth_taskpool_t *pool;
+  int fd;
+  FILE *journal;
+  int64_t *header; /* [3 + 4 * (mmax + 1)] */
+  size_t file_pos;
+  int failed;
+  pthread_mutex_t mutex;
+} resource_writer_t;
+
+typedef struct {
+  resource_writer_t *writer;
+  int m, odd;
+} matrix_task_t;
+
+static uint32_t crc_table[256];
+static pthread_once_t crc_table_once = PTHREAD_ONCE_INIT;
+
+static void init_crc_table(void) {
+  for (uint32_t i = 0; i != 256; ++i) {
+    uint32_t c = i;
+    for (int k = 0; k != 8; ++k) c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+    crc_table[i] = c;
+  }
+}
+
+/* CRC-32 as in zlib */
+static uint32_t crc32_of(const char *buf, size_t len) {
+  uint32_t c = 0xFFFFFFFFu;
+  pthread_once(&crc_table_once, init_crc_table);
+  for (size_t i = 0; i != len; ++i) c = crc_table[(c ^ (uint8_t)buf[i]) & 0xFF] ^ (c >> 8);
+  return c ^ 0xFFFFFFFFu;
+}
+
+static int pwrite_all(int fd, const char *buf, size_t len, size_t pos) {
+  while (len > 0) {
+    ssize_t n = pwrite(fd, buf, len, pos);
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      return -1;
+    }
+    buf += n;
+    len -= n;
+    pos += n;
+  }
+  return 0;
+}
+
+static int pread_all(int fd, char *buf, size_t len, size_t pos) {
+  while (len > 0) {
+    ssize_t n = pread(fd, buf, len, pos);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) return -1;
+    buf += n;
+    len -= n;
+    pos += n;
+  }
+  return 0;
+}
+
+/* Read a matrix of a resource file; returns NULL on error or bad checksum */
+static char *read_matrix(int fd, size_t pos, size_t len, int check_crc, uint32_t crc) {
+  char *data = memalign(16, len + 1);
+  if (data == NULL) return NULL;
+  if (pread_all(fd, data, len, pos) != 0 || (check_crc && crc32_of(data, len) != crc)) {
+    free(data);
+    return NULL;
+  }
+  return data;
+}
+
+static void writer_fail(resource_writer_t *w) {
+  pthread_mutex_lock(&w->mutex);
+  w->failed = 1;
+  pthread_mutex_unlock(&w->mutex);
+}
+
+/* Append a matrix to the file and record it in the header and journal */
+static void append_matrix(resource_writer_t *w, int m, int odd, const char *data,
+                          size_t len) {
+  uint32_t crc = crc32_of(data, len);
+  size_t pos;
+  pthread_mutex_lock(&w->mutex);
+  pos = w->file_pos = (w->file_pos + 15) & ~(size_t)15;
+  w->file_pos += len;
+  pthread_mutex_unlock(&w->mutex);
+  /* Regions are disjoint, so the write itself needs no lock */
+  if (pwrite_all(w->fd, data, len, pos) != 0) {
+    fprintf(stderr, "Error writing resource file: %s\n", strerror(errno));
+    writer_fail(w);
+    return;
+  }
+  pthread_mutex_lock(&w->mutex);
+  w->header[3 + 4 * m + 2 * odd] = pos;
+  w->header[3 + 4 * m + 2 * odd + 1] = len;
+  fprintf(w->journal, "%d %d %zu %zu %08x\n", m, odd, pos, len, crc);
+  if (fflush(w->journal) != 0) w->failed = 1;
+  pthread_mutex_unlock(&w->mutex);
+}
+
+static void matrix_task(void *arg) {
+  matrix_task_t *task = arg;
+  resource_writer_t *w = task->writer;
+  int m = task->m, odd = task->odd, failed;
+  char *data;
+  size_t len;
+
+  pthread_mutex_lock(&w->mutex);
+  failed = w->failed;
+  pthread_mutex_unlock(&w->mutex);
+  if (failed) return;
+
+  if (compute_matrix(w->opts, w->pool, m, odd, &data, &len) != 0) {
+    fprintf(stderr, "Failed to compute matrix m=%d, odd=%d\n", m, odd);
+    writer_fail(w);
+    return;
+  }
+  append_matrix(w, m, odd, data, len);
+  free(data);
+}
+
+/*
+Load a journal. If params is not NULL, the journal must have been
+written with those parameters, or, if prefix_only, parameters starting
+with them. For each entry that matches the header
+slots of the file fd (if header is not NULL) or whose data in fd has
+the recorded checksum (otherwise), (*visit)(ctx, m, odd, offset,
+length, crc) is called. Returns -1 if the journal can not be read or
+does not match.
+*/
+typedef void (*journal_visitor_t)(void *ctx, int m, int odd, size_t pos, size_t len,
+                                  uint32_t crc);
+
+/* The parameters that determine the format of the file, which the
+   journal parameters start with */
+static int format_journal_format(char *buf, size_t buflen,
+                                 const wavemoth_precompute_options_t *opts) {
+  return snprintf(buf, buflen, "%s %d %d %d %d", JOURNAL_MAGIC, JOURNAL_VERSION,
+                  opts->Nside, opts->lmax, opts->mmax);
+}
+
+static void format_journal_params(char *buf, size_t buflen,
+                                  const wavemoth_precompute_options_t *opts) {
+  const wavemoth_cost_model_t *model = opts->cost_model;
+  int n = format_journal_format(buf, buflen, opts);
+  if (n >= 0 && (size_t)n < buflen) {
+    n += snprintf(buf + n, buflen - n, " %d %.17g %.17g %d", opts->chunk_size,
+                  opts->eps, opts->memop_cost, opts->randomized);
+  }
+  if (model != NULL && n >= 0 && (size_t)n < buflen) {
+    snprintf(buf + n, buflen - n, " model %.17g %.17g %.17g %.17g %.17g",
+             model->ip_element, model->ip_row, model->ip_block,
+             model->residual_element, model->residual_block);
+  }
+}
+
+static int load_journal(const char *journal_name, const char *params, int prefix_only,
+                        int mmax, int fd, const int64_t *header,
+                        journal_visitor_t visit, void *ctx) {
+  char line[512];
+  int m, odd;
+  size_t pos, len;
+  unsigned int crc;
+  FILE *f = fopen(journal_name, "r");
+  if (f == NULL) return -1;
+  if (fgets(line, sizeof(line), f) == NULL ||
+      strncmp(line, JOURNAL_MAGIC " ", strlen(JOURNAL_MAGIC) + 1) != 0 ||
+      (params != NULL && (strncmp(line, params, strlen(params)) != 0 ||
+                          (line[strlen(params)] != '\n' &&
+                           !(prefix_only && line[strlen(params)] == ' '))))) {
+    fclose(f);
+    return -1;
+  }
+  while (fgets(line, sizeof(line), f) != NULL) {
+    if (sscanf(line, "%d %d %zu %zu %x", &m, &odd, &pos, &len, &crc) != 5) continue;
+    if (m < 0 || m > mmax || odd < 0 || odd > 1) continue;
+    if (header != NULL) {
+      if ((size_t)header[3 + 4 * m + 2 * odd] != pos ||
+          (size_t)header[3 + 4 * m + 2 * odd + 1] != len) continue;
+    } else {
+      char *data = read_matrix(fd, pos, len, 1, crc);
+      if (data == NULL) continue;
+      free(data);
+    }
+    visit(ctx, m, odd, pos, len, crc);
+  }
+  fclose(f);
+  return 0;
+}
+
+static void resume_visitor(void *ctx, int m, int odd, size_t pos, size_t len,
+                           uint32_t crc) {
+  resource_writer_t *w = ctx;
+  w->header[3 + 4 * m + 2 * odd] = pos;
+  w->header[3 + 4 * m + 2 * odd + 1] = len;
+}
+
+/* Checksums of the source file of a regeneration, [2 * (mmax + 1)] */
+typedef struct {
+  uint32_t *crcs;
+  char *known;
+} source_crcs_t;
+
+static void source_visitor(void *ctx, int m, int odd, size_t pos, size_t len,
+                           uint32_t crc) {
+  source_crcs_t *c = ctx;
+  c->crcs[2 * m + odd] = crc;
+  c->known[2 * m + odd] = 1;
+}
+
+/*
+Write filename. Matrix (m, odd) is computed if compute_m[m] is set,
+and otherwise copied from the resource file source (if it has it); if
+source is NULL, every m_stride-th m is computed.
+*/
+static int write_resources(const char *filename, const wavemoth_precompute_options_t *opts,
+                           const char *compute_m, const char *source) {
+  resource_writer_t w = {0};
+  wavemoth_taskgroup_t group = {0};
+  matrix_task_t *tasks = NULL;
+  source_crcs_t source_crcs = {NULL, NULL};
+  int64_t *source_header = NULL;
+  double *x_squared = NULL;
+  size_t nslots = 3 + 4 * (opts->mmax + 1), slots_len = sizeof(int64_t[nslots]);
+  size_t header_len = slots_len + sizeof(double[2 * opts->Nside]);
+  size_t ntasks = 0, nresumed = 0, ncopied = 0;
+  size_t namelen = strlen(filename) + 32;
+  char partial_name[namelen], journal_name[namelen], final_journal_name[namelen];
+  char source_journal_name[(source != NULL) ? strlen(source) + 32 : 1];
+  char params[512], source_params[128];
+  int nthreads = get_nthreads(opts), source_fd = -1, resumed = 0;
+  struct stat st;
+  double t0 = walltime();
+
+  if (opts->m_stride < 1 || opts->chunk_size < 1 || opts->mmax > opts->lmax) {
+    fprintf(stderr, "Invalid precomputation options\n");
+    return -1;
+  }
+  snprintf(partial_name, namelen, "%s.partial", filename);
+  snprintf(journal_name, namelen, "%s.partial.journal", filename);
+  snprintf(final_journal_name, namelen, "%s.journal", filename);
+  format_journal_params(params, sizeof(params), opts);
+  w.opts = opts;
+  w.fd = -1;
+  pthread_mutex_init(&w.mutex, NULL);
+  w.header = calloc(nslots, sizeof(int64_t));
+  x_squared = malloc(sizeof(double[2 * opts->Nside]));
+  tasks = malloc(sizeof(matrix_task_t[2 * (opts->mmax + 1)]));
+  if (w.header == NULL || x_squared == NULL || tasks == NULL) goto ERROR;
+  wavemoth_precompute_ring_x_squared(opts->Nside, x_squared);
+
+  if (source != NULL) {
+    source_header = malloc(slots_len);
+    source_crcs.crcs = calloc(2 * (opts->mmax + 1), sizeof(uint32_t));
+    source_crcs.known = calloc(2 * (opts->mmax + 1), 1);
+    if (source_header == NULL || source_crcs.crcs == NULL || source_crcs.known == NULL) {
+      goto ERROR;
+    }
+    source_fd = open(source, O_RDONLY);
+    if (source_fd == -1 || pread_all(source_fd, (char*)source_header, slots_len, 0) != 0 ||
+        source_header[0] != opts->lmax || source_header[1] != opts->mmax ||
+        source_header[2] != opts->Nside) {
+      fprintf(stderr, "%s is not a resource file for Nside=%d, lmax=%d, mmax=%d\n",
+              source, opts->Nside, opts->lmax, opts->mmax);
+      goto ERROR;
+    }
+    /* The source must have been written in the same format; the
+       compression parameters (e.g. eps) may differ from those used
+       for the matrices recomputed. Copied matrices are verified
+       against its checksums. */
+    snprintf(source_journal_name, sizeof(source_journal_name), "%s.journal", source);
+    format_journal_format(source_params, sizeof(source_params), opts);
+    if (load_journal(source_journal_name, source_params, 1, opts->mmax, source_fd,
+                     source_header, source_visitor, &source_crcs) != 0) {
+      fprintf(stderr, "%s is missing, or %s was not written in this format (%s)\n",
+              source_journal_name, source, source_params);
+      goto ERROR;
+    }
+  }
+
+  /* Resume an interrupted run with the same parameters */
+  w.fd = open(partial_name, O_RDWR);
+  if (w.fd != -1 && fstat(w.fd, &st) == 0 &&
+      load_journal(journal_name, params, 0, opts->mmax, w.fd, NULL, resume_visitor,
+                   &w) == 0) {
+    resumed = 1;
+    w.file_pos = ((size_t)st.st_size > header_len) ? (size_t)st.st_size : header_len;
+    w.journal = fopen(journal_name, "a");
+  } else {
+    if (w.fd != -1) close(w.fd);
+    w.fd = open(partial_name, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    w.file_pos = header_len;
+    w.journal = (w.fd == -1) ? NULL : fopen(journal_name, "w");
+    if (w.journal != NULL) {
+      fprintf(w.journal, "%s\n", params);
+      fflush(w.journal);
+    }
+  }
+  if (w.fd == -1 || w.journal == NULL) {
+    fprintf(stderr, "Could not create %s: %s\n", partial_name, strerror(errno));
+    goto ERROR;
+  }
+  w.header[0] = opts->lmax;
+  w.header[1] = opts->mmax;
+  w.header[2] = opts->Nside;
+
+  w.pool = wavemoth_taskpool_create(nthreads);
+  if (w.pool == NULL) goto ERROR;
+  for (int m = 0; m <= opts->mmax; ++m) {
+    for (int odd = 0; odd != 2; ++odd) {
+      int slot = 3 + 4 * m + 2 * odd, compute;
+      if (w.header[slot] != 0) {
+        ++nresumed;
+        continue;
+      }
+      compute = (compute_m != NULL) ? compute_m[m] : (m % opts->m_stride == 0);
+      if (!compute && source_header != NULL && source_header[slot] != 0) {
+        /* Copied below, while the pool computes */
+        continue;
+      }
+      if (!compute) continue;
+      tasks[ntasks] = (matrix_task_t){&w, m, odd};
+      wavemoth_taskpool_spawn(w.pool, &group, matrix_task, &tasks[ntasks]);
+      ++ntasks;
+    }
+  }
+  if (resumed && opts->verbose) {
+    fprintf(stderr, "Resuming %s: %zu matrices already done\n", partial_name, nresumed);
+  }
+  for (int m = 0; m <= opts->mmax && source_header != NULL; ++m) {
+    if (compute_m[m]) continue;
+    for (int odd = 0; odd != 2; ++odd) {
+      int slot = 3 + 4 * m + 2 * odd;
+      if (w.header[slot] != 0 || source_header[slot] == 0) continue;
+      char *data = read_matrix(source_fd, source_header[slot], source_header[slot + 1],
+                               source_crcs.known[2 * m + odd], source_crcs.crcs[2 * m + odd]);
+      if (data == NULL) {
+        /* Recompute what can not be copied intact */
+        fprintf(stderr, "Bad matrix m=%d, odd=%d in %s, recomputing\n", m, odd, source);
+        tasks[ntasks] = (matrix_task_t){&w, m, odd};
+        wavemoth_taskpool_spawn(w.pool, &group, matrix_task, &tasks[ntasks]);
+        ++ntasks;
+        continue;
+      }
+      append_matrix(&w, m, odd, data, source_header[slot + 1]);
+      free(data);
+      ++ncopied;
+    }
+  }
+  wavemoth_taskpool_wait(w.pool, &group);
+
+  if (w.failed) goto ERROR;
+  if (pwrite_all(w.fd, (char*)w.header, slots_len, 0) != 0 ||
+      pwrite_all(w.fd, (char*)x_squared, header_len - slots_len, slots_len) != 0 ||
+      fsync(w.fd) != 0 ||
+      fflush(w.journal) != 0 || fsync(fileno(w.journal)) != 0) {
+    fprintf(stderr, "Error writing resource file: %s\n", strerror(errno));
+    goto ERROR;
+  }
+  if (rename(partial_name, filename) != 0 ||
+      rename(journal_name, final_journal_name) != 0) {
+    fprintf(stderr, "Could not rename %s to %s: %s\n", partial_name, filename,
+            strerror(errno));
+    goto ERROR;
+  }
+  if (opts->verbose) {
+    fprintf(stderr, "Wrote %s (%zu bytes; %zu matrices computed, %zu copied, %zu resumed) "
+            "in %.1f s using %d threads\n", filename, w.file_pos, ntasks, ncopied, nresumed,
+            walltime() - t0, nthreads);
+  }
+  goto FINALLY;
+
+ ERROR:
+  w.failed = 1;
+  if (w.fd != -1) {
+    fprintf(stderr, "Precomputation incomplete; run again to resume from %s\n",
+            partial_name);
+  }
+ FINALLY:
+  wavemoth_taskpool_destroy(w.pool);
+  pthread_mutex_destroy(&w.mutex);
+  if (w.journal != NULL) fclose(w.journal);
+  if (w.fd != -1) close(w.fd);
+  if (source_fd != -1) close(source_fd);
+  free(source_header);
+  free(source_crcs.crcs);
+  free(source_crcs.known);
+  free(w.header);
+  free(x_squared);
+  free(tasks);
+  return w.failed ? -1 : 0;
+}
+
+int wavemoth_precompute_resources(const char *filename,
+                                  const wavemoth_precompute_options_t *opts) {
+  return write_resources(filename, opts, NULL, NULL);
+}
+
+int wavemoth_precompute_regenerate(const char *filename,
+                                   const wavemoth_precompute_options_t *opts,
+                                   const int *ms, size_t nms) {
+  char *compute_m = calloc(opts->mmax + 1, 1);
+  int ret;
+  if (compute_m == NULL) return -1;
+  for (size_t i = 0; i != nms; ++i) {
+    if (ms[i] >= 0 && ms[i] <= opts->mmax) compute_m[ms[i]] = 1;
+  }
+  ret = write_resources(filename, opts, compute_m, filename);
+  free(compute_m);
+  return ret;
+}
@@ -0,0 +1,107 @@
+#ifndef _WAVEMOTH_PRECOMPUTE_H_
+#define _WAVEMOTH_PRECOMPUTE_H_
+
+#include <stddef.h>
+
+#include "costmodel.h"
+
+/*
+Native generation of the resource files read by
+wavemoth_mmap_resources; the C counterpart of ResourceComputer in
+lib.pyx.
+
+For each (m, odd), the Legendre matrix Lambda[k, j] = P_l^m(cos theta_j)
+for l = m + 2k + odd and the theta_j of the HEALPix rings on the
+northern hemisphere (equator first) is computed with the ylmgen SSE2
+recurrence of libpshtlight, butterfly-compressed with interpolative
+decompositions (see interpolative.h; optionally randomized, which
+is much faster for the tall blocks of low rank near the root) on
+column chunks of chunk_size, and the number of compression levels
+that minimizes the estimated time of applying the matrix
+(costmodel.h) is serialized in the butterfly format of butterfly.h,
+with the residual blocks in the format pulled by
+pull_a_through_legendre_block
+(Legendre recurrence starting values per strip, or dense blocks).
+The recurrence coefficients are stored once per matrix, ahead of the
+butterfly data, and x^2 once per file, in the header.
+
+The work is spread over nthreads threads with a work-stealing pool
+(taskpool.h): the (m, odd) matrices, and within each matrix the
+columns of the Legendre matrix, the subtrees of the butterfly and the
+IDs of each level, are tasks, so that the largest matrices (small m)
+do not end up as a single-threaded tail. Matrices are appended to the
+file as they complete, with the header written last.
+*/
+
+typedef struct {
+  int Nside, lmax, mmax;
+  int chunk_size;     /* columns per leaf block */
+  double eps;         /* relative precision of the interpolative decompositions */
+  double memop_cost;  /* cost of a memory operation relative to a flop */
+  /* If not NULL, e.g. from wavemoth_calibrate_cost_model on the host
+     that will use the resources, used instead of memop_cost */
+  const wavemoth_cost_model_t *cost_model;
+  int randomized;     /* use randomized IDs (wavemoth_sparse_id_randomized) */
+  int m_stride;       /* only compute every m_stride-th m (for benchmarks; 1) */
+  int nthreads;       /* <= 0: all online CPUs */
+  int verbose;
+} wavemoth_precompute_options_t;
+
+/* Defaults as scripts/precompute.py: lmax = mmax = 2 * Nside, chunk_size 64,
+   eps 1e-10, memop_cost 20 and no cost_model, deterministic IDs */
+void wavemoth_precompute_default_options(wavemoth_precompute_options_t *opts, int Nside);
+
+/*
+Compute the serialized matrix for (m, odd), using opts->nthreads
+threads. On success, *out_data (16-byte aligned, free with free())
+and *out_len are set and 0 returned. Returns -1 on error (out of memory, or a numerically
+unstable Legendre recurrence start).
+*/
+int wavemoth_precompute_matrix(const wavemoth_precompute_options_t *opts, int m, int odd,
+                               char **out_data, size_t *out_len);
+
+/*
+x^2 = cos(theta)^2 of the 2 * Nside HEALPix rings of the northern
+hemisphere, starting at the equator; the table of the resource file
+header, which the residual payloads refer to.
+*/
+void wavemoth_precompute_ring_x_squared(int Nside, double *x_squared);
+
+/*
+As wavemoth_precompute_matrix, but with no butterfly compression: the
+matrix is a single residual block, i.e. the starting values of the
+Legendre recurrence for each strip of columns and nothing else. Its
+size is O(Nside) rather than O(Nside * lmax), and it is quick to
+compute, so that it can be generated at plan creation time (see
+WAVEMOTH_ON_THE_FLY in wavemoth.h). Single-threaded.
+*/
+int wavemoth_precompute_uncompressed_matrix(int Nside, int lmax, int m, int odd,
+                                            char **out_data, size_t *out_len);
+
+/*
+Write a complete resource file. The data is written to
+<filename>.partial, which is renamed to filename when complete, so
+that readers never see a partial file. Every matrix is recorded with
+its CRC-32 in a journal, kept as <filename>.journal; if the run is
+interrupted, calling this again with the same options resumes it,
+keeping the matrices already written. Returns 0 on success, -1 on
+error.
+*/
+int wavemoth_precompute_resources(const char *filename,
+                                  const wavemoth_precompute_options_t *opts);
+
+/*
+Recompute the matrices of the nms values of m in ms (both parities)
+of the existing resource file filename, e.g. with another eps, and
+copy the others from it (verified against <filename>.journal; bad
+ones are recomputed). The new file replaces filename as for
+wavemoth_precompute_resources, and can be resumed the same way.
+Nside, lmax and mmax of opts must match the file, and its journal
+must be present and of the current JOURNAL_VERSION, so that matrices
+of an older format are never copied; returns -1 otherwise.
+*/
+int wavemoth_precompute_regenerate(const char *filename,
+                                   const wavemoth_precompute_options_t *opts,
+                                   const int *ms, size_t nms);
+
+#endif
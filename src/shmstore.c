@@ -0,0 +1,212 @@
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <numa.h>
+
+#include "shmstore.h"
+
+#define SHM_MAGIC 0x53485357564d4f54ULL
+#define HEADER_SIZE 4096
+#define HUGE_2MB ((size_t)1 << 21)
+#define DEFAULT_HUGETLBFS "/dev/hugepages"
+
+typedef struct {
+  uint64_t magic, key;
+  int64_t data_size;
+  int32_t ready;
+  int32_t refcount; /* attached processes */
+} shm_header_t;
+
+uint64_t wavemoth_hash_bytes(uint64_t hash, const void *buf, size_t len) {
+  /* FNV-1a */
+  const unsigned char *p = buf;
+  for (size_t i = 0; i != len; ++i) {
+    hash ^= p[i];
+    hash *= 1099511628211ULL;
+  }
+  return hash;
+}
+
+static const char *hugetlbfs_dir(void) {
+  const char *dir = getenv("WAVEMOTH_HUGETLBFS");
+  return (dir != NULL) ? dir : DEFAULT_HUGETLBFS;
+}
+
+static int open_segment_flags(const char *name, int hugetlbfs, int flags) {
+  if (hugetlbfs) {
+    char path[1024];
+    snprintf(path, sizeof(path), "%s%s", hugetlbfs_dir(), name);
+    return open(path, flags, 0644);
+  } else {
+    return shm_open(name, flags, 0644);
+  }
+}
+
+/* Open the segment, creating it if it does not exist; *created tells
+   whether this call did */
+static int open_segment(const char *name, int hugetlbfs, int *created) {
+  int fd = open_segment_flags(name, hugetlbfs, O_RDWR | O_CREAT | O_EXCL);
+  *created = (fd != -1);
+  if (fd == -1 && errno == EEXIST) fd = open_segment_flags(name, hugetlbfs, O_RDWR);
+  return fd;
+}
+
+static void unlink_segment(const char *name, int hugetlbfs) {
+  if (hugetlbfs) {
+    char path[1024];
+    snprintf(path, sizeof(path), "%s%s", hugetlbfs_dir(), name);
+    unlink(path);
+  } else {
+    shm_unlink(name);
+  }
+}
+
+static shm_header_t *header_of(wavemoth_shm_segment_t *seg) {
+  return (shm_header_t*)seg->base;
+}
+
+static void lock_name(char *name, size_t len, uint64_t key) {
+  snprintf(name, len, "/wavemoth-%016llx.lock", (unsigned long long)key);
+}
+
+/* Whether fd is still the lock object of the name, which the last
+   process to detach unlinks (see wavemoth_shm_detach) */
+static int is_current_lock(int fd, const char *name) {
+  struct stat st_fd, st_name;
+  int name_fd = shm_open(name, O_RDWR, 0644), same;
+  if (name_fd == -1) return 0;
+  same = (fstat(fd, &st_fd) == 0 && fstat(name_fd, &st_name) == 0 &&
+          st_fd.st_dev == st_name.st_dev && st_fd.st_ino == st_name.st_ino);
+  close(name_fd);
+  return same;
+}
+
+int wavemoth_shm_lock(uint64_t key) {
+  char name[64];
+  int fd;
+  lock_name(name, sizeof(name), key);
+  while (1) {
+    fd = shm_open(name, O_RDWR | O_CREAT, 0644);
+    if (fd == -1) return -1;
+    while (flock(fd, LOCK_EX) != 0) {
+      if (errno != EINTR) {
+        close(fd);
+        return -1;
+      }
+    }
+    if (is_current_lock(fd, name)) return fd;
+    /* Unlinked while we waited; lock the new one */
+    close(fd);
+  }
+}
+
+void wavemoth_shm_unlock(int lock_fd) {
+  flock(lock_fd, LOCK_UN);
+  close(lock_fd);
+}
+
+/* Open (creating if needed), size and map the segment seg->name. On
+   failure, a file this call created is removed again (e.g. hugetlbfs
+   without huge pages reserved, so that the next attempt does not trip
+   over it); one that existed may be in use by other processes and is
+   left alone. */
+static int map_segment(wavemoth_shm_segment_t *seg, int hugetlbfs) {
+  struct stat st;
+  int created;
+  int fd = open_segment(seg->name, hugetlbfs, &created);
+  if (fd == -1) return -1;
+  if (fstat(fd, &st) != 0) goto ERROR;
+  if (st.st_size == 0) {
+    if (ftruncate(fd, seg->mapped_size) != 0) goto ERROR;
+  } else if ((size_t)st.st_size != seg->mapped_size) {
+    goto ERROR;
+  }
+  seg->base = mmap(NULL, seg->mapped_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (seg->base == MAP_FAILED) {
+    seg->base = NULL;
+    goto ERROR;
+  }
+  close(fd);
+  seg->hugetlbfs = hugetlbfs;
+  return 0;
+ ERROR:
+  close(fd);
+  if (created) unlink_segment(seg->name, hugetlbfs);
+  return -1;
+}
+
+int wavemoth_shm_attach(wavemoth_shm_segment_t *seg, uint64_t key, int node_id,
+                        size_t data_size, int use_hugepages) {
+  shm_header_t *header;
+  int ret = -1;
+
+  snprintf(seg->name, sizeof(seg->name), "/wavemoth-%016llx-n%d",
+           (unsigned long long)key, node_id);
+  seg->base = NULL;
+  seg->needs_fill = 0;
+  seg->mapped_size = HEADER_SIZE + data_size;
+  seg->hugetlbfs = 0;
+  if (use_hugepages) {
+    seg->mapped_size = (seg->mapped_size + HUGE_2MB - 1) / HUGE_2MB * HUGE_2MB;
+    ret = map_segment(seg, 1);
+  }
+  if (ret != 0) ret = map_segment(seg, 0);
+  if (ret != 0) return -1;
+  seg->data = seg->base + HEADER_SIZE;
+
+  header = header_of(seg);
+  if (header->magic == SHM_MAGIC && header->key == key && header->ready &&
+      header->data_size == (int64_t)data_size) {
+    header->refcount++;
+  } else {
+    /* New, or left half-filled by a process that died */
+    header->magic = SHM_MAGIC;
+    header->key = key;
+    header->data_size = data_size;
+    header->ready = 0;
+    header->refcount = 1;
+    seg->needs_fill = 1;
+    if (node_id >= 0) numa_tonode_memory(seg->data, seg->mapped_size - HEADER_SIZE, node_id);
+#ifdef MADV_HUGEPAGE
+    if (use_hugepages && !seg->hugetlbfs) {
+      madvise(seg->base, seg->mapped_size, MADV_HUGEPAGE);
+    }
+#endif
+  }
+  return 0;
+}
+
+void wavemoth_shm_publish(wavemoth_shm_segment_t *seg) {
+  __sync_synchronize();
+  header_of(seg)->ready = 1;
+  seg->needs_fill = 0;
+  /* Read-only from now on; may fail for huge pages, which is harmless */
+  mprotect(seg->data, seg->mapped_size - HEADER_SIZE, PROT_READ);
+}
+
+void wavemoth_shm_detach(wavemoth_shm_segment_t *seg, uint64_t key) {
+  int lock_fd;
+  if (seg->base == NULL) return;
+  lock_fd = wavemoth_shm_lock(key);
+  if (--header_of(seg)->refcount == 0) {
+    unlink_segment(seg->name, seg->hugetlbfs);
+    if (lock_fd != -1) {
+      /* Last, while still holding it; processes waiting on it notice
+         and move on to a new lock object (see wavemoth_shm_lock) */
+      char name[64];
+      lock_name(name, sizeof(name), key);
+      shm_unlink(name);
+    }
+  }
+  if (lock_fd != -1) wavemoth_shm_unlock(lock_fd);
+  munmap(seg->base, seg->mapped_size);
+  seg->base = NULL;
+}
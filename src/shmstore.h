@@ -0,0 +1,59 @@
+#ifndef _WAVEMOTH_SHMSTORE_H_
+#define _WAVEMOTH_SHMSTORE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+Process-shared store of node-local resource copies.
+
+Each NUMA node's copy of the resources (laid out for the plan's m
+assignment) lives in a named shared memory segment, so that processes
+on the same host running the same configuration share one copy per
+node instead of making private ones. Segments are identified by a key
+hashing the resource file, the node layout and whether huge pages are
+used (see wavemoth_hash_bytes), and the node id.
+
+The first process to need a segment creates and fills it; later ones
+find it ready and only attach. Creation is serialized across processes
+by wavemoth_shm_lock on the key, which is held from the first attach
+until all created segments are published; a process that dies while
+filling releases the lock, and the next one fills the segment anew.
+Segments are refcounted by attached processes and unlinked by the last
+to detach, together with the lock object of the key. Segments left
+behind by crashed processes can be removed from /dev/shm (or the
+hugetlbfs mount).
+
+With use_hugepages, segments are created as files on a hugetlbfs mount
+(WAVEMOTH_HUGETLBFS, default /dev/hugepages) if one is available,
+otherwise POSIX shm with MADV_HUGEPAGE is used; this includes a
+hugetlbfs mount without enough reserved huge pages. A segment that
+cannot be mapped is only removed by the process that created it.
+
+wavemoth_shm_detach takes the lock of the key, so callers must not
+detach a segment of another key while holding a lock.
+*/
+
+typedef struct {
+  char name[64];
+  int hugetlbfs;
+  char *base; /* mapping, starting with the segment header */
+  size_t mapped_size;
+  char *data; /* page-aligned data area */
+  int needs_fill; /* we created it; fill and then call wavemoth_shm_publish */
+} wavemoth_shm_segment_t;
+
+uint64_t wavemoth_hash_bytes(uint64_t hash, const void *buf, size_t len);
+#define WAVEMOTH_HASH_INIT 14695981039346656037ULL
+
+int wavemoth_shm_lock(uint64_t key);
+void wavemoth_shm_unlock(int lock_fd);
+
+/* Caller must hold the lock. Returns -1 on failure. */
+int wavemoth_shm_attach(wavemoth_shm_segment_t *seg, uint64_t key, int node_id,
+                        size_t data_size, int use_hugepages);
+/* Mark a filled segment as ready for other processes. Caller must hold the lock. */
+void wavemoth_shm_publish(wavemoth_shm_segment_t *seg);
+void wavemoth_shm_detach(wavemoth_shm_segment_t *seg, uint64_t key);
+
+#endif
@@ -0,0 +1,282 @@
+/*
+Plan snapshots, see wavemoth_plan_save in wavemoth.h.
+
+A snapshot directory contains
+
+  plan.dat:     Header and layout (below), written last so that an
+                incomplete snapshot is never loaded
+  node<i>.arena: The resource arena of node i, padded to a whole
+                number of pages
+  fftw.wisdom:  FFTW wisdom
+
+plan.dat consists of int64_t fields:
+
+  magic, version, resource_format, Nside, lmax, mmax, nmaps, flags,
+  threads_per_cpu, nnodes, ncpu_ids
+
+where resource_format is the RESOURCE_FORMAT_VERSION of the matrices
+in the arenas; snapshots of another format are not loaded.
+  cpu_ids[ncpu_ids]: Grouped by node; for each CPU plan its CPU id
+      followed by any SMT siblings hosting its workers
+  for each node: node_id, mem_concurrency, arena_size
+  lens[2 * (mmax + 1)]: Length of the matrix (m, odd) at 2 * m + odd
+*/
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include "wavemoth.h"
+#include "wavemoth_private.h"
+#include "hugepages.h"
+
+#define SNAPSHOT_MAGIC 0x31304e414c504d57LL /* "WMPLAN01" */
+#define SNAPSHOT_VERSION 2
+#define NHEADER 11
+
+static void snapshot_filename(char *buf, size_t buflen, const char *dirname,
+                              const char *name) {
+  snprintf(buf, buflen, "%s/%s", dirname, name);
+  buf[buflen - 1] = '\0';
+}
+
+static int write_all(int fd, const char *buf, size_t len) {
+  while (len > 0) {
+    ssize_t n = write(fd, buf, len);
+    if (n <= 0) return -1;
+    buf += n;
+    len -= n;
+  }
+  return 0;
+}
+
+static int write_file(const char *filename, const char *buf, size_t len, size_t padded_len) {
+  int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  int retcode = 0;
+  if (fd == -1) return -1;
+  if (write_all(fd, buf, len) != 0) retcode = -1;
+  if (retcode == 0 && padded_len > len && ftruncate(fd, padded_len) != 0) retcode = -1;
+  if (close(fd) != 0) retcode = -1;
+  return retcode;
+}
+
+static int pread_all(int fd, char *buf, size_t len) {
+  size_t pos = 0;
+  while (pos != len) {
+    ssize_t n = pread(fd, buf + pos, len - pos, pos);
+    if (n <= 0) return -1;
+    pos += n;
+  }
+  return 0;
+}
+
+static char *read_file(const char *filename, size_t *out_len) {
+  FILE *f = fopen(filename, "rb");
+  char *buf;
+  long len;
+  if (f == NULL) return NULL;
+  fseek(f, 0, SEEK_END);
+  len = ftell(f);
+  fseek(f, 0, SEEK_SET);
+  buf = malloc(len + 1);
+  if (fread(buf, 1, len, f) != (size_t)len) {
+    free(buf);
+    fclose(f);
+    return NULL;
+  }
+  buf[len] = '\0';
+  fclose(f);
+  if (out_len != NULL) *out_len = len;
+  return buf;
+}
+
+/* Bytes of the node's arena in use; matrices are laid out in im order */
+static size_t arena_used(wavemoth_node_plan_t *np) {
+  size_t used = 0;
+  for (size_t im = 0; im != np->nm; ++im) {
+    for (int odd = 0; odd != 2; ++odd) {
+      size_t end = np->m_resources[im].data[odd] + np->m_resources[im].len[odd] -
+        np->resource_arena;
+      if (end > used) used = end;
+    }
+  }
+  return used;
+}
+
+int wavemoth_plan_save(wavemoth_plan plan, const char *dirname) {
+  char filename[MAX_SNAPSHOT_PATH], tmpname[MAX_SNAPSHOT_PATH], arena_name[64];
+  size_t pagesize = getpagesize();
+  int64_t *buf = NULL;
+  size_t n, nbuf;
+  int retcode = -1;
+  char *wisdom = NULL;
+
+  if (plan->flags & WAVEMOTH_NO_RESOURCE_COPY) return -1;
+
+  /* Arenas */
+  for (int inode = 0; inode != plan->nnodes; ++inode) {
+    wavemoth_node_plan_t *np = plan->node_plans[inode];
+    size_t used = arena_used(np);
+    snprintf(arena_name, sizeof(arena_name), "node%d.arena", inode);
+    snapshot_filename(filename, sizeof(filename), dirname, arena_name);
+    if (write_file(filename, np->resource_arena, used,
+                   (used + pagesize - 1) / pagesize * pagesize) != 0) goto FINALLY;
+  }
+
+  /* Wisdom */
+  wisdom = wavemoth_export_wisdom();
+  snapshot_filename(filename, sizeof(filename), dirname, "fftw.wisdom");
+  if (wisdom == NULL || write_file(filename, wisdom, strlen(wisdom), 0) != 0) goto FINALLY;
+
+  /* Header and layout */
+  int ncpu_ids = 0;
+  for (int inode = 0; inode != plan->nnodes; ++inode) {
+    for (int icpu = 0; icpu != plan->node_plans[inode]->ncpus; ++icpu) {
+      ncpu_ids += plan->node_plans[inode]->cpu_plans[icpu].nsiblings;
+    }
+  }
+  nbuf = NHEADER + ncpu_ids + 3 * plan->nnodes + 2 * (plan->mmax + 1);
+  buf = calloc(nbuf, sizeof(int64_t));
+  n = 0;
+  buf[n++] = SNAPSHOT_MAGIC;
+  buf[n++] = SNAPSHOT_VERSION;
+  buf[n++] = RESOURCE_FORMAT_VERSION;
+  buf[n++] = plan->Nside;
+  buf[n++] = plan->lmax;
+  buf[n++] = plan->mmax;
+  buf[n++] = plan->nmaps;
+  buf[n++] = plan->flags;
+  buf[n++] = plan->threads_per_cpu;
+  buf[n++] = plan->nnodes;
+  buf[n++] = ncpu_ids;
+  for (int inode = 0; inode != plan->nnodes; ++inode) {
+    wavemoth_node_plan_t *np = plan->node_plans[inode];
+    for (int icpu = 0; icpu != np->ncpus; ++icpu) {
+      for (int k = 0; k != np->cpu_plans[icpu].nsiblings; ++k) {
+        buf[n++] = np->cpu_plans[icpu].sibling_ids[k];
+      }
+    }
+  }
+  for (int inode = 0; inode != plan->nnodes; ++inode) {
+    wavemoth_node_plan_t *np = plan->node_plans[inode];
+    buf[n++] = np->node_id;
+    buf[n++] = np->mem_concurrency;
+    buf[n++] = arena_used(np);
+  }
+  for (int inode = 0; inode != plan->nnodes; ++inode) {
+    wavemoth_node_plan_t *np = plan->node_plans[inode];
+    for (size_t im = 0; im != np->nm; ++im) {
+      for (int odd = 0; odd != 2; ++odd) {
+        buf[n + 2 * np->m_resources[im].m + odd] = np->m_resources[im].len[odd];
+      }
+    }
+  }
+  snapshot_filename(tmpname, sizeof(tmpname), dirname, "plan.dat.tmp");
+  snapshot_filename(filename, sizeof(filename), dirname, "plan.dat");
+  if (write_file(tmpname, (char*)buf, sizeof(int64_t[nbuf]), 0) != 0) goto FINALLY;
+  if (rename(tmpname, filename) != 0) goto FINALLY;
+  retcode = 0;
+ FINALLY:
+  free(buf);
+  free(wisdom);
+  return retcode;
+}
+
+void wavemoth_free_plan_snapshot(wavemoth_plan_snapshot_t *snapshot) {
+  if (snapshot->arenas != NULL) {
+    for (int inode = 0; inode != snapshot->nnodes; ++inode) {
+      if (snapshot->arenas[inode] != NULL) {
+        wavemoth_free_large(snapshot->arenas[inode], snapshot->arena_sizes[inode]);
+      }
+    }
+  }
+  free(snapshot->node_ids);
+  free(snapshot->mem_concurrency);
+  free(snapshot->arenas);
+  free(snapshot->arena_sizes);
+  free(snapshot->lens);
+  free(snapshot->wisdom);
+  free(snapshot);
+}
+
+wavemoth_plan wavemoth_plan_load(const char *dirname, double *input, double *output) {
+  char filename[MAX_SNAPSHOT_PATH], arena_name[64];
+  wavemoth_plan_snapshot_t *snapshot = calloc(1, sizeof(wavemoth_plan_snapshot_t));
+  wavemoth_plan plan = NULL;
+  int64_t *buf;
+  size_t len, n, nbuf;
+  int *cpu_ids = NULL;
+  int64_t Nside, lmax, mmax, nmaps, flags, nnodes, ncpu_ids;
+
+  snapshot_filename(filename, sizeof(filename), dirname, "plan.dat");
+  buf = (int64_t*)read_file(filename, &len);
+  if (buf == NULL) goto FINALLY;
+  nbuf = len / sizeof(int64_t);
+  if (nbuf < NHEADER || buf[0] != SNAPSHOT_MAGIC || buf[1] != SNAPSHOT_VERSION ||
+      buf[2] != RESOURCE_FORMAT_VERSION) goto FINALLY;
+  Nside = buf[3];
+  lmax = buf[4];
+  mmax = buf[5];
+  nmaps = buf[6];
+  flags = buf[7];
+  snapshot->threads_per_cpu = buf[8];
+  nnodes = buf[9];
+  ncpu_ids = buf[10];
+  if (nbuf != NHEADER + ncpu_ids + 3 * nnodes + 2 * (mmax + 1)) goto FINALLY;
+  n = NHEADER;
+
+  cpu_ids = malloc(sizeof(int[ncpu_ids]));
+  for (int i = 0; i != ncpu_ids; ++i) cpu_ids[i] = buf[n++];
+
+  snapshot->nnodes = nnodes;
+  snapshot->node_ids = malloc(sizeof(int[nnodes]));
+  snapshot->mem_concurrency = malloc(sizeof(int[nnodes]));
+  snapshot->arenas = calloc(nnodes, sizeof(char*));
+  snapshot->arena_sizes = calloc(nnodes, sizeof(size_t));
+  for (int inode = 0; inode != nnodes; ++inode) {
+    struct stat fileinfo;
+    int fd;
+    snapshot->node_ids[inode] = buf[n++];
+    snapshot->mem_concurrency[inode] = buf[n++];
+    snapshot->arena_sizes[inode] = buf[n++];
+    snprintf(arena_name, sizeof(arena_name), "node%d.arena", inode);
+    snapshot_filename(filename, sizeof(filename), dirname, arena_name);
+    fd = open(filename, O_RDONLY);
+    if (fd == -1) goto FINALLY;
+    if (fstat(fd, &fileinfo) != 0 || (size_t)fileinfo.st_size < snapshot->arena_sizes[inode]) {
+      close(fd);
+      goto FINALLY;
+    }
+    /* Read into memory bound to the node; mapping the file would
+       leave the pages wherever the page cache has them */
+    size_t used = snapshot->arena_sizes[inode];
+    snapshot->arenas[inode] = wavemoth_alloc_large((used == 0) ? 1 : used,
+                                                   snapshot->node_ids[inode],
+                                                   (flags & WAVEMOTH_HUGEPAGES) != 0,
+                                                   &snapshot->arena_sizes[inode]);
+    if (snapshot->arenas[inode] == NULL ||
+        pread_all(fd, snapshot->arenas[inode], used) != 0) {
+      close(fd);
+      goto FINALLY;
+    }
+    close(fd);
+  }
+  snapshot->lens = malloc(sizeof(size_t[2 * (mmax + 1)]));
+  for (int i = 0; i != 2 * (mmax + 1); ++i) snapshot->lens[i] = buf[n++];
+
+  snapshot_filename(filename, sizeof(filename), dirname, "fftw.wisdom");
+  snapshot->wisdom = read_file(filename, NULL);
+
+  plan = wavemoth_create_plan(Nside, lmax, mmax, nmaps, ncpu_ids, cpu_ids, input, output,
+                              WAVEMOTH_MMAJOR, flags, NULL, snapshot);
+ FINALLY:
+  if (plan == NULL) wavemoth_free_plan_snapshot(snapshot);
+  free(cpu_ids);
+  free(buf);
+  return plan;
+}
@@ -0,0 +1,225 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include "taskpool.h"
+
+typedef struct {
+  wavemoth_task_func_t func;
+  void *arg;
+  wavemoth_taskgroup_t *group;
+} task_t;
+
+/* Tasks [top, bottom) of a worker; the lock is only contended by thieves */
+typedef struct {
+  task_t *tasks;
+  size_t top, bottom, capacity;
+  pthread_mutex_t lock;
+} deque_t;
+
+typedef struct {
+  wavemoth_taskpool_t *pool;
+  int index;
+} worker_t;
+
+struct _wavemoth_taskpool {
+  int nworkers, nstarted;
+  deque_t *deques; /* [nworkers + 1]; the last is the queue of outside threads */
+  worker_t *workers;
+  pthread_t *threads;
+  int epoch; /* bumped on every spawn, so that sleeping workers do not miss tasks */
+  int nsleeping, shutdown;
+  pthread_mutex_t lock;
+  pthread_cond_t work_cond, done_cond;
+};
+
+static __thread wavemoth_taskpool_t *current_pool = NULL;
+static __thread int current_index;
+
+static int atomic_read(int *x) {
+  return __sync_fetch_and_add(x, 0);
+}
+
+static int deque_push(deque_t *d, task_t task) {
+  int ret = 0;
+  pthread_mutex_lock(&d->lock);
+  if (d->bottom == d->capacity) {
+    if (d->top > 0) {
+      memmove(d->tasks, d->tasks + d->top, sizeof(task_t[d->bottom - d->top]));
+      d->bottom -= d->top;
+      d->top = 0;
+    } else {
+      size_t capacity = (d->capacity == 0) ? 64 : 2 * d->capacity;
+      task_t *tasks = realloc(d->tasks, sizeof(task_t[capacity]));
+      if (tasks == NULL) {
+        ret = -1;
+        goto FINALLY;
+      }
+      d->tasks = tasks;
+      d->capacity = capacity;
+    }
+  }
+  d->tasks[d->bottom++] = task;
+ FINALLY:
+  pthread_mutex_unlock(&d->lock);
+  return ret;
+}
+
+/* Take the newest task (from_top == 0) or the oldest (from_top == 1) */
+static int deque_take(deque_t *d, int from_top, task_t *task) {
+  int found = 0;
+  pthread_mutex_lock(&d->lock);
+  if (d->top != d->bottom) {
+    *task = from_top ? d->tasks[d->top++] : d->tasks[--d->bottom];
+    if (d->top == d->bottom) d->top = d->bottom = 0;
+    found = 1;
+  }
+  pthread_mutex_unlock(&d->lock);
+  return found;
+}
+
+static int find_task(wavemoth_taskpool_t *pool, int self, int include_queue,
+                     task_t *task) {
+  int n = pool->nworkers;
+  if (deque_take(&pool->deques[self], 0, task)) return 1;
+  for (int i = 1; i != n; ++i) {
+    if (deque_take(&pool->deques[(self + i) % n], 1, task)) return 1;
+  }
+  return include_queue && deque_take(&pool->deques[n], 1, task);
+}
+
+static void run_task(wavemoth_taskpool_t *pool, task_t *task) {
+  task->func(task->arg);
+  if (__sync_sub_and_fetch(&task->group->pending, 1) == 0) {
+    /* For outside threads waiting on the group */
+    pthread_mutex_lock(&pool->lock);
+    pthread_cond_broadcast(&pool->done_cond);
+    pthread_mutex_unlock(&pool->lock);
+  }
+}
+
+static void *worker_main(void *ctx) {
+  worker_t *worker = ctx;
+  wavemoth_taskpool_t *pool = worker->pool;
+  task_t task;
+  current_pool = pool;
+  current_index = worker->index;
+  while (1) {
+    int epoch = atomic_read(&pool->epoch);
+    if (find_task(pool, worker->index, 1, &task)) {
+      run_task(pool, &task);
+      continue;
+    }
+    pthread_mutex_lock(&pool->lock);
+    if (pool->shutdown) {
+      pthread_mutex_unlock(&pool->lock);
+      break;
+    }
+    __sync_fetch_and_add(&pool->nsleeping, 1);
+    if (atomic_read(&pool->epoch) == epoch) {
+      pthread_cond_wait(&pool->work_cond, &pool->lock);
+    }
+    __sync_fetch_and_sub(&pool->nsleeping, 1);
+    pthread_mutex_unlock(&pool->lock);
+  }
+  return NULL;
+}
+
+wavemoth_taskpool_t *wavemoth_taskpool_create(int nthreads) {
+  wavemoth_taskpool_t *pool = calloc(1, sizeof(wavemoth_taskpool_t));
+  if (nthreads < 1) nthreads = 1;
+  if (pool == NULL) return NULL;
+  pool->nworkers = nthreads;
+  pool->deques = calloc(nthreads + 1, sizeof(deque_t));
+  pool->workers = malloc(sizeof(worker_t[nthreads]));
+  pool->threads = malloc(sizeof(pthread_t[nthreads]));
+  if (pool->deques == NULL || pool->workers == NULL || pool->threads == NULL) {
+    free(pool->deques);
+    free(pool->workers);
+    free(pool->threads);
+    free(pool);
+    return NULL;
+  }
+  for (int i = 0; i != nthreads + 1; ++i) pthread_mutex_init(&pool->deques[i].lock, NULL);
+  pthread_mutex_init(&pool->lock, NULL);
+  pthread_cond_init(&pool->work_cond, NULL);
+  pthread_cond_init(&pool->done_cond, NULL);
+  for (; pool->nstarted != nthreads; ++pool->nstarted) {
+    worker_t *worker = &pool->workers[pool->nstarted];
+    worker->pool = pool;
+    worker->index = pool->nstarted;
+    if (pthread_create(&pool->threads[pool->nstarted], NULL, worker_main, worker) != 0) {
+      wavemoth_taskpool_destroy(pool);
+      return NULL;
+    }
+  }
+  return pool;
+}
+
+void wavemoth_taskpool_destroy(wavemoth_taskpool_t *pool) {
+  if (pool == NULL) return;
+  pthread_mutex_lock(&pool->lock);
+  pool->shutdown = 1;
+  pthread_cond_broadcast(&pool->work_cond);
+  pthread_mutex_unlock(&pool->lock);
+  for (int i = 0; i != pool->nstarted; ++i) pthread_join(pool->threads[i], NULL);
+  for (int i = 0; i != pool->nworkers + 1; ++i) {
+    free(pool->deques[i].tasks);
+    pthread_mutex_destroy(&pool->deques[i].lock);
+  }
+  pthread_mutex_destroy(&pool->lock);
+  pthread_cond_destroy(&pool->work_cond);
+  pthread_cond_destroy(&pool->done_cond);
+  free(pool->deques);
+  free(pool->workers);
+  free(pool->threads);
+  free(pool);
+}
+
+void wavemoth_taskpool_spawn(wavemoth_taskpool_t *pool, wavemoth_taskgroup_t *group,
+                             wavemoth_task_func_t func, void *arg) {
+  task_t task = {func, arg, group};
+  int target;
+  if (pool == NULL) {
+    func(arg);
+    return;
+  }
+  target = (current_pool == pool) ? current_index : pool->nworkers;
+  __sync_fetch_and_add(&group->pending, 1);
+  if (deque_push(&pool->deques[target], task) != 0) {
+    __sync_fetch_and_sub(&group->pending, 1);
+    func(arg);
+    return;
+  }
+  /* Pairs with the nsleeping/epoch check of worker_main */
+  __sync_fetch_and_add(&pool->epoch, 1);
+  if (atomic_read(&pool->nsleeping) > 0) {
+    pthread_mutex_lock(&pool->lock);
+    pthread_cond_signal(&pool->work_cond);
+    pthread_mutex_unlock(&pool->lock);
+  }
+}
+
+void wavemoth_taskpool_wait(wavemoth_taskpool_t *pool, wavemoth_taskgroup_t *group) {
+  task_t task;
+  if (pool == NULL) return;
+  if (current_pool == pool) {
+    /* Help out rather than block; tasks of the outside queue are left
+       to idle workers, so that the nesting of waits stays shallow */
+    while (atomic_read(&group->pending) > 0) {
+      if (find_task(pool, current_index, 0, &task)) {
+        run_task(pool, &task);
+      } else {
+        sched_yield();
+      }
+    }
+  } else {
+    pthread_mutex_lock(&pool->lock);
+    while (atomic_read(&group->pending) > 0) {
+      pthread_cond_wait(&pool->done_cond, &pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+  }
+}
@@ -0,0 +1,45 @@
+#ifndef _WAVEMOTH_TASKPOOL_H_
+#define _WAVEMOTH_TASKPOOL_H_
+
+/*
+Work-stealing pool for fork-join parallelism, used by the
+precomputation (precompute.c) to compress a single large matrix on
+several threads.
+
+Each worker has a deque of tasks. A worker pushes the tasks it
+spawns at the bottom and takes its own work from the bottom, while
+idle workers steal from the top of the other deques, which holds the
+oldest, and hence usually largest, tasks. Tasks spawned by threads
+outside the pool go to a shared FIFO queue, which workers only take
+from when idle.
+
+wavemoth_taskpool_wait lets a worker keep running tasks until the
+tasks of the group are done, so tasks may spawn and wait for subtasks
+recursively.
+
+With pool == NULL, tasks are run immediately by the spawning thread.
+*/
+
+typedef struct _wavemoth_taskpool wavemoth_taskpool_t;
+
+typedef void (*wavemoth_task_func_t)(void *arg);
+
+/* A set of tasks to wait for; initialize with {0} */
+typedef struct {
+  int pending;
+} wavemoth_taskgroup_t;
+
+/* Start nthreads workers; returns NULL on failure */
+wavemoth_taskpool_t *wavemoth_taskpool_create(int nthreads);
+
+/* Wait for all tasks to finish, then stop the workers */
+void wavemoth_taskpool_destroy(wavemoth_taskpool_t *pool);
+
+/* Run func(arg) as part of group; runs it immediately if out of memory */
+void wavemoth_taskpool_spawn(wavemoth_taskpool_t *pool, wavemoth_taskgroup_t *group,
+                             wavemoth_task_func_t func, void *arg);
+
+/* Return when all tasks spawned in group have finished */
+void wavemoth_taskpool_wait(wavemoth_taskpool_t *pool, wavemoth_taskgroup_t *group);
+
+#endif
@@ -0,0 +1,107 @@
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sched.h>
+#include <numa.h>
+
+#include "topology.h"
+
+static int read_core_id(int cpu_id) {
+  char filename[256], buf[1024];
+  int core_id = cpu_id;
+  FILE *f;
+  snprintf(filename, sizeof(filename),
+           "/sys/devices/system/cpu/cpu%d/topology/thread_siblings_list", cpu_id);
+  f = fopen(filename, "r");
+  if (f == NULL) return core_id;
+  if (fgets(buf, sizeof(buf), f) != NULL) {
+    /* The list is sorted, e.g. "3,35" or "6-7"; the first entry is the lowest */
+    core_id = atoi(buf);
+  }
+  fclose(f);
+  return core_id;
+}
+
+static int is_usable(int cpu_id, cpu_set_t *affinity, size_t affinity_size,
+                     struct bitmask *nodemask) {
+  int node_id;
+  if (!CPU_ISSET_S(cpu_id, affinity_size, affinity)) return 0;
+  node_id = numa_node_of_cpu(cpu_id);
+  return node_id >= 0 && numa_bitmask_isbitset(nodemask, node_id);
+}
+
+int wavemoth_discover_topology(wavemoth_topology_t *topo, const int *cpu_list,
+                               int ncpu_list) {
+  int ncpus_possible = numa_num_possible_cpus();
+  size_t affinity_size = CPU_ALLOC_SIZE(ncpus_possible);
+  cpu_set_t *affinity = CPU_ALLOC(ncpus_possible);
+  struct bitmask *nodemask = numa_allocate_nodemask(), *run_nodes, *mem_nodes;
+  int retcode = 0, n = 0;
+
+  topo->cpus = NULL;
+  topo->ncpus = 0;
+
+  /* Nodes in both cpubind and membind */
+  run_nodes = numa_get_run_node_mask();
+  mem_nodes = numa_get_membind();
+  for (int i = 0; i <= numa_max_node(); ++i) {
+    if (numa_bitmask_isbitset(run_nodes, i) && numa_bitmask_isbitset(mem_nodes, i)) {
+      numa_bitmask_setbit(nodemask, i);
+    }
+  }
+  numa_free_nodemask(run_nodes);
+  numa_free_nodemask(mem_nodes);
+
+  CPU_ZERO_S(affinity_size, affinity);
+  if (sched_getaffinity(0, affinity_size, affinity) != 0) {
+    retcode = -1;
+    goto FINALLY;
+  }
+
+  topo->cpus = malloc(sizeof(wavemoth_cpu_info_t[ncpus_possible]));
+  if (cpu_list != NULL) {
+    for (int i = 0; i != ncpu_list; ++i) {
+      int cpu_id = cpu_list[i];
+      if (cpu_id < 0 || cpu_id >= ncpus_possible ||
+          !is_usable(cpu_id, affinity, affinity_size, nodemask)) {
+        retcode = -1;
+        goto FINALLY;
+      }
+      for (int j = 0; j != i; ++j) {
+        if (cpu_list[j] == cpu_id) {
+          retcode = -1;
+          goto FINALLY;
+        }
+      }
+      topo->cpus[n++].cpu_id = cpu_id;
+    }
+  } else {
+    for (int cpu_id = 0; cpu_id != ncpus_possible; ++cpu_id) {
+      if (is_usable(cpu_id, affinity, affinity_size, nodemask)) {
+        topo->cpus[n++].cpu_id = cpu_id;
+      }
+    }
+  }
+  for (int i = 0; i != n; ++i) {
+    topo->cpus[i].node_id = numa_node_of_cpu(topo->cpus[i].cpu_id);
+    topo->cpus[i].core_id = read_core_id(topo->cpus[i].cpu_id);
+  }
+  topo->ncpus = n;
+
+ FINALLY:
+  if (retcode != 0) {
+    free(topo->cpus);
+    topo->cpus = NULL;
+  }
+  CPU_FREE(affinity);
+  numa_free_nodemask(nodemask);
+  return retcode;
+}
+
+void wavemoth_free_topology(wavemoth_topology_t *topo) {
+  free(topo->cpus);
+  topo->cpus = NULL;
+  topo->ncpus = 0;
+}
@@ -0,0 +1,37 @@
+#ifndef _WAVEMOTH_TOPOLOGY_H_
+#define _WAVEMOTH_TOPOLOGY_H_
+
+/*
+Discovery of the CPUs a plan may run on. A CPU is usable if it is in
+the affinity mask of the process (sched_getaffinity; this reflects
+cpusets/cgroups and taskset), and its NUMA node is in both the run
+node mask and the memory binding (numactl --cpunodebind/--membind).
+
+Physical cores are identified from sysfs (thread_siblings_list), so
+that SMT siblings can be told apart from separate cores.
+*/
+
+typedef struct {
+  int cpu_id;
+  int node_id;
+  int core_id; /* lowest CPU id among the SMT siblings of this CPU */
+} wavemoth_cpu_info_t;
+
+typedef struct {
+  wavemoth_cpu_info_t *cpus;
+  int ncpus;
+} wavemoth_topology_t;
+
+/*
+Fill in topo with the usable CPUs, in increasing order of CPU id.
+
+If cpu_list is not NULL, the result is instead exactly the ncpu_list
+CPUs listed, in the given order. Returns -1 (leaving topo empty) if
+any of them is not usable or listed twice.
+*/
+int wavemoth_discover_topology(wavemoth_topology_t *topo, const int *cpu_list,
+                               int ncpu_list);
+
+void wavemoth_free_topology(wavemoth_topology_t *topo);
+
+#endif
@@ -19,6 +19,7 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/mman.h>
+#include <sys/syscall.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <errno.h>
@@ -43,18 +44,22 @@
 #include "blas.h"
 #include "butterfly_utils.h"
 #include "legendre_transform.h"
+#include "topology.h"
+#include "hugepages.h"
+#include "arena.h"
+#include "precompute.h"
 
 typedef __m128d m128d;
 
 #define CACHELINE 64
-#define THREADS_PER_CPU 1
-#define CONCURRENT_MEMORY_BUS_USE 1
-/*
-Every time resource format changes, we increase this, so that
-we can keep multiple resource files around and jump in git
-history.
-*/
-#define RESOURCE_FORMAT_VERSION 1
+#define COSCHEDULE_THREADS_PER_CPU 2
+/* Bandwidth calibration for WAVEMOTH_COSCHEDULE: Buffer streamed by
+   each thread, and fraction of peak node bandwidth at which we consider
+   the memory bus saturated. */
+#define CALIBRATE_BUF_SIZE (32 * 1024 * 1024)
+#define BANDWIDTH_SATURATION 0.9
+/* Alignment of each matrix in the node-local resource arena */
+#define RESOURCE_ALIGN 128
 /*#define RESOURCE_HEADER "butterfly-compressed matrix data"*/
 
 #define PI 3.14159265358979323846
@@ -67,10 +72,18 @@ static INLINE int imin(int a, int b) {
   return (a < b) ? a : b;
 }
 
+static INLINE int imax(int a, int b) {
+  return (a > b) ? a : b;
+}
+
 static INLINE size_t zmax(size_t a, size_t b) {
   return (a > b) ? a : b;
 }
 
+static INLINE size_t round_up_size(size_t size, size_t align) {
+  return (size + align - 1) / align * align;
+}
+
 /** A more useful mod function; the result will have the same sign as
     the divisor rather than the dividend.
  */
@@ -82,23 +95,53 @@ static INLINE int imod_divisorsign(int a, int b) {
   return r;
 }
 
-/*
-Global storage of precomputed data.
+#define MAX_RESOURCE_PATH 2048
+static char global_resource_path[MAX_RESOURCE_PATH];
 
-Precomputed data is stored as:
- - Array of precomputation_t indexed by resolution nside_level (Nside = 2**nside_level)
-*/
+/*
+Resource registry.
 
-#define MAX_NSIDE_LEVEL 15
+Resource files are memory mapped once per process and shared by all
+plans using them (resource_file_t, keyed by filename); a file is
+unmapped when the last plan using it is destroyed.
 
+Node-local copies of the matrices are shared by all plans with the same
+resource file and node layout (resource_copy_t, keyed by
+resource_layout_key). Unused copies are kept for reuse, and evicted in
+least-recently-used order whenever the total size of the copies
+exceeds the budget set by wavemoth_set_resource_cache_budget (by
+default 0, i.e., a copy is freed with the last plan using it).
 
-/*
-Precomputed
+Everything here is protected by registry_lock.
 */
-static precomputation_t precomputed_data[MAX_NSIDE_LEVEL + 1];
-
-#define MAX_RESOURCE_PATH 2048
-static char global_resource_path[MAX_RESOURCE_PATH];
+typedef struct _resource_file {
+  precomputation_t data; /* first, see wavemoth_release_resource */
+  char filename[MAX_RESOURCE_PATH];
+  int Nside;
+  struct _resource_file *next;
+} resource_file_t;
+
+typedef struct _resource_copy {
+  uint64_t key;
+  int nnodes;
+  char **arenas; /* [nnodes] */
+  size_t *arena_sizes; /* [nnodes] mapped sizes (0 for shared memory) */
+  wavemoth_shm_segment_t *shm; /* [nnodes] */
+  size_t total_size;
+  int refcount, ready;
+  uint64_t last_used;
+  struct _resource_copy *next;
+} resource_copy_t;
+
+/* FFTW planning and plan destruction are not thread-safe */
+static pthread_mutex_t fftw_planner_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static pthread_mutex_t registry_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t registry_cond = PTHREAD_COND_INITIALIZER;
+static resource_file_t *resource_files = NULL;
+static resource_copy_t *resource_copies = NULL;
+static size_t resource_cache_budget = 0, resource_cache_size = 0;
+static uint64_t registry_clock = 0;
 
 /*
 Private
@@ -131,7 +174,6 @@ void wavemoth_configure(char *resource_path) {
   configured = 1;
   strncpy(global_resource_path, resource_path, MAX_RESOURCE_PATH);
   global_resource_path[MAX_RESOURCE_PATH - 1] = '\0';
-  memset(precomputed_data, 0, sizeof(precomputed_data));
 }
 
 static void wavemoth_get_resources_filename(char *filename, size_t buflen, int Nside) {
@@ -213,6 +255,7 @@ int wavemoth_mmap_resources(char *filename, precomputation_t *data, int *out_Nsi
     Memory map buffer
    */
   data->mmapped_buffer = MAP_FAILED;
+  data->fd = -1;
   fd = open(filename, O_RDONLY);
   if (fd == -1) goto ERROR;
   if (fstat(fd, &fileinfo) == -1) goto ERROR;
@@ -220,7 +263,9 @@ int wavemoth_mmap_resources(char *filename, precomputation_t *data, int *out_Nsi
   data->mmapped_buffer = mmap(NULL, data->mmap_len, PROT_READ, MAP_SHARED,
                               fd, 0);
   if (data->mmapped_buffer == MAP_FAILED) goto ERROR;
-  close(fd);
+  /* Keep the descriptor for loading with pread; see load_matrix_data */
+  data->fd = fd;
+  posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
   fd = -1;
   head = data->mmapped_buffer;
   /* Read mmax, allocate arrays, read offsets */
@@ -232,6 +277,8 @@ int wavemoth_mmap_resources(char *filename, precomputation_t *data, int *out_Nsi
   data->lmax = lmax;
   data->mmax = mmax;
   offsets = (int64_t*)head;
+  /* The x^2 table follows the offsets */
+  data->x_squared = (double*)(offsets + 4 * (mmax + 1));
   /* Assign pointers to compressed matrices. This doesn't actually load it
      into memory, just set out pointers into virtual memory presently on
      disk. */
@@ -255,54 +302,239 @@ int wavemoth_mmap_resources(char *filename, precomputation_t *data, int *out_Nsi
  ERROR:
   retcode = -1;
   if (fd != -1) close(fd);
-  if (data->mmapped_buffer == MAP_FAILED) {
+  if (data->mmapped_buffer != MAP_FAILED) {
     munmap(data->mmapped_buffer, data->mmap_len);
-    data->mmapped_buffer = NULL;
   }
+  data->mmapped_buffer = NULL;
+  if (data->fd != -1) close(data->fd);
+  data->fd = -1;
  FINALLY:
   return retcode;
 }
 
+static precomputation_t *acquire_resource_file(char *filename, int *out_Nside) {
+  resource_file_t *entry;
+  pthread_mutex_lock(&registry_lock);
+  for (entry = resource_files; entry != NULL; entry = entry->next) {
+    if (strcmp(entry->filename, filename) == 0) break;
+  }
+  if (entry == NULL) {
+    entry = malloc(sizeof(resource_file_t));
+    if (wavemoth_mmap_resources(filename, &entry->data, &entry->Nside) != 0) {
+      free(entry);
+      pthread_mutex_unlock(&registry_lock);
+      return NULL;
+    }
+    strncpy(entry->filename, filename, MAX_RESOURCE_PATH);
+    entry->filename[MAX_RESOURCE_PATH - 1] = '\0';
+    entry->data.refcount = 0;
+    entry->next = resource_files;
+    resource_files = entry;
+  }
+  ++entry->data.refcount;
+  *out_Nside = entry->Nside;
+  pthread_mutex_unlock(&registry_lock);
+  return &entry->data;
+}
+
+/* WAVEMOTH_GENERATE_RESOURCES: compute the resource file if it is missing */
+static int generate_missing_resources(char *filename, int Nside, int lmax, int mmax,
+                                      int nthreads) {
+  wavemoth_precompute_options_t opts;
+  char dirname[MAX_RESOURCE_PATH];
+  char *slash;
+  if (access(filename, F_OK) == 0) return 0;
+  if (Nside <= 0) return -1;
+  strncpy(dirname, filename, MAX_RESOURCE_PATH);
+  dirname[MAX_RESOURCE_PATH - 1] = '\0';
+  slash = strrchr(dirname, '/');
+  if (slash != NULL && slash != dirname) {
+    *slash = '\0';
+    if (mkdir(dirname, 0755) != 0 && errno != EEXIST) return -1;
+  }
+  wavemoth_precompute_default_options(&opts, Nside);
+  opts.lmax = lmax;
+  opts.mmax = mmax;
+  opts.nthreads = nthreads;
+  fprintf(stderr, "Generating resource file %s\n", filename);
+  return wavemoth_precompute_resources(filename, &opts);
+}
+
 precomputation_t* wavemoth_fetch_resource(int Nside) {
-  int Nside_level = 0, tmp, got_Nside;
+  int got_Nside;
   char filename[MAX_RESOURCE_PATH];
+  precomputation_t *data;
 
   if (!configured) {
     return NULL;
   }
   wavemoth_get_resources_filename(filename, MAX_RESOURCE_PATH, Nside);
-  tmp = Nside;
-  while (tmp /= 2) ++Nside_level;
-  checkf(Nside_level < MAX_NSIDE_LEVEL + 1, "Nside=2**%d but maximum value is 2**%d",
-         Nside_level, MAX_NSIDE_LEVEL);
-  if (precomputed_data[Nside_level].refcount == 0) {
-    check(wavemoth_mmap_resources(filename, precomputed_data + Nside_level, &got_Nside) == 0,
-          "resource load failed");
-    checkf(Nside == got_Nside, "Loading precomputation: Expected Nside=%d but got %d in %s",           Nside, got_Nside, filename);
-  }
-  ++precomputed_data[Nside_level].refcount;
-  return &precomputed_data[Nside_level];
+  data = acquire_resource_file(filename, &got_Nside);
+  check(data != NULL, "resource load failed");
+  checkf(Nside == got_Nside, "Loading precomputation: Expected Nside=%d but got %d in %s",
+         Nside, got_Nside, filename);
+  return data;
 }
 
 void wavemoth_release_resource(precomputation_t *data) {
-  return;
-  --data->refcount;
-  if (data->refcount == 0) {
+  resource_file_t *entry = (resource_file_t*)data, **pprev;
+  pthread_mutex_lock(&registry_lock);
+  if (--data->refcount == 0) {
+    for (pprev = &resource_files; *pprev != entry; pprev = &(*pprev)->next);
+    *pprev = entry->next;
     munmap(data->mmapped_buffer, data->mmap_len);
-    data->mmapped_buffer = NULL;
+    if (data->fd != -1) close(data->fd);
     free(data->matrices);
+    free(entry);
   }
+  pthread_mutex_unlock(&registry_lock);
 }
 
-static void bitmask_or(struct bitmask *a, struct bitmask *b, struct bitmask *out) {
-  int n = numa_bitmask_nbytes(a) * 8;
-  for (int i = 0; i != n; ++i) {
-    if (numa_bitmask_isbitset(a, i) && numa_bitmask_isbitset(b, i)) {
-      numa_bitmask_setbit(out, i);
+static void free_resource_copy(resource_copy_t *copy) {
+  for (int inode = 0; inode != copy->nnodes; ++inode) {
+    if (copy->shm[inode].base != NULL) {
+      wavemoth_shm_detach(&copy->shm[inode], copy->key);
+    } else {
+      wavemoth_free_large(copy->arenas[inode], copy->arena_sizes[inode]);
+    }
+  }
+  free(copy->arenas);
+  free(copy->arena_sizes);
+  free(copy->shm);
+  free(copy);
+}
+
+/* Unlink unused copies, LRU first, until within budget. Called with
+   registry_lock held; the victims are returned to be freed after
+   unlocking (detaching shared memory may need the store lock). */
+static resource_copy_t *evict_resource_copies(size_t budget) {
+  resource_copy_t *victims = NULL;
+  while (resource_cache_size > budget) {
+    resource_copy_t **pvictim = NULL, **pprev;
+    for (pprev = &resource_copies; *pprev != NULL; pprev = &(*pprev)->next) {
+      if ((*pprev)->refcount == 0 &&
+          (pvictim == NULL || (*pprev)->last_used < (*pvictim)->last_used)) {
+        pvictim = pprev;
+      }
+    }
+    if (pvictim == NULL) break;
+    resource_copy_t *victim = *pvictim;
+    *pvictim = victim->next;
+    resource_cache_size -= victim->total_size;
+    victim->next = victims;
+    victims = victim;
+  }
+  return victims;
+}
+
+static void free_resource_copies(resource_copy_t *list) {
+  while (list != NULL) {
+    resource_copy_t *next = list->next;
+    free_resource_copy(list);
+    list = next;
+  }
+}
+
+/*
+Get the node-local copies for plan->resource_key, allocating them if
+needed. On return, fill[inode] tells whether the caller must load the
+arena of a node and then call resource_copy_ready; copies created by
+another plan are waited for until they are ready.
+
+Copies evicted to make room are returned in *victims, for the caller
+to free with free_resource_copies once it no longer holds the store
+lock of its key: detaching them takes the locks of their keys, and
+two processes evicting each other's keys would otherwise deadlock.
+*/
+static resource_copy_t *acquire_resource_copy(wavemoth_plan plan, size_t *arena_sizes,
+                                              int use_shm, int use_hugepages, int *fill,
+                                              resource_copy_t **victims) {
+  resource_copy_t *copy;
+  int nnodes = plan->nnodes;
+  pthread_mutex_lock(&registry_lock);
+  for (copy = resource_copies; copy != NULL; copy = copy->next) {
+    if (copy->key == plan->resource_key && copy->nnodes == nnodes) break;
+  }
+  if (copy != NULL) {
+    ++copy->refcount;
+    copy->last_used = ++registry_clock;
+    while (!copy->ready) pthread_cond_wait(&registry_cond, &registry_lock);
+    pthread_mutex_unlock(&registry_lock);
+    for (int inode = 0; inode != nnodes; ++inode) fill[inode] = 0;
+    *victims = NULL;
+    return copy;
+  }
+  copy = malloc(sizeof(resource_copy_t));
+  copy->key = plan->resource_key;
+  copy->nnodes = nnodes;
+  copy->arenas = malloc(sizeof(char*[nnodes]));
+  copy->arena_sizes = malloc(sizeof(size_t[nnodes]));
+  copy->shm = malloc(sizeof(wavemoth_shm_segment_t[nnodes]));
+  copy->total_size = 0;
+  copy->refcount = 1;
+  copy->ready = 1;
+  copy->last_used = ++registry_clock;
+  for (int inode = 0; inode != nnodes; ++inode) {
+    int node_id = plan->node_plans[inode]->node_id;
+    copy->shm[inode].base = NULL;
+    if (use_shm) {
+      checkf(wavemoth_shm_attach(&copy->shm[inode], copy->key, node_id,
+                                 arena_sizes[inode], use_hugepages) == 0,
+             "Could not attach shared resources %s", copy->shm[inode].name);
+      copy->arenas[inode] = copy->shm[inode].data;
+      copy->arena_sizes[inode] = 0;
+      copy->total_size += copy->shm[inode].mapped_size;
+      fill[inode] = copy->shm[inode].needs_fill;
     } else {
-      numa_bitmask_clearbit(out, i);
+      copy->arenas[inode] = wavemoth_alloc_large(arena_sizes[inode], node_id, use_hugepages,
+                                                 &copy->arena_sizes[inode]);
+      checkf(copy->arenas[inode] != NULL, "No memory allocated of size %ld on node %d",
+             arena_sizes[inode], node_id);
+      copy->total_size += copy->arena_sizes[inode];
+      fill[inode] = 1;
     }
+    if (fill[inode]) copy->ready = 0;
   }
+  copy->next = resource_copies;
+  resource_copies = copy;
+  resource_cache_size += copy->total_size;
+  *victims = evict_resource_copies(resource_cache_budget);
+  pthread_mutex_unlock(&registry_lock);
+  return copy;
+}
+
+static void resource_copy_ready(resource_copy_t *copy) {
+  pthread_mutex_lock(&registry_lock);
+  copy->ready = 1;
+  pthread_cond_broadcast(&registry_cond);
+  pthread_mutex_unlock(&registry_lock);
+}
+
+static void release_resource_copy(resource_copy_t *copy) {
+  resource_copy_t *victims;
+  pthread_mutex_lock(&registry_lock);
+  --copy->refcount;
+  copy->last_used = ++registry_clock;
+  victims = evict_resource_copies(resource_cache_budget);
+  pthread_mutex_unlock(&registry_lock);
+  free_resource_copies(victims);
+}
+
+void wavemoth_set_resource_cache_budget(size_t bytes) {
+  resource_copy_t *victims;
+  pthread_mutex_lock(&registry_lock);
+  resource_cache_budget = bytes;
+  victims = evict_resource_copies(resource_cache_budget);
+  pthread_mutex_unlock(&registry_lock);
+  free_resource_copies(victims);
+}
+
+void wavemoth_clear_resource_cache(void) {
+  resource_copy_t *victims;
+  pthread_mutex_lock(&registry_lock);
+  victims = evict_resource_copies(0);
+  pthread_mutex_unlock(&registry_lock);
+  free_resource_copies(victims);
 }
 
 typedef void (*thread_main_func_t)(wavemoth_plan, int, int, int, void*);
@@ -344,18 +576,20 @@ static int wavemoth_run_in_threads(wavemoth_plan plan, thread_main_func_t func,
   int idx = 0;
   for (int inode = 0; inode != plan->nnodes; ++inode) {
     for (int icpu = 0; icpu != plan->node_plans[inode]->ncpus; ++icpu) {
-      cpu_set_t cpu_set;
-      pthread_attr_t attr;
-      CPU_ZERO(&cpu_set);
-      CPU_SET(plan->node_plans[inode]->cpu_plans[icpu].cpu_id, &cpu_set);
-      pthread_attr_init(&attr);
-      pthread_attr_setaffinity_np(&attr, sizeof(cpu_set_t), &cpu_set);
+      wavemoth_cpu_plan_t *cpu_plan = &plan->node_plans[inode]->cpu_plans[icpu];
       for (int ithread = 0; ithread != threads_per_cpu; ++ithread) {
+        /* With WAVEMOTH_SMT, thread i runs on SMT sibling i of the core */
+        cpu_set_t cpu_set;
+        pthread_attr_t attr;
+        CPU_ZERO(&cpu_set);
+        CPU_SET(cpu_plan->sibling_ids[ithread % cpu_plan->nsiblings], &cpu_set);
+        pthread_attr_init(&attr);
+        pthread_attr_setaffinity_np(&attr, sizeof(cpu_set_t), &cpu_set);
         adaptor_ctx[idx] = (thread_ctx_t){ ctx, func, plan, inode, icpu, ithread };
         pthread_create(&threads[idx], &attr, thread_main_adaptor, &adaptor_ctx[idx]);
+        pthread_attr_destroy(&attr);
         idx++;
       }
-      pthread_attr_destroy(&attr);
     }
   }
   assert(idx == n);
@@ -367,29 +601,202 @@ static int wavemoth_run_in_threads(wavemoth_plan plan, thread_main_func_t func,
   return n;
 }
 
+/* Shared by the threads of wavemoth_create_plan_thread */
+typedef struct {
+  pthread_mutex_t mutex;
+  pthread_barrier_t *node_barriers; /* [nnodes], one thread per CPU of the node */
+} create_plan_sync_t;
+
 static void wavemoth_create_plan_thread(wavemoth_plan plan, int inode, int icpu,
                                        int ithread, void *ctx); /* forward decl */
 
 static void wait_for_execute_thread(wavemoth_plan plan, int inode, int icpu,
                                     int ithread, void *ctx);
 
-static int next_numa_node(struct bitmask *nodemask, int node_id, int nnodes) {
-  do {
-    node_id = (node_id + 1) % nnodes;
-  } while (!numa_bitmask_isbitset(nodemask, node_id));
-  return node_id;
+static void calibrate_memory_concurrency(wavemoth_plan plan); /* forward decl */
+static void measure_threads_per_cpu(wavemoth_plan plan); /* forward decl */
+
+/*
+Where the matrices of m come from: the resource file, or those
+computed at plan creation by generate_missing_matrices.
+*/
+static precomputation_t *matrix_source(wavemoth_plan plan, int m) {
+  if (plan->generated != NULL && plan->generated->matrices[m].data[0] != NULL) {
+    return plan->generated;
+  }
+  return plan->resources;
+}
+
+static int is_missing_from_resources(wavemoth_plan plan, int m) {
+  precomputation_t *res = plan->resources;
+  return (res == NULL || m > res->mmax || res->matrices[m].data[0] == NULL ||
+          res->matrices[m].data[1] == NULL);
+}
+
+static void generate_matrices_thread(wavemoth_plan plan, int inode, int icpu,
+                                     int ithread, void *ctx) {
+  wavemoth_node_plan_t *node_plan = plan->node_plans[inode];
+  m_resource_t *matrices = plan->generated->matrices;
+  for (size_t im = icpu; im < node_plan->nm; im += node_plan->ncpus) {
+    int m = node_plan->m_resources[im].m;
+    if (!is_missing_from_resources(plan, m)) continue;
+    for (int odd = 0; odd != 2; ++odd) {
+      checkf(wavemoth_precompute_uncompressed_matrix(plan->Nside, plan->lmax, m, odd,
+                                                     &matrices[m].data[odd],
+                                                     &matrices[m].len[odd]) == 0,
+             "Could not compute the matrix of m=%d, odd=%d", m, odd);
+    }
+  }
+}
+
+/*
+Compute the matrices the resource file does not have, each on the node
+that will use it. They are small (see
+wavemoth_precompute_uncompressed_matrix), and computing them costs
+about as much as a few transforms.
+*/
+static void generate_missing_matrices(wavemoth_plan plan) {
+  precomputation_t *gen;
+  int m, any = 0;
+  for (m = 0; m != plan->mmax + 1; ++m) {
+    if (is_missing_from_resources(plan, m)) any = 1;
+  }
+  if (!any) return;
+  gen = plan->generated = calloc(1, sizeof(precomputation_t));
+  check(gen != NULL, "Out of memory");
+  gen->fd = -1;
+  gen->lmax = plan->lmax;
+  gen->mmax = plan->mmax;
+  gen->refcount = 1;
+  gen->matrices = calloc(plan->mmax + 1, sizeof(m_resource_t));
+  check(gen->matrices != NULL, "Out of memory");
+  for (m = 0; m != plan->mmax + 1; ++m) gen->matrices[m].m = m;
+  wavemoth_run_in_threads(plan, &generate_matrices_thread, 1, NULL, NULL, NULL);
+}
+
+static void free_generated_matrices(precomputation_t *gen) {
+  if (gen == NULL) return;
+  for (int m = 0; m != gen->mmax + 1; ++m) {
+    free(gen->matrices[m].data[0]);
+    free(gen->matrices[m].data[1]);
+  }
+  free(gen->matrices);
+  free(gen);
+}
+
+/*
+Key of the shared resource store: identifies the resource file (header,
+matrix offsets, file size and modification time), how its matrices
+are laid out on nodes, and whether the copies use huge pages (whose
+segments may live on hugetlbfs rather than in /dev/shm).
+*/
+static uint64_t resource_layout_key(wavemoth_plan plan) {
+  precomputation_t *res = plan->resources;
+  uint64_t h = WAVEMOTH_HASH_INIT;
+  int64_t fields[5] = {RESOURCE_FORMAT_VERSION, (res == NULL) ? -1 : res->lmax,
+                       (res == NULL) ? -1 : res->mmax, plan->Nside, plan->lmax};
+  struct stat fileinfo;
+  h = wavemoth_hash_bytes(h, fields, sizeof(fields));
+  if (res != NULL && res->fd != -1 && fstat(res->fd, &fileinfo) == 0) {
+    int64_t stamp[2] = {fileinfo.st_size, fileinfo.st_mtime};
+    h = wavemoth_hash_bytes(h, stamp, sizeof(stamp));
+  }
+  for (int m = 0; m != plan->mmax + 1; ++m) {
+    precomputation_t *src = matrix_source(plan, m);
+    for (int odd = 0; odd != 2; ++odd) {
+      /* Generated matrices only depend on the fields above */
+      char *data = src->matrices[m].data[odd];
+      int64_t loc[2] = {(src != res) ? -1 : data - res->mmapped_buffer,
+                        src->matrices[m].len[odd]};
+      h = wavemoth_hash_bytes(h, loc, sizeof(loc));
+    }
+  }
+  int use_hugepages = (plan->flags & WAVEMOTH_HUGEPAGES) != 0;
+  h = wavemoth_hash_bytes(h, &use_hugepages, sizeof(int));
+  h = wavemoth_hash_bytes(h, &plan->nnodes, sizeof(int));
+  for (int inode = 0; inode != plan->nnodes; ++inode) {
+    wavemoth_node_plan_t *np = plan->node_plans[inode];
+    h = wavemoth_hash_bytes(h, &np->node_id, sizeof(int));
+    for (size_t im = 0; im != np->nm; ++im) {
+      h = wavemoth_hash_bytes(h, &np->m_resources[im].m, sizeof(size_t));
+    }
+  }
+  return h;
+}
+
+/* Allocate from the arena of node inode of the plan */
+static void *node_alloc(wavemoth_plan plan, int inode, size_t size, size_t align) {
+  void *p = wavemoth_arena_alloc(&plan->node_arenas[inode], size, align);
+  checkf(p != NULL, "Could not allocate %ld bytes on node %d", size,
+         plan->node_arenas[inode].node_id);
+  return p;
+}
+
+/* Offset and length (in doubles) of the alm of m in the input array */
+static INLINE size_t input_slab_offset(wavemoth_plan plan, size_t m) {
+  return 2 * plan->nmaps * m * (2 * plan->lmax - m + 3) / 2;
+}
+
+static INLINE size_t input_slab_len(wavemoth_plan plan, size_t m) {
+  return 2 * plan->nmaps * (plan->lmax - m + 1);
+}
+
+static int core_is_chosen(wavemoth_topology_t *topo, int *chosen, int nchosen, int i) {
+  for (int j = 0; j != nchosen; ++j) {
+    wavemoth_cpu_info_t *a = &topo->cpus[chosen[j]], *b = &topo->cpus[i];
+    if (a->core_id == b->core_id && a->node_id == b->node_id) return 1;
+  }
+  return 0;
 }
 
 wavemoth_plan wavemoth_plan_to_healpix(int Nside, int lmax, int mmax, int nmaps,
                                      int nthreads, double *input, double *output,
                                      int ordering, unsigned flags,
                                      char *resource_filename) {
-  wavemoth_plan plan = malloc(sizeof(struct _wavemoth_plan));
+  return wavemoth_plan_to_healpix_on_cpus(Nside, lmax, mmax, nmaps, nthreads, NULL,
+                                          input, output, ordering, flags, resource_filename);
+}
+
+wavemoth_plan wavemoth_plan_to_healpix_on_cpus(int Nside, int lmax, int mmax, int nmaps,
+                                              int ncpus, const int *cpu_ids,
+                                              double *input, double *output,
+                                              int ordering, unsigned flags,
+                                              char *resource_filename) {
+  return wavemoth_create_plan(Nside, lmax, mmax, nmaps, ncpus, cpu_ids, input, output,
+                              ordering, flags, resource_filename, NULL);
+}
+
+wavemoth_plan wavemoth_create_plan(int Nside, int lmax, int mmax, int nmaps,
+                                   int ncpus, const int *cpu_ids,
+                                   double *input, double *output,
+                                   int ordering, unsigned flags,
+                                   char *resource_filename,
+                                   wavemoth_plan_snapshot_t *snapshot) {
+  int nthreads = ncpus;
+  double t_plan = walltime();
+  wavemoth_plan plan;
   size_t nrings;
   int out_Nside;
   wavemoth_grid_info *grid;
   bfm_index_t start, stop;
 
+  /* Figure out how threads should be distributed. We query the
+     topology for the CPUs we can run on (process affinity, on nodes
+     in the intersection of cpubind and membind), and then fill up
+     nodes round-robin until we hit nthreads; or use the CPUs given. */
+
+  if (nthreads <= 0) {
+    fprintf(stderr, "Require nthreads > 0\n");
+    return NULL; /* TODO */
+  }
+  wavemoth_topology_t topo;
+  if (wavemoth_discover_topology(&topo, cpu_ids, (cpu_ids != NULL) ? ncpus : 0) != 0) {
+    fprintf(stderr, "CPU list contains CPUs not available to the process\n");
+    return NULL;
+  }
+
+  plan = malloc(sizeof(struct _wavemoth_plan));
+
   /* Simple attribute assignment */
   nrings = 4 * Nside - 1;
   plan->type = PLANTYPE_HEALPIX;
@@ -401,96 +808,138 @@ wavemoth_plan wavemoth_plan_to_healpix(int Nside, int lmax, int mmax, int nmaps,
   plan->lmax = lmax;
   plan->mmax = mmax;
   plan->flags = flags;
-  plan->nthreads = nthreads;
-
-  /* Figure out how threads should be distributed. We query NUMA for
-     the nodes we can run on (intersection of cpubind and membind),
-     and then fill up node-by-node until we
-     hit nthreads. */
-
-  if (nthreads <= 0) {
-    fprintf(stderr, "Require nthreads > 0\n");
-    return NULL; /* TODO */
+  plan->threads_per_cpu = (flags & WAVEMOTH_COSCHEDULE) ? COSCHEDULE_THREADS_PER_CPU : 1;
+  plan->phase_hook = NULL;
+  plan->phase_hook_ctx = NULL;
+  plan->snapshot = snapshot;
+  plan->generated = NULL;
+  memset(&plan->stats, 0, sizeof(plan->stats));
+
+  /* Choose CPUs; chosen[] indexes topo.cpus. The round-robin
+     distribution on nodes is mainly to enable/disable use of Intel
+     hyperthreading. I.e., for determining program scalability one
+     *must* use numactl or an explicit CPU list!
+
+     With WAVEMOTH_SMT, each chosen CPU is a physical core instead: The
+     SMT siblings of a chosen CPU are not used as separate CPUs, but
+     host additional Legendre workers of that core. */
+  int use_smt = (flags & WAVEMOTH_SMT) != 0;
+  int chosen[topo.ncpus + 1], nchosen = 0;
+  char used[topo.ncpus + 1];
+  memset(used, 0, sizeof(used));
+  if (cpu_ids != NULL) {
+    for (int i = 0; i != topo.ncpus; ++i) {
+      if (use_smt && core_is_chosen(&topo, chosen, nchosen, i)) continue;
+      chosen[nchosen++] = i;
+    }
+  } else {
+    /* Node ids in increasing order */
+    int avail_nodes[topo.ncpus + 1], navail = 0;
+    for (int i = 0; i != topo.ncpus; ++i) {
+      int node_id = topo.cpus[i].node_id, j;
+      for (j = 0; j != navail && avail_nodes[j] != node_id; ++j);
+      if (j == navail) avail_nodes[navail++] = node_id;
+    }
+    for (int j = 1; j < navail; ++j) {
+      for (int k = j; k > 0 && avail_nodes[k - 1] > avail_nodes[k]; --k) {
+        int tmp = avail_nodes[k];
+        avail_nodes[k] = avail_nodes[k - 1];
+        avail_nodes[k - 1] = tmp;
+      }
+    }
+    /* Round-robin; stop when a full round finds no free CPU */
+    int irr = 0, nfailed = 0;
+    while (nchosen < nthreads && nfailed < navail) {
+      int node_id = avail_nodes[irr];
+      irr = (irr + 1) % navail;
+      int i;
+      for (i = 0; i != topo.ncpus; ++i) {
+        if (!used[i] && topo.cpus[i].node_id == node_id &&
+            !(use_smt && core_is_chosen(&topo, chosen, nchosen, i))) break;
+      }
+      if (i == topo.ncpus) {
+        nfailed++;
+      } else {
+        nfailed = 0;
+        used[i] = 1;
+        chosen[nchosen++] = i;
+      }
+    }
+    checkf(nchosen == nthreads, "Requested number of CPUs (%d) not available (%d)",
+           nthreads, nchosen);
   }
-
-  /* Find intersection of cpubind and membind */
-  struct bitmask *nodemask = numa_allocate_nodemask(), *a, *b;
-  a = numa_get_run_node_mask();
-  b = numa_get_membind();
-  bitmask_or(a, b, nodemask);
-  numa_free_nodemask(a);
-  numa_free_nodemask(b);
-
-  plan->ncpus_total = 0;
-
-  struct bitmask *cpumask = numa_allocate_cpumask();
-  int icpu = 0;
-  int max_node_id = numa_max_node();
+  nthreads = plan->nthreads = plan->ncpus_total = nchosen;
+
+  /* Set up node-specific structures for the nodes we got CPUs on, in
+     order of first appearance */
+  int node_ids[nchosen], nnodes = 0;
+  for (int i = 0; i != nchosen; ++i) {
+    int node_id = topo.cpus[chosen[i]].node_id, j;
+    for (j = 0; j != nnodes && node_ids[j] != node_id; ++j);
+    if (j == nnodes) node_ids[nnodes++] = node_id;
+  }
+  plan->nnodes = nnodes;
+  plan->node_plans = malloc(sizeof(wavemoth_node_plan_t*[nnodes]));
+  plan->node_arenas = malloc(sizeof(wavemoth_arena_t[nnodes]));
   size_t nm_bound = (mmax + 1);
-  size_t inode = 0;
-
-  /* Set up node-specific structures for all available nodes */
-  inode = 0;
-  for (int node_id = 0; node_id != max_node_id + 1; ++node_id) {
-    if (numa_bitmask_isbitset(nodemask, node_id)) {
-      size_t bufsize = sizeof(wavemoth_node_plan_t) + 
-        sizeof(m_resource_t[nm_bound]) + 
-        sizeof(double*[mmax + 1]);
-      char *buf = numa_alloc_onnode(bufsize, node_id);
-      wavemoth_node_plan_t *node_plan = (void*)buf;
-      buf += sizeof(wavemoth_node_plan_t);
-      if ((size_t)buf % sizeof(void*) != 0) {
-        buf += sizeof(void*) - (size_t)buf % sizeof(void*);
+  size_t inode;
+  for (inode = 0; inode != nnodes; ++inode) {
+    int node_id = node_ids[inode];
+    wavemoth_arena_init(&plan->node_arenas[inode], node_id,
+                        (flags & WAVEMOTH_HUGEPAGES) != 0);
+    wavemoth_node_plan_t *node_plan = node_alloc(plan, inode, sizeof(wavemoth_node_plan_t),
+                                                 CACHELINE);
+    node_plan->m_resources = node_alloc(plan, inode, sizeof(m_resource_t[nm_bound]),
+                                        CACHELINE);
+
+    node_plan->node_id = node_id;
+    node_plan->ncpus = 0;
+    for (int i = 0; i != nchosen; ++i) {
+      if (topo.cpus[chosen[i]].node_id == node_id) node_plan->ncpus++;
+    }
+    node_plan->cpu_plans = node_alloc(plan, inode,
+                                      sizeof(wavemoth_cpu_plan_t[node_plan->ncpus]),
+                                      CACHELINE);
+    pthread_mutex_init(&node_plan->queue_lock, NULL);
+    plan->node_plans[inode] = node_plan;
+
+    /* CPUs, and with WAVEMOTH_SMT their usable siblings */
+    int icpu = 0;
+    for (int i = 0; i != nchosen; ++i) {
+      wavemoth_cpu_info_t *info = &topo.cpus[chosen[i]];
+      if (info->node_id != node_id) continue;
+      wavemoth_cpu_plan_t *cpu_plan = &node_plan->cpu_plans[icpu++];
+      cpu_plan->cpu_id = info->cpu_id;
+      cpu_plan->nsiblings = 1;
+      if (use_smt) {
+        for (int j = 0; j != topo.ncpus; ++j) {
+          if (j != chosen[i] && topo.cpus[j].core_id == info->core_id &&
+              topo.cpus[j].node_id == node_id) cpu_plan->nsiblings++;
+        }
+      }
+      cpu_plan->sibling_ids = node_alloc(plan, inode, sizeof(int[cpu_plan->nsiblings]),
+                                         sizeof(int));
+      cpu_plan->sibling_ids[0] = info->cpu_id;
+      for (int j = 0, k = 1; k != cpu_plan->nsiblings; ++j) {
+        if (j != chosen[i] && topo.cpus[j].core_id == info->core_id &&
+            topo.cpus[j].node_id == node_id) cpu_plan->sibling_ids[k++] = topo.cpus[j].cpu_id;
       }
-      //node_plan->m_to_phase_ring = (void*)buf;
-      buf += sizeof(double*[mmax + 1]);
-      node_plan->m_resources = (void*)buf;
-      buf += sizeof(m_resource_t[nm_bound]);
-
-      node_plan->node_id = node_id;
-      node_plan->ncpus = 0;      
-      node_plan->cpu_plans = malloc(sizeof(wavemoth_cpu_plan_t[16])); // TODO
-      sem_init(&node_plan->memory_bus_semaphore, 0, CONCURRENT_MEMORY_BUS_USE);
-      pthread_mutex_init(&node_plan->queue_lock, NULL);
-      plan->node_plans[inode] = node_plan;
-      inode++;
     }
   }
-  int nnodes = plan->nnodes = inode;
-
-  /* Distribute CPUs in round-robin fashion on available nodes. The
-     assumption is that the nodemask really does specify what nodes we
-     can use, and this equal distribution is mainly to enable/disable
-     use of Intel hyperthreading. I.e., for determining program
-     scalability one *must* use numactl! */
-  inode = 0;
-  int cpus_assigned;
-  for (cpus_assigned = 0; cpus_assigned != nthreads; ++cpus_assigned) {
-    wavemoth_node_plan_t *node_plan = plan->node_plans[inode];
-    inode = (inode + 1) % nnodes;
+  wavemoth_free_topology(&topo);
 
-    /* Walk through cpuid's and check which is next on this node */
-    int cpu_id = (node_plan->ncpus == 0) ? 0 : 
-      node_plan->cpu_plans[node_plan->ncpus - 1].cpu_id + 1;
-    if (numa_node_to_cpus(node_plan->node_id, cpumask) < 0) {
-      check(0, "numa_node_to_cpus failed");
-    }
-    for (; cpu_id < numa_bitmask_nbytes(cpumask) * 8; ++cpu_id) {
-      if (numa_bitmask_isbitset(cpumask, cpu_id)) {
-        wavemoth_cpu_plan_t *cpu_plan = &node_plan->cpu_plans[node_plan->ncpus];
-        cpu_plan->cpu_id = cpu_id;
-        node_plan->ncpus++;
-        break;
+  /* Legendre workers to allocate per CPU; how many are actually used
+     (threads_per_cpu) may be decided by measurement later. */
+  plan->max_threads_per_cpu = plan->threads_per_cpu;
+  if (use_smt) {
+    for (inode = 0; inode != nnodes; ++inode) {
+      for (int icpu = 0; icpu != plan->node_plans[inode]->ncpus; ++icpu) {
+        plan->max_threads_per_cpu = imax(plan->max_threads_per_cpu,
+                                         plan->node_plans[inode]->cpu_plans[icpu].nsiblings);
       }
     }
-    if (cpu_id == numa_bitmask_nbytes(cpumask) * 8) {
-      check(0, "Requested number of CPUs not available\n");
-    }
+    plan->threads_per_cpu = plan->max_threads_per_cpu;
   }
-  plan->ncpus_total = cpus_assigned;
-
-  numa_free_nodemask(nodemask);
-  numa_free_cpumask(cpumask);
 
 
   /* Distribute Legendre transform tasks to nodes */
@@ -506,6 +955,20 @@ wavemoth_plan wavemoth_plan_to_healpix(int Nside, int lmax, int mmax, int nmaps,
   for (int inode = 0; inode != nnodes; ++inode) {
     plan->node_plans[inode]->nm = nms[inode];
   }
+  /* Node-local staging areas for the alm of each m */
+  plan->input_replicas = NULL;
+  if (flags & WAVEMOTH_REPLICATE_INPUT) {
+    plan->input_replicas = malloc(sizeof(double*[mmax + 1]));
+    for (int inode = 0; inode != nnodes; ++inode) {
+      wavemoth_node_plan_t *np = plan->node_plans[inode];
+      for (size_t im = 0; im != np->nm; ++im) {
+        size_t m = np->m_resources[im].m;
+        plan->input_replicas[m] = node_alloc(plan, inode,
+                                             sizeof(double[input_slab_len(plan, m)]),
+                                             CACHELINE);
+      }
+    }
+  }
   /* Figure out how work should be distributed among nodes. */
   /* First allocate information buffers */
   int ring_block_size = FFT_CHUNK_SIZE;
@@ -514,8 +977,7 @@ wavemoth_plan wavemoth_plan_to_healpix(int Nside, int lmax, int mmax, int nmaps,
     for (int icpu = 0; icpu != plan->node_plans[inode]->ncpus; ++icpu) {
       wavemoth_cpu_plan_t *td = &plan->node_plans[inode]->cpu_plans[icpu];
       td->buf_size = sizeof(ring_pair_info_t[nring_bound]);
-      td->ring_pairs = numa_alloc_onnode(td->buf_size, inode);
-      check(td->ring_pairs != NULL, "Could not allocate");
+      td->ring_pairs = node_alloc(plan, inode, td->buf_size, CACHELINE);
     }
   }
   /* Distribute rings */
@@ -552,22 +1014,127 @@ wavemoth_plan wavemoth_plan_to_healpix(int Nside, int lmax, int mmax, int nmaps,
   }
 
   /* Load map of resources globally... */
-  if (resource_filename != NULL) {
+  if (snapshot != NULL) {
+    /* Resources come from the snapshot; it must have been taken with
+       the same node layout */
+    check(nnodes == snapshot->nnodes, "Plan snapshot: Different number of nodes");
+    for (inode = 0; inode != nnodes; ++inode) {
+      check(plan->node_plans[inode]->node_id == snapshot->node_ids[inode],
+            "Plan snapshot: Different node layout");
+    }
+    plan->resources = NULL;
+  } else if (flags & WAVEMOTH_ON_THE_FLY) {
+    check(Nside >= 0, "Invalid Nside");
+    plan->resources = NULL;
+  } else if (resource_filename != NULL) {
     /* Used in debugging/benchmarking */
-    plan->resources = malloc(sizeof(precomputation_t));
-    plan->did_allocate_resources = 1;
-    checkf(wavemoth_mmap_resources(resource_filename, plan->resources, &out_Nside) == 0,
-           "Error in loading resource %s", resource_filename);
+    if (flags & WAVEMOTH_GENERATE_RESOURCES) {
+      checkf(generate_missing_resources(resource_filename, Nside, lmax, mmax,
+                                        nthreads) == 0,
+             "Could not generate resource file %s", resource_filename);
+    }
+    plan->resources = acquire_resource_file(resource_filename, &out_Nside);
+    checkf(plan->resources != NULL, "Error in loading resource %s", resource_filename);
     check(Nside < 0 || out_Nside == Nside, "Incompatible Nside");
     Nside = out_Nside;
   } else {
     check(Nside >= 0, "Invalid Nside");
-    plan->did_allocate_resources = 0;
+    if ((flags & WAVEMOTH_GENERATE_RESOURCES) && configured) {
+      char filename[MAX_RESOURCE_PATH];
+      wavemoth_get_resources_filename(filename, MAX_RESOURCE_PATH, Nside);
+      checkf(generate_missing_resources(filename, Nside, lmax, mmax, nthreads) == 0,
+             "Could not generate resource file %s", filename);
+    }
     plan->resources = wavemoth_fetch_resource(Nside);
   }
-  check(mmax == plan->resources->mmax, "Incompatible mmax");
-  check(lmax == plan->resources->lmax, "Incompatible lmax");
+  /* A resource file for a larger band serves any band within it (see
+     pull_a_through_legendre_block); for m beyond its mmax, or missing
+     from it, the matrices are computed here */
+  check(mmax <= lmax, "Require mmax <= lmax");
+  if (plan->resources != NULL) {
+    check(lmax <= plan->resources->lmax, "Resource file has too small lmax");
+  }
+  if (snapshot == NULL) generate_missing_matrices(plan);
+  /* The x^2 table of the rings. Restored plans and plans without a
+     resource file compute it as the resource files are written */
+  plan->x_squared = memalign(16, sizeof(double[2 * Nside]));
+  check(plan->x_squared != NULL, "Out of memory");
+  if (plan->resources != NULL) {
+    memcpy(plan->x_squared, plan->resources->x_squared, sizeof(double[2 * Nside]));
+  } else {
+    wavemoth_precompute_ring_x_squared(Nside, plan->x_squared);
+  }
 
+  /* The node-local resource copies are one arena per node, laid out in
+     the order the matrices are traversed by legendre_transforms_thread.
+     They are shared with other plans with the same layout through the
+     resource registry, and with WAVEMOTH_SHARED_RESOURCES with other
+     processes; only if they are new do the create-plan threads fill
+     them. */
+  int use_hugepages = (flags & WAVEMOTH_HUGEPAGES) != 0;
+  int use_shm = (flags & WAVEMOTH_SHARED_RESOURCES) != 0;
+  int shm_lock = -1;
+  resource_copy_t *victims = NULL;
+  plan->resource_copy = NULL;
+  for (inode = 0; inode != nnodes; ++inode) {
+    plan->node_plans[inode]->resource_arena = NULL;
+    plan->node_plans[inode]->fill_resources = 1;
+  }
+  if (snapshot != NULL) {
+    for (inode = 0; inode != nnodes; ++inode) {
+      wavemoth_node_plan_t *np = plan->node_plans[inode];
+      np->resource_arena = snapshot->arenas[inode];
+      np->fill_resources = 0;
+      char *head = np->resource_arena;
+      for (size_t im = 0; im != np->nm; ++im) {
+        for (int odd = 0; odd != 2; ++odd) {
+          size_t len = snapshot->lens[2 * np->m_resources[im].m + odd];
+          np->m_resources[im].data[odd] = head;
+          np->m_resources[im].len[odd] = len;
+          head += round_up_size(len, RESOURCE_ALIGN);
+        }
+      }
+    }
+  } else if (!(flags & WAVEMOTH_NO_RESOURCE_COPY)) {
+    size_t arena_sizes[nnodes];
+    int fill[nnodes];
+    for (inode = 0; inode != nnodes; ++inode) {
+      wavemoth_node_plan_t *np = plan->node_plans[inode];
+      arena_sizes[inode] = 0;
+      for (size_t im = 0; im != np->nm; ++im) {
+        for (int odd = 0; odd != 2; ++odd) {
+          size_t m = np->m_resources[im].m;
+          arena_sizes[inode] += round_up_size(matrix_source(plan, m)->matrices[m].len[odd],
+                                              RESOURCE_ALIGN);
+        }
+      }
+    }
+    plan->resource_key = resource_layout_key(plan);
+    if (use_shm) {
+      shm_lock = wavemoth_shm_lock(plan->resource_key);
+      check(shm_lock != -1, "Could not lock shared resource store");
+    }
+    plan->resource_copy = acquire_resource_copy(plan, arena_sizes, use_shm, use_hugepages,
+                                                fill, &victims);
+    if (shm_lock == -1) {
+      free_resource_copies(victims);
+      victims = NULL;
+    }
+    for (inode = 0; inode != nnodes; ++inode) {
+      wavemoth_node_plan_t *np = plan->node_plans[inode];
+      np->resource_arena = plan->resource_copy->arenas[inode];
+      np->fill_resources = fill[inode];
+      char *head = np->resource_arena;
+      for (size_t im = 0; im != np->nm; ++im) {
+        for (int odd = 0; odd != 2; ++odd) {
+          size_t m = np->m_resources[im].m;
+          np->m_resources[im].data[odd] = head;
+          head += round_up_size(matrix_source(plan, m)->matrices[m].len[odd],
+                                RESOURCE_ALIGN);
+        }
+      }
+    }
+  }
 
   /* Compute stride for work_q */
   size_t nvecs = 2 * plan->nmaps;
@@ -578,21 +1145,72 @@ wavemoth_plan wavemoth_plan_to_healpix(int Nside, int lmax, int mmax, int nmaps,
   s /= sizeof(double);
   plan->work_q_stride = s;
 
+  /* With saved wisdom, planning FFTs is quick even under FFTW_MEASURE */
+  if (snapshot != NULL && snapshot->wisdom != NULL) {
+    pthread_mutex_lock(&fftw_planner_lock);
+    fftw_import_wisdom_from_string(snapshot->wisdom);
+    pthread_mutex_unlock(&fftw_planner_lock);
+  }
+
   /* Spawn threads to do thread-local intialization:
      Copy over precomputed data, initialize butterfly & FFT plans */
   
-  struct {
-    pthread_mutex_t mutex;
-    pthread_barrier_t barrier, node_barrier;
-  } sync;
+  pthread_barrier_t node_barriers[nnodes];
+  create_plan_sync_t sync = { .node_barriers = node_barriers };
   pthread_mutex_init(&sync.mutex, NULL);
-  //  pthread_barrier_init(&sync.barrier, NULL, nthreads);
-  //pthread_barrier_init(&sync.node_barrier, NULL, nnodes);
+  for (inode = 0; inode != nnodes; ++inode) {
+    /* The threads reduce-max into these (see wavemoth_create_plan_thread) */
+    plan->node_plans[inode]->k_max = plan->node_plans[inode]->nblocks_max = 0;
+    pthread_barrier_init(&node_barriers[inode], NULL, plan->node_plans[inode]->ncpus);
+  }
   wavemoth_run_in_threads(plan, &wavemoth_create_plan_thread, 1, &sync, NULL, NULL);
-  //pthread_barrier_destroy(&sync.barrier);
-  //pthread_barrier_destroy(&sync.node_barrier);
+  for (inode = 0; inode != nnodes; ++inode) {
+    pthread_barrier_destroy(&node_barriers[inode]);
+  }
   pthread_mutex_destroy(&sync.mutex);
 
+  if (plan->resource_copy != NULL) {
+    resource_copy_t *copy = plan->resource_copy;
+    for (inode = 0; inode != nnodes; ++inode) {
+      if (copy->shm[inode].base != NULL && copy->shm[inode].needs_fill) {
+        wavemoth_shm_publish(&copy->shm[inode]);
+      }
+    }
+    resource_copy_ready(copy);
+    if (shm_lock != -1) wavemoth_shm_unlock(shm_lock);
+    free_resource_copies(victims);
+  }
+
+  /* Decide how many threads per node may stream from memory concurrently */
+  if (snapshot != NULL) {
+    for (inode = 0; inode != nnodes; ++inode) {
+      plan->node_plans[inode]->mem_concurrency = snapshot->mem_concurrency[inode];
+    }
+  } else if (flags & WAVEMOTH_COSCHEDULE) {
+    if (flags & WAVEMOTH_MEASURE) {
+      calibrate_memory_concurrency(plan);
+    } else {
+      for (inode = 0; inode != nnodes; ++inode) {
+        wavemoth_node_plan_t *np = plan->node_plans[inode];
+        np->mem_concurrency = (np->ncpus + 1) / 2;
+      }
+    }
+  } else {
+    for (inode = 0; inode != nnodes; ++inode) {
+      plan->node_plans[inode]->mem_concurrency = plan->node_plans[inode]->ncpus;
+    }
+  }
+  for (inode = 0; inode != nnodes; ++inode) {
+    wavemoth_node_plan_t *np = plan->node_plans[inode];
+    sem_init(&np->memory_bus_semaphore, 0, np->mem_concurrency);
+  }
+
+  if (snapshot != NULL) {
+    plan->threads_per_cpu = imin(snapshot->threads_per_cpu, plan->max_threads_per_cpu);
+  } else if ((flags & WAVEMOTH_SMT) && (flags & WAVEMOTH_MEASURE)) {
+    measure_threads_per_cpu(plan);
+  }
+
   /* Now that work_q has been allocated, set up m_to_phase_ring */
   double **m_to_phase_ring = plan->m_to_phase_ring = malloc(sizeof(double[mmax + 1]));
   size_t work_stride = plan->work_q_stride;
@@ -603,17 +1221,96 @@ wavemoth_plan wavemoth_plan_to_healpix(int Nside, int lmax, int mmax, int nmaps,
     }
   }
 
-  thread_ctx_t adaptor_ctx[nthreads];
+  size_t nexecute_threads = nthreads * plan->threads_per_cpu;
+  thread_ctx_t adaptor_ctx[nexecute_threads];
   plan->destructing = 0;
-  plan->execute_threads = malloc(sizeof(pthread_t[nthreads]));
-  pthread_barrier_init(&plan->execute_barrier, NULL, nthreads + 1);
-  wavemoth_run_in_threads(plan, &wait_for_execute_thread, 1, NULL,
+  plan->execute_threads = malloc(sizeof(pthread_t[nexecute_threads]));
+  pthread_barrier_init(&plan->execute_barrier, NULL, nexecute_threads + 1);
+  wavemoth_run_in_threads(plan, &wait_for_execute_thread, plan->threads_per_cpu, NULL,
                          plan->execute_threads, adaptor_ctx);
   /* Wait until adaptor_ctx is no longer needed */
   pthread_barrier_wait(&plan->execute_barrier);
+  plan->stats.plan_time = walltime() - t_plan;
   return plan;
 }
 
+/* Bind the pages overlapping [start, stop) of buf to node_id. Pages
+   shared by neighbouring ranges end up on the node bound last. */
+static void bind_range(char *buf, size_t start, size_t stop, int node_id) {
+  size_t pagesize = getpagesize();
+  start = start / pagesize * pagesize;
+  stop = round_up_size(stop, pagesize);
+  if (stop > start) numa_tonode_memory(buf + start, stop - start, node_id);
+}
+
+static size_t input_size(wavemoth_plan plan) {
+  return sizeof(double[input_slab_offset(plan, plan->mmax + 1)]);
+}
+
+static size_t output_size(wavemoth_plan plan) {
+  return sizeof(double[plan->grid->npix * plan->nmaps]);
+}
+
+/* Small pages, so that placement can follow the m-slabs and rings */
+double *wavemoth_alloc_input(wavemoth_plan plan) {
+  size_t mapped_size;
+  char *buf = wavemoth_alloc_large(input_size(plan), -1, 0, &mapped_size);
+  if (buf == NULL) return NULL;
+  for (int inode = 0; inode != plan->nnodes; ++inode) {
+    wavemoth_node_plan_t *np = plan->node_plans[inode];
+    for (size_t im = 0; im != np->nm; ++im) {
+      size_t m = np->m_resources[im].m;
+      bind_range(buf, sizeof(double[input_slab_offset(plan, m)]),
+                 sizeof(double[input_slab_offset(plan, m + 1)]), np->node_id);
+    }
+  }
+  plan->input = (double*)buf;
+  return plan->input;
+}
+
+double *wavemoth_alloc_output(wavemoth_plan plan) {
+  size_t mapped_size, nmaps = plan->nmaps;
+  char *buf = wavemoth_alloc_large(output_size(plan), -1, 0, &mapped_size);
+  if (buf == NULL) return NULL;
+  for (int inode = 0; inode != plan->nnodes; ++inode) {
+    wavemoth_node_plan_t *np = plan->node_plans[inode];
+    for (int icpu = 0; icpu != np->ncpus; ++icpu) {
+      wavemoth_cpu_plan_t *cpu_plan = &np->cpu_plans[icpu];
+      for (size_t iring = 0; iring != cpu_plan->nrings; ++iring) {
+        ring_pair_info_t *ri = &cpu_plan->ring_pairs[iring];
+        bind_range(buf, sizeof(double[nmaps * ri->offset_top]),
+                   sizeof(double[nmaps * (ri->offset_top + ri->length)]), np->node_id);
+        bind_range(buf, sizeof(double[nmaps * ri->offset_bottom]),
+                   sizeof(double[nmaps * (ri->offset_bottom + ri->length)]), np->node_id);
+      }
+    }
+  }
+  plan->output = (double*)buf;
+  return plan->output;
+}
+
+void wavemoth_free_input(wavemoth_plan plan, double *input) {
+  if (plan->input == input) plan->input = NULL;
+  wavemoth_free_large(input, round_up_size(input_size(plan), getpagesize()));
+}
+
+void wavemoth_free_output(wavemoth_plan plan, double *output) {
+  if (plan->output == output) plan->output = NULL;
+  wavemoth_free_large(output, round_up_size(output_size(plan), getpagesize()));
+}
+
+void wavemoth_get_plan_stats(wavemoth_plan plan, wavemoth_plan_stats_t *stats) {
+  *stats = plan->stats;
+}
+
+char *wavemoth_export_wisdom(void) {
+  char *wisdom;
+  pthread_mutex_lock(&fftw_planner_lock);
+  wisdom = fftw_export_wisdom_to_string();
+  pthread_mutex_unlock(&fftw_planner_lock);
+  return wisdom;
+}
+
 int _dummy = 0;
 
 static void migrate_data(void *startptr, size_t len, int node) {
@@ -662,14 +1359,56 @@ static void* round_up_to(void *addr, size_t size) {
   return p;
 }
 
+/*
+Resource loading. Rather than faulting in the memory map a page at a
+time and then copying, matrices are read with pread in large chunks
+straight into their node-local destination, and posix_fadvise is used
+to start readahead of the matrices a CPU will read next. This lets
+plan creation run at disk or page cache bandwidth.
+*/
+#define LOAD_CHUNK_SIZE (8 * 1024 * 1024)
+
+static void load_matrix_data(precomputation_t *resources, char *dst, char *src,
+                             size_t len) {
+  if (resources->fd == -1) {
+    memcpy(dst, src, len);
+    return;
+  }
+  off_t offset = src - resources->mmapped_buffer;
+  while (len > 0) {
+    ssize_t n = pread(resources->fd, dst, len < LOAD_CHUNK_SIZE ? len : LOAD_CHUNK_SIZE,
+                      offset);
+    if (n == -1 && errno == EINTR) continue;
+    checkf(n > 0, "Failed to read resources: %s", (n == 0) ? "end of file" : strerror(errno));
+    dst += n;
+    offset += n;
+    len -= n;
+  }
+}
+
+static void prefetch_matrix_data(precomputation_t *resources, char *src, size_t len) {
+  if (src == NULL) return;
+  if (resources->fd != -1) {
+    posix_fadvise(resources->fd, src - resources->mmapped_buffer, len,
+                  POSIX_FADV_WILLNEED);
+  } else {
+    char *start = round_down_to(src, getpagesize());
+    madvise(start, src + len - start, MADV_WILLNEED);
+  }
+}
+
+static void fault_in(char *addr, size_t len) {
+  const size_t PAGESIZE = getpagesize();
+  char *start = round_down_to(addr, PAGESIZE);
+  madvise(start, addr + len - start, MADV_WILLNEED);
+  for (char *p = start; p < addr + len; p += PAGESIZE) {
+    _dummy += *p;
+  }
+}
+
 static void wavemoth_create_plan_thread(wavemoth_plan plan, int inode, int icpu,
                                        int ithread, void *ctx) {
-  struct {
-    pthread_mutex_t mutex;
-      //    pthread_barrier_t barrier, node_barrier;
-  } *sync = ctx;
-
-  const int PAGESIZE = getpagesize();
+  create_plan_sync_t *sync = ctx;
 
   wavemoth_node_plan_t *node_plan = plan->node_plans[inode];
   wavemoth_cpu_plan_t *cpu_plan = &node_plan->cpu_plans[icpu];
@@ -679,106 +1418,82 @@ static void wavemoth_create_plan_thread(wavemoth_plan plan, int inode, int icpu,
 
   sem_init(&cpu_plan->cpu_lock, 0, 1);
 
-  /* First, ensure that data is all faulted into memory in a nice,
-     serial order so that we don't have to wait forever for harddisk
-     seeks. However, each page should be faulted by the node that
-     wants the page in its local memory. We assume that im refers to
-     tasks in order of increasing m. */
-  size_t im = 0;
-  double t0 = walltime();
-  size_t faulted_bytes = 0;
-  if (icpu == 0) {
-    for (int m = 0; m != plan->mmax + 1; ++m) {
-      m_resource_t *m_resources_node = node_plan->m_resources;
-      while (im < nm && m_resources_node[im].m < m) ++im;
-      if (m_resources_node[im].m == m) {
-        if (m % 97 == 0) {
-          double t = walltime();
-          printf("Loading m=%d on node %d (%.1f MB/s)\n", m, node_plan->node_id,
-                 faulted_bytes / 1024.0 / 1024.0 / (t - t0));
-          faulted_bytes = 0;
-          t0 = t;
-        }
-        m_resource_t *m_resource_mmap = &plan->resources->matrices[m];
-        for (int odd = 0; odd != 2; ++odd) {
-          char *addr = m_resource_mmap->data[odd];
-          size_t size = m_resource_mmap->len[odd];
-          size_t npages = (size + PAGESIZE - 1) / PAGESIZE;
-          char vec[npages];
-
-          addr = round_down_to(addr, PAGESIZE);
-          size = (char*)round_up_to(addr + size, PAGESIZE) - addr;
-          int r = mincore(addr, size, vec);
-          checkf(r == 0, "mincore failed: %x", r);
-          for (size_t ipage = 0; ipage != npages; ++ipage) {
-            if ((vec[ipage] & 0x1) == 0) {
-              /* fault page */
-              faulted_bytes += PAGESIZE;
-              _dummy += *(addr + ipage * PAGESIZE);
-            } else {
-              /* TODO migrate page */
-            }
-          }
-        }
-      }
-      /* All nodes wait in line for harddrive access */
-      //      if (plan->nthreads > 1) pthread_barrier_wait(&sync->node_barrier);
-    }
-  }
-  //  if (plan->nthreads > 1) pthread_barrier_wait(&sync->barrier);
-
-  /* Copy matrix data into cpu_plans buffers. Stride by
-     our thread-on-node number.
+  /* Load our share of the matrix data into node-local buffers (or,
+     with WAVEMOTH_NO_RESOURCE_COPY, fault in the memory map). All
+     CPUs on all nodes load concurrently, each striding by its
+     thread-on-node number; with im referring to tasks in order of
+     increasing m, the CPUs together sweep the file front to back.
 
      While we're at it, inspect precomputed data to figure out buffer
      sizes (common for all, so synchronize/reduce-max at the end). */
   size_t k_max = 0, nblocks_max = 0;
   int do_copy = !((plan->flags & WAVEMOTH_NO_RESOURCE_COPY) == WAVEMOTH_NO_RESOURCE_COPY);
-  for (im = icpu; im < nm; im += node_plan->ncpus) {
+  int use_hugepages = (plan->flags & WAVEMOTH_HUGEPAGES) != 0;
+  size_t loaded_bytes = 0;
+  double t0 = walltime();
+  for (size_t im = icpu; im < nm; im += node_plan->ncpus) {
     m_resource_t *localres = &node_plan->m_resources[im];
-    int m = localres->m;
-    m_resource_t *fileres = &plan->resources->matrices[m];
-    for (int odd = 0; odd != 2; ++odd) {
-#if 0
-      migrate_data(fileres->data[odd], fileres->len[odd], node_plan->node_id);
-      localres->data[odd] = fileres->data[odd];
-      localres->len[odd] = fileres->len[odd];
-#else
-      if (do_copy) {
-        localres->data[odd] = memalign(4096, fileres->len[odd]);
-        localres->len[odd] = fileres->len[odd];
-        checkf(localres->data[odd] != NULL, "No memory allocated of size %ld on node %d",
-               fileres->len[odd], node_plan->node_id);
-        memcpy(localres->data[odd], fileres->data[odd], fileres->len[odd]);
-      } else {
-        localres->data[odd] = fileres->data[odd];
+    if (plan->snapshot != NULL) {
+      /* Restored by wavemoth_plan_load, which read the arena of this
+         node into memory on the node */
+      for (int odd = 0; odd != 2; ++odd) {
+        loaded_bytes += localres->len[odd];
+      }
+    } else {
+      precomputation_t *resources = matrix_source(plan, localres->m);
+      m_resource_t *fileres = &resources->matrices[localres->m];
+      int load = !do_copy || node_plan->fill_resources;
+      if (load && im + node_plan->ncpus < nm) {
+        /* Keep the disk busy with our next matrices while reading these */
+        size_t next_m = node_plan->m_resources[im + node_plan->ncpus].m;
+        precomputation_t *next_resources = matrix_source(plan, next_m);
+        if (next_resources == plan->resources) {
+          m_resource_t *nextres = &next_resources->matrices[next_m];
+          for (int odd = 0; odd != 2; ++odd) {
+            prefetch_matrix_data(next_resources, nextres->data[odd], nextres->len[odd]);
+          }
+        }
+      }
+      for (int odd = 0; odd != 2; ++odd) {
         localres->len[odd] = fileres->len[odd];
+        if (do_copy) {
+          /* localres->data points into node_plan->resource_arena */
+          if (load) {
+            load_matrix_data(resources, localres->data[odd], fileres->data[odd],
+                             fileres->len[odd]);
+          }
+        } else {
+          localres->data[odd] = fileres->data[odd];
+          fault_in(fileres->data[odd], fileres->len[odd]);
+        }
+        if (load) loaded_bytes += fileres->len[odd];
       }
-#endif
-
+    }
+    for (int odd = 0; odd != 2; ++odd) {
       bfm_matrix_data_info info;
-      bfm_query_matrix_data(localres->data[odd], &info);
+      double *auxdata;
+      char *bfm_data = wavemoth_matrix_bfm_data(localres->data[odd], &auxdata);
+      bfm_query_matrix_data(bfm_data, &info);
       k_max = zmax(k_max, info.k_max);
       nblocks_max = zmax(nblocks_max, info.nblocks_max);
+      /* Parse the butterfly once, rather than on every execute */
+      localres->schedules[odd] = bfm_compile_schedule(bfm_data);
+      checkf(localres->schedules[odd] != NULL, "Could not compile schedule of m=%d",
+             (int)localres->m);
     }
   }
+  double load_time = walltime() - t0;
 
-  /* reduce-max */
-  if (icpu == 0) {
-    /* root-cpu initializes to 0 */
-    node_plan->k_max = node_plan->nblocks_max = 0;
-  }
-
-  //  if (plan->nthreads > 1) pthread_barrier_wait(&sync->barrier);
-
-  /* all threads do max*/
+  /* reduce-max (the maxima were zeroed before the threads started) */
   pthread_mutex_lock(&sync->mutex);
   node_plan->k_max = zmax(node_plan->k_max, k_max);
   node_plan->nblocks_max = zmax(node_plan->nblocks_max,
                                 nblocks_max);
+  plan->stats.load_bytes += loaded_bytes;
+  plan->stats.load_time = fmax(plan->stats.load_time, load_time);
   pthread_mutex_unlock(&sync->mutex);
-  //  if (plan->nthreads > 1) pthread_barrier_wait(&sync->barrier);
-  /* all threads read back values */
+  /* all threads of the node read back the values once all contributed */
+  pthread_barrier_wait(&sync->node_barriers[inode]);
   k_max = node_plan->k_max;
   nblocks_max = node_plan->nblocks_max;
 
@@ -787,20 +1502,32 @@ static void wavemoth_create_plan_thread(wavemoth_plan plan, int inode, int icpu,
   size_t nvecs = 2 * plan->nmaps;
   size_t nmats = 2 * nm;
 
-  cpu_plan->legendre_workers = malloc(sizeof(wavemoth_legendre_worker_t[THREADS_PER_CPU]));
-  for (int w = 0; w != THREADS_PER_CPU; ++w) {
+  /* When coscheduling on SMT siblings, the workers of a core run
+     concurrently and only the memory bus is admission-controlled. */
+  int coschedule = (plan->flags & WAVEMOTH_COSCHEDULE) != 0;
+  int timeshare = coschedule && !(plan->flags & WAVEMOTH_SMT);
+  cpu_plan->legendre_workers = node_alloc(plan, inode, sizeof(wavemoth_legendre_worker_t[plan->max_threads_per_cpu]),
+                                          CACHELINE);
+  for (int w = 0; w != plan->max_threads_per_cpu; ++w) {
     wavemoth_legendre_worker_t *worker_plan = &cpu_plan->legendre_workers[w];
     worker_plan->bfm = bfm_create_plan(k_max, nblocks_max, 2 * nmaps,
-                                       &node_plan->memory_bus_semaphore,
-                                       &cpu_plan->cpu_lock);
+                                       coschedule ? &node_plan->memory_bus_semaphore : NULL,
+                                       timeshare ? &cpu_plan->cpu_lock : NULL,
+                                       use_hugepages ? BFM_HUGEPAGES : 0);
     worker_plan->legendre_transform_work = 
-      (legendre_work_size == 0) ? NULL : memalign(4096, legendre_work_size);
-    worker_plan->work_a_l = memalign(4096, sizeof(double[(nvecs * (plan->lmax + 1))]));
+      (legendre_work_size == 0) ? NULL : node_alloc(plan, inode, legendre_work_size, 4096);
+    worker_plan->work_a_l = node_alloc(plan, inode, sizeof(double[(nvecs * (plan->lmax + 1))]),
+                                       4096);
+    worker_plan->work_x_squared = node_alloc(plan, inode, sizeof(double[nrings_half]),
+                                             CACHELINE);
+    worker_plan->work_P1 = node_alloc(plan, inode, sizeof(double[nrings_half]), CACHELINE);
+    worker_plan->tid = 0;
   }
 
   /* Target q_m buffer (per node) */
   if (icpu == 0) {
-    node_plan->work_q = memalign(4096, sizeof(double[nmats * plan->work_q_stride]));
+    node_plan->work_q = node_alloc(plan, inode, sizeof(double[nmats * plan->work_q_stride]),
+                                   4096);
   }
 
   /* For FFTs, we use inplace c2r/r2c. This means that the buffer per
@@ -808,12 +1535,14 @@ static void wavemoth_create_plan_thread(wavemoth_plan plan, int inode, int icpu,
      coefficient: len(complex) = len(real) // 2 + 1. We allocate
      work space for FFT_CHUNK_SIZE rings in both the northern and southern
      hemisphere. */
-  cpu_plan->work_fft = memalign(4096, sizeof(double[2 * FFT_CHUNK_SIZE * nmaps * 
-                                                     (4 * plan->Nside + 2)]));
+  cpu_plan->work_fft = node_alloc(plan, inode, sizeof(double[2 * FFT_CHUNK_SIZE * nmaps * 
+                                                               (4 * plan->Nside + 2)]),
+                                  4096);
 
   /* Make FFT plans. FFTW is *not* thread-safe in the fftw_plan_X functions,
      but we *do* want to run it in each local thread, to properly benchmark
-     using local memory. So, we serialize access to FFTW. Note that the
+     using local memory. So, we serialize access to FFTW (across plans,
+     hence a global lock). Note that the
      fftw_execute_... functions *are* thread-safe (as long as used with
      different plans).
   */
@@ -821,7 +1550,7 @@ static void wavemoth_create_plan_thread(wavemoth_plan plan, int inode, int icpu,
   unsigned fftw_flags = FFTW_DESTROY_INPUT;
   fftw_flags |= (plan->flags & WAVEMOTH_MEASURE) ? FFTW_MEASURE : FFTW_ESTIMATE;
 
-  pthread_mutex_lock(&sync->mutex);
+  pthread_mutex_lock(&fftw_planner_lock);
   for (int i = 0; i != cpu_plan->nrings; ++i) {
     ring_pair_info_t *ri = &cpu_plan->ring_pairs[i];
     int ringlen = ri->length;
@@ -830,54 +1559,188 @@ static void wavemoth_create_plan_thread(wavemoth_plan plan, int inode, int icpu,
                                           cpu_plan->work_fft, NULL, nmaps, 1,
                                           fftw_flags);
   }
-  pthread_mutex_unlock(&sync->mutex);
+  pthread_mutex_unlock(&fftw_planner_lock);
 }
 
 
 void wavemoth_destroy_plan(wavemoth_plan plan) {
-  int iring;
-
   plan->destructing = 1;
   pthread_barrier_wait(&plan->execute_barrier);
-  for (int idx = 0; idx != plan->nthreads; ++idx) {
+  for (int idx = 0; idx != plan->nthreads * plan->threads_per_cpu; ++idx) {
     pthread_join(plan->execute_threads[idx], NULL);
   }
   pthread_barrier_destroy(&plan->execute_barrier);
 
+  /* FFTW3 destructor access must be serialized, like planning */
+  pthread_mutex_lock(&fftw_planner_lock);
+  for (int inode = 0; inode != plan->nnodes; ++inode) {
+    wavemoth_node_plan_t *node_plan = plan->node_plans[inode];
+    for (int icpu = 0; icpu != node_plan->ncpus; ++icpu) {
+      wavemoth_cpu_plan_t *cpu_plan = &node_plan->cpu_plans[icpu];
+      for (size_t iring = 0; iring != cpu_plan->nrings; ++iring) {
+        fftw_destroy_plan(cpu_plan->ring_pairs[iring].fft_plan);
+      }
+    }
+  }
+  pthread_mutex_unlock(&fftw_planner_lock);
 
-  /* Cleanup for all threads. Do not move to per-thread without a mutex,
-     FFTW3 destructor access must be serialized!
-   */
-  /*  for (int ithread = 0; ithread != plan->nthreads; ++ithread) {
-    wavemoth_cpu_plan_t *lp = &plan->cpu_plans[ithread];
-    for (size_t iring = 0; iring != lp->nrings; ++iring) {
-      fftw_destroy_plan(lp->ring_pairs[iring].fft_plan);
+  for (int inode = 0; inode != plan->nnodes; ++inode) {
+    wavemoth_node_plan_t *node_plan = plan->node_plans[inode];
+    for (int icpu = 0; icpu != node_plan->ncpus; ++icpu) {
+      wavemoth_cpu_plan_t *cpu_plan = &node_plan->cpu_plans[icpu];
+      for (int w = 0; w != plan->max_threads_per_cpu; ++w) {
+        bfm_destroy_plan(cpu_plan->legendre_workers[w].bfm);
+      }
+      sem_destroy(&cpu_plan->cpu_lock);
     }
-    for (size_t im = 0; im != lp->nm; ++im) {
+    sem_destroy(&node_plan->memory_bus_semaphore);
+    pthread_mutex_destroy(&node_plan->queue_lock);
+    for (size_t im = 0; im != node_plan->nm; ++im) {
       for (int odd = 0; odd != 2; ++odd) {
-        free(lp->m_resources[im].data[odd]);
+        bfm_destroy_schedule(node_plan->m_resources[im].schedules[odd]);
       }
     }
-    bfm_destroy_plan(lp->bfm);
-    free(lp->work);
-    free(lp->work_a_l);
-    free(lp->work_fft);*/
-    /* Free buffer for ring_pairs, m_resources, and m_to_phase_ring,
-       allocated by numa_alloc. */
-  //    numa_free(lp->buf, lp->buf_size);
-  //}
+  }
+
+  if (plan->resource_copy != NULL) release_resource_copy(plan->resource_copy);
+  if (plan->resources != NULL) wavemoth_release_resource(plan->resources);
+  free_generated_matrices(plan->generated);
+  free(plan->x_squared);
 
+  /* Everything else per node lives in the node arenas */
+  for (int inode = 0; inode != plan->nnodes; ++inode) {
+    wavemoth_arena_release(&plan->node_arenas[inode]);
+  }
+  if (plan->snapshot != NULL) wavemoth_free_plan_snapshot(plan->snapshot);
+  free(plan->node_arenas);
+  free(plan->node_plans);
+  free(plan->m_to_phase_ring);
+  free(plan->input_replicas);
+  free(plan->execute_threads);
   wavemoth_free_grid_info(plan->grid);
-  wavemoth_release_resource(plan->resources);
-  if (plan->did_allocate_resources) free(plan->resources);
   free(plan);
 }
 
+/*
+Calibration of the memory bus admission limit. On each node, k = 1, 2,
+... threads stream through a private buffer at the same time, and the
+limit is set to the smallest k that reaches BANDWIDTH_SATURATION of
+the best aggregate bandwidth seen on the node.
+*/
+typedef struct {
+  pthread_barrier_t *node_barriers;
+  double **thread_times, **node_bandwidths; /* indexed by inode */
+} calibrate_ctx_t;
+
+static void calibrate_memory_concurrency_thread(wavemoth_plan plan, int inode, int icpu,
+                                                int ithread, void *ctx_) {
+  calibrate_ctx_t *ctx = ctx_;
+  wavemoth_node_plan_t *node_plan = plan->node_plans[inode];
+  pthread_barrier_t *barrier = &ctx->node_barriers[inode];
+  double *times = ctx->thread_times[inode], *bandwidths = ctx->node_bandwidths[inode];
+  size_t n = CALIBRATE_BUF_SIZE / sizeof(double);
+  double *buf = memalign(4096, CALIBRATE_BUF_SIZE);
+  check(buf != NULL, "Could not allocate calibration buffer");
+  memset(buf, 0, CALIBRATE_BUF_SIZE);
+
+  for (int k = 1; k <= node_plan->ncpus; ++k) {
+    pthread_barrier_wait(barrier);
+    if (icpu < k) {
+      m128d acc = _mm_setzero_pd();
+      double t0 = walltime();
+      for (size_t i = 0; i < n; i += 2) {
+        acc = _mm_add_pd(acc, _mm_load_pd(buf + i));
+      }
+      times[icpu] = walltime() - t0;
+      _dummy += (int)((double*)&acc)[0];
+    }
+    pthread_barrier_wait(barrier);
+    if (icpu == 0) {
+      double tmax = 0;
+      for (int i = 0; i != k; ++i) tmax = fmax(tmax, times[i]);
+      bandwidths[k - 1] = k * (double)CALIBRATE_BUF_SIZE / tmax;
+    }
+  }
+  if (icpu == 0) {
+    double best = 0;
+    for (int k = 0; k != node_plan->ncpus; ++k) best = fmax(best, bandwidths[k]);
+    int k = 0;
+    while (bandwidths[k] < BANDWIDTH_SATURATION * best) ++k;
+    node_plan->mem_concurrency = k + 1;
+  }
+  free(buf);
+}
+
+static void calibrate_memory_concurrency(wavemoth_plan plan) {
+  int nnodes = plan->nnodes;
+  pthread_barrier_t node_barriers[nnodes];
+  double *thread_times[nnodes], *node_bandwidths[nnodes];
+  for (int inode = 0; inode != nnodes; ++inode) {
+    int ncpus = plan->node_plans[inode]->ncpus;
+    pthread_barrier_init(&node_barriers[inode], NULL, ncpus);
+    thread_times[inode] = malloc(sizeof(double[ncpus]));
+    node_bandwidths[inode] = malloc(sizeof(double[ncpus]));
+  }
+  calibrate_ctx_t ctx = { node_barriers, thread_times, node_bandwidths };
+  wavemoth_run_in_threads(plan, &calibrate_memory_concurrency_thread, 1, &ctx, NULL, NULL);
+  for (int inode = 0; inode != nnodes; ++inode) {
+    pthread_barrier_destroy(&node_barriers[inode]);
+    free(thread_times[inode]);
+    free(node_bandwidths[inode]);
+  }
+}
+
+/*
+Choose the number of Legendre workers per core for WAVEMOTH_SMT by
+timing the Legendre transforms with 1, 2, ... workers per core.
+*/
+static void measure_threads_per_cpu(wavemoth_plan plan) {
+  double best_time = 1e300;
+  int best = 1;
+  /* The input may not be allocated yet (wavemoth_alloc_input) */
+  double *input = plan->input;
+  if (input == NULL) {
+    plan->input = calloc(input_slab_offset(plan, plan->mmax + 1), sizeof(double));
+    check(plan->input != NULL, "Out of memory");
+  }
+  for (int w = 1; w <= plan->max_threads_per_cpu; ++w) {
+    double dt = 1e300;
+    plan->threads_per_cpu = w;
+    for (int rep = 0; rep != 2; ++rep) {
+      double t0 = walltime();
+      wavemoth_perform_legendre_transforms(plan);
+      dt = fmin(dt, walltime() - t0);
+    }
+    if (dt < best_time) {
+      best_time = dt;
+      best = w;
+    }
+  }
+  plan->threads_per_cpu = best;
+  if (input == NULL) {
+    free(plan->input);
+    plan->input = NULL;
+  }
+}
+
 int64_t wavemoth_get_legendre_flops(wavemoth_plan plan, int m, int odd) {
   int64_t N, nvecs;
   bfm_matrix_data_info info;
-  bfm_query_matrix_data(plan->resources->matrices[m].data[odd],
-                        &info);
+  double *auxdata;
+  char *data = NULL;
+  /* The node copies exist for every kind of plan (resource file,
+     generated matrices or snapshot) */
+  for (int inode = 0; inode != plan->nnodes && data == NULL; ++inode) {
+    wavemoth_node_plan_t *node_plan = plan->node_plans[inode];
+    for (size_t im = 0; im != node_plan->nm; ++im) {
+      if (node_plan->m_resources[im].m == (size_t)m) {
+        data = node_plan->m_resources[im].data[odd];
+        break;
+      }
+    }
+  }
+  if (data == NULL) return 0;
+  bfm_query_matrix_data(wavemoth_matrix_bfm_data(data, &auxdata), &info);
   N = info.element_count;
   nvecs = 2;
   N *= nvecs;
@@ -897,13 +1760,16 @@ static void legendre_transforms_thread(wavemoth_plan plan, int inode, int icpu,
   size_t work_q_stride = plan->work_q_stride;
 
   wavemoth_legendre_worker_t *thread_plan = &cpu_plan->legendre_workers[ithread];
-  assert(ithread == 0);
+  int timeshare = (plan->flags & WAVEMOTH_COSCHEDULE) && !(plan->flags & WAVEMOTH_SMT);
 
   size_t im;
   do {
-    /* First grab the CPU lock */
-    int val;
-    /*sem_wait(&cpu_plan->cpu_lock);*/
+    /* First grab the CPU lock; when coscheduling, the threads sharing
+       a CPU take turns, handing over the CPU while waiting for the
+       memory bus (see bfm_enter_mem_section). */
+    if (timeshare) {
+      while (sem_wait(&cpu_plan->cpu_lock) != 0 && errno == EINTR) {};
+    }
     /* Fetch next work item from queue */
     pthread_mutex_lock(&node_plan->queue_lock);
     im = node_plan->im;
@@ -917,16 +1783,21 @@ static void legendre_transforms_thread(wavemoth_plan plan, int inode, int icpu,
       m_resource_t *m_resource = &node_plan->m_resources[im];
       size_t m = m_resource->m;
 
-      
+      if (plan->input_replicas != NULL) {
+        memcpy(plan->input_replicas[m], plan->input + input_slab_offset(plan, m),
+               sizeof(double[input_slab_len(plan, m)]));
+      }
       for (int odd = 0; odd < 2; ++odd) {
         double *target = work_q + (2 * im + odd) * plan->work_q_stride;
         wavemoth_perform_matmul(plan, thread_plan->bfm, m_resource->data[odd],
-                               m, odd, nrings_half, target,
+                               m_resource->schedules[odd], m, odd, nrings_half, target,
                                thread_plan->legendre_transform_work,
-                               thread_plan->work_a_l);
+                               thread_plan->work_a_l,
+                               thread_plan->work_x_squared,
+                               thread_plan->work_P1);
       }
     }
-    /*sem_post(&cpu_plan->cpu_lock);*/
+    if (timeshare) sem_post(&cpu_plan->cpu_lock);
   } while (im != nm);
 }
 
@@ -936,7 +1807,7 @@ void wavemoth_perform_legendre_transforms(wavemoth_plan plan) {
     plan->node_plans[inode]->im = 0;
   }
   /* Run threads */
-  wavemoth_run_in_threads(plan, &legendre_transforms_thread, THREADS_PER_CPU, NULL,
+  wavemoth_run_in_threads(plan, &legendre_transforms_thread, plan->threads_per_cpu, NULL,
                          NULL, NULL);
 }
 
@@ -944,9 +1815,15 @@ void wavemoth_perform_legendre_transforms(wavemoth_plan plan) {
 typedef struct {
   double *input, *input_pack_buf;
   char *work;
+  bfm_plan *bfm;
+  size_t nk_plan; /* rows with l <= lmax of the plan; the input ends there */
+  double *auxdata; /* shared by the blocks of the matrix; see wavemoth_matrix_bfm_data */
+  double *x_squared, *x_squared_buf; /* table of the rings, and buffer for a strip */
+  double first_alpha, first_beta; /* see wavemoth_legendre_transform_first_step */
+  double *P1_buf; /* for strips starting at the first row of the matrix */
 } transpose_apply_ctx_t;
 
-static void pack_every_other(size_t nk, size_t nvecs, double *input, double *packed) {
+void pack_every_other(size_t nk, size_t nvecs, double *input, double *packed) {
   for (size_t k = 0; k != nk; ++k) {
     for (size_t j = 0; j != nvecs; j += 2) {
       m128d x = _mm_load_pd(input + 2 * k * nvecs + j);
@@ -955,6 +1832,31 @@ static void pack_every_other(size_t nk, size_t nvecs, double *input, double *pac
   }
 }
 
+/* buf = A^T input, for the first nk_used of the nk rows of A (col-major) */
+static void apply_dense_rows(double *input, double *input_pack_buf, double *A,
+                             double *buf, size_t nvecs, size_t ncols, size_t nk,
+                             size_t nk_used) {
+  if (nk_used == 0) {
+    memset(buf, 0, sizeof(double[ncols * nvecs]));
+    return;
+  }
+  pack_every_other(nk_used, nvecs, input, input_pack_buf);
+  dgemm('N', 'N', nvecs, ncols, nk_used, 1.0, input_pack_buf, nvecs, A, nk, 0.0,
+        buf, nvecs);
+}
+
+/*
+Rows of the resource matrices beyond the lmax of the plan (when the
+resource file was computed for a larger lmax) are cut off here: the
+recurrence of each strip stops at nk_plan, and strips and blocks
+starting beyond it only contribute zeros.
+
+The recurrence coefficients are those shared by the whole matrix, and
+x^2 is looked up in the ring table of the plan by the rings the
+payload lists (or the first of a consecutive run). Strips starting at
+the first row of the matrix only store P0; P1 is a single step of the
+recurrence from it.
+*/
 void pull_a_through_legendre_block(double *buf, size_t start, size_t stop,
                                    size_t nvecs, char *payload, size_t payload_len,
                                    void *ctx_) {
@@ -964,66 +1866,113 @@ void pull_a_through_legendre_block(double *buf, size_t start, size_t stop,
   size_t row_start = read_int64(&payload);
   size_t row_stop = read_int64(&payload);
   size_t nk = row_stop - row_start;
+  size_t nk_used = (ctx->nk_plan <= row_start) ? 0 :
+    (ctx->nk_plan >= row_stop) ? nk : ctx->nk_plan - row_start;
   input += 2 * row_start * nvecs;
   if (nk <= 4 || start == stop) {
     double *A = read_aligned_array_d(&payload, (stop - start) * nk);
-    pack_every_other(nk, nvecs, input, input_pack_buf);
-    dgemm_ccc(input_pack_buf, A, buf,
-              nvecs, stop - start, nk, 0.0);
+    bfm_enter_mem_section(ctx->bfm);
+    apply_dense_rows(input, input_pack_buf, A, buf, nvecs, stop - start, nk, nk_used);
+    bfm_exit_mem_section(ctx->bfm);
   } else {
     size_t nstrips = read_int64(&payload);
-    double *auxdata = read_aligned_array_d(&payload, 3 * (nk - 2));
+    int64_t first_col = read_int64(&payload);
+    int32_t *cols = NULL;
+    double *auxdata = ctx->auxdata + 3 * row_start;
     size_t rstart, cstart, cstop;
+    if (first_col < 0) {
+      skip128(&payload);
+      cols = (int32_t*)payload;
+      payload += sizeof(int32_t[stop - start]);
+    }
     cstart = 0;
     for (size_t i = 0; i != nstrips; ++i) {
       rstart = read_int64(&payload);
       cstop = read_int64(&payload);
       size_t nx_strip = cstop - cstart;
       size_t nk_strip = nk - rstart;
+      size_t nk_strip_used = (nk_used <= rstart) ? 0 : nk_used - rstart;
       if (nk - rstart <= 4) {
         double *A = read_aligned_array_d(&payload, nk_strip * nx_strip);
-        pack_every_other(nk_strip, nvecs, input + 2 * rstart * nvecs, input_pack_buf);
-        dgemm_ccc(input_pack_buf,
-                  A,
-                  buf + cstart * nvecs,
-                  nvecs,
-                  nx_strip,
-                  nk_strip, 0.0);
+        bfm_enter_mem_section(ctx->bfm);
+        apply_dense_rows(input + 2 * rstart * nvecs, input_pack_buf, A,
+                         buf + cstart * nvecs, nvecs, nx_strip, nk_strip, nk_strip_used);
+        bfm_exit_mem_section(ctx->bfm);
       } else {
-        double *x_squared = read_aligned_array_d(&payload, nx_strip);
+        int first_row = (row_start + rstart == 0);
         double *P0 = read_aligned_array_d(&payload, nx_strip);
-        double *P1 = read_aligned_array_d(&payload, nx_strip);
-        wavemoth_legendre_transform_pack(nk_strip, nvecs, input + 2 * rstart * nvecs,
-                                        input_pack_buf);
-        wavemoth_legendre_transform_sse(nx_strip, nk_strip, nvecs,
-                                       input_pack_buf,
-                                       buf + cstart * nvecs,
-                                       x_squared,
-                                       auxdata + 3 * rstart,
-                                       P0, P1,
-                                       ctx->work);
+        double *P1 = first_row ? ctx->P1_buf : read_aligned_array_d(&payload, nx_strip);
+        if (nk_strip_used < 2) {
+          /* Nothing to recur; at most the first row, which is P0 */
+          apply_dense_rows(input + 2 * rstart * nvecs, input_pack_buf, P0,
+                           buf + cstart * nvecs, nvecs, nx_strip, 1, nk_strip_used);
+        } else {
+          /* x^2 of the columns, gathered unless aligned in the table */
+          double *x_squared = ctx->x_squared_buf;
+          if (cols != NULL) {
+            for (size_t j = 0; j != nx_strip; ++j) {
+              x_squared[j] = ctx->x_squared[cols[cstart + j]];
+            }
+          } else if ((first_col + cstart) % 2 == 0) {
+            x_squared = ctx->x_squared + first_col + cstart;
+          } else {
+            memcpy(x_squared, ctx->x_squared + first_col + cstart, sizeof(double[nx_strip]));
+          }
+          if (first_row) {
+            for (size_t j = 0; j != nx_strip; ++j) {
+              P1[j] = (x_squared[j] + ctx->first_alpha) * ctx->first_beta * P0[j];
+            }
+          }
+          wavemoth_legendre_transform_pack(nk_strip_used, nvecs,
+                                          input + 2 * rstart * nvecs,
+                                          input_pack_buf);
+          wavemoth_legendre_transform_sse(nx_strip, nk_strip_used, nvecs,
+                                         input_pack_buf,
+                                         buf + cstart * nvecs,
+                                         x_squared,
+                                         auxdata + 3 * rstart,
+                                         P0, P1,
+                                         ctx->work);
+        }
       }
       cstart = cstop;
     }
   }
 }
 
+char *wavemoth_matrix_bfm_data(char *record, double **auxdata) {
+  char *head = record;
+  read_int64(&head); /* nk */
+  size_t bfm_offset = read_int64(&head);
+  *auxdata = (double*)head;
+  return record + bfm_offset;
+}
+
 void wavemoth_perform_matmul(wavemoth_plan plan, bfm_plan *bfm, char *matrix_data,
-                            bfm_index_t m, int odd, size_t ncols,
+                            bfm_schedule *schedule, bfm_index_t m, int odd, size_t ncols,
                             double *output, char *legendre_transform_work,
-                            double *work_a_l) {
-  bfm_index_t l, lmax = plan->lmax, j;
+                            double *work_a_l, double *work_x_squared,
+                            double *work_P1) {
+  bfm_index_t lmax = plan->lmax;
   size_t nvecs = 2 * plan->nmaps;
-  double *input_m = plan->input + nvecs * m * (2 * lmax - m + 3) / 2;
+  size_t nk_plan = (lmax < m + odd) ? 0 : (lmax - m - odd) / 2 + 1;
+  double *input_m = (plan->input_replicas != NULL) ? plan->input_replicas[m] :
+    plan->input + input_slab_offset(plan, m);
   input_m += odd * nvecs;
 
-  transpose_apply_ctx_t ctx = { input_m, work_a_l, legendre_transform_work };
-  int ret = bfm_transpose_apply_d(bfm,
-                                  matrix_data,
-                                  pull_a_through_legendre_block,
-                                  output,
-                                  ncols * nvecs,
-                                  &ctx);
+  double *auxdata;
+  char *bfm_data = wavemoth_matrix_bfm_data(matrix_data, &auxdata);
+  transpose_apply_ctx_t ctx = { input_m, work_a_l, legendre_transform_work, bfm, nk_plan,
+                                auxdata, plan->x_squared, work_x_squared, 0, 0, work_P1 };
+  wavemoth_legendre_transform_first_step(m, m + odd, &ctx.first_alpha, &ctx.first_beta);
+  int ret;
+  if (schedule != NULL) {
+    ret = bfm_transpose_apply_schedule_d(bfm, schedule, pull_a_through_legendre_block,
+                                         output, ncols * nvecs, &ctx);
+  } else {
+    ret = bfm_transpose_apply_d(bfm, bfm_data, pull_a_through_legendre_block,
+                                output, ncols * nvecs, &ctx);
+  }
   checkf(ret == 0, "bfm_transpose_apply_d retcode %d", ret);
 }
 
@@ -1249,6 +2198,12 @@ void wavemoth_disable_phase_shifting(wavemoth_plan plan) {
 
 static void wait_for_execute_thread(wavemoth_plan plan, int inode, int icpu,
                                     int ithread, void *ctx) {
+  /* Record our kernel thread id so that benchmarks can attach
+     hardware counters to us. */
+  wavemoth_cpu_plan_t *cpu_plan = &plan->node_plans[inode]->cpu_plans[icpu];
+  pid_t tid = syscall(SYS_gettid);
+  if (ithread == 0) cpu_plan->tid = tid;
+  cpu_plan->legendre_workers[ithread].tid = tid;
   /* First wait for the barrier during plan creation, so that the
      thread is created before planning returns. */
   pthread_barrier_wait(&plan->execute_barrier);
@@ -1261,7 +2216,8 @@ static void wait_for_execute_thread(wavemoth_plan plan, int inode, int icpu,
 
     pthread_barrier_wait(&plan->execute_barrier);
 
-    perform_backward_ffts_thread(plan, inode, icpu, ithread, ctx);
+    /* Extra coscheduled threads only take part in Legendre transforms */
+    if (ithread == 0) perform_backward_ffts_thread(plan, inode, icpu, ithread, ctx);
 
     pthread_barrier_wait(&plan->execute_barrier);
   }
@@ -1275,10 +2231,14 @@ void wavemoth_execute(wavemoth_plan plan) {
   }
 
   plan->times.legendre_transform_start = walltime();
+  if (plan->phase_hook) plan->phase_hook(plan, WAVEMOTH_PHASE_START, plan->phase_hook_ctx);
   pthread_barrier_wait(&plan->execute_barrier);
   pthread_barrier_wait(&plan->execute_barrier);
   plan->times.legendre_transform_done = walltime();
+  if (plan->phase_hook) plan->phase_hook(plan, WAVEMOTH_PHASE_LEGENDRE_DONE,
+                                         plan->phase_hook_ctx);
   pthread_barrier_wait(&plan->execute_barrier);
   plan->times.fft_done = walltime();
+  if (plan->phase_hook) plan->phase_hook(plan, WAVEMOTH_PHASE_FFT_DONE, plan->phase_hook_ctx);
 }
 
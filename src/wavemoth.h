@@ -1,13 +1,24 @@
 /*
-Data format of precomputed file:
+Data format of precomputed file (RESOURCE_FORMAT_VERSION 3; see its
+history in wavemoth_private.h):
 
-  int64_t max_m
-  int64_t offset[4 * (max_m + 1)]: Offsets, relative to start of file, of
-      the data. The array is indexed by "4*m" for the start of even part,
-      4*m + 1 for the end of even part, 4*m+2 and 4*m+4 for start and length
-      of odd part.
+  int64_t lmax, mmax, Nside
+  int64_t slots[4 * (mmax + 1)]: Offset, relative to start of file, and
+      length of the matrix records. Indexed by 4*m and 4*m+1 for the
+      start and length of the even part, 4*m+2 and 4*m+3 for those of
+      the odd part; offset 0 means the matrix is missing.
+  double x_squared[2 * Nside]: cos(theta)^2 of the rings from the equator
+      to the north pole, shared by all matrices.
 
-The data is a compressed butterfly matrix, as documented in butterfly.h.
+followed by the matrix records at 16-byte aligned offsets, each being
+
+  int64_t nk, int64_t offset of the butterfly matrix data in the record
+  double auxdata[3 * (nk - 2)]: recurrence coefficients of all rows
+  the compressed butterfly matrix, as documented in butterfly.h
+
+The residual blocks of the butterfly matrix refer to the shared
+auxdata and x^2 table, and strips starting at the first row leave out
+P1. See serialize_matrix_record in precompute.c.
 
 */
 
@@ -25,6 +36,45 @@ typedef struct _wavemoth_plan *wavemoth_plan;
 #define WAVEMOTH_MEASURE 0x1
 
 #define WAVEMOTH_NO_RESOURCE_COPY 0x10
+/* Run two Legendre transform threads per CPU; memory-bound parts of
+   the transform are admission-controlled per NUMA node so that
+   compute-bound parts (Legendre recurrences) of the other thread can
+   fill the CPU meanwhile. With WAVEMOTH_MEASURE, the number of
+   concurrent memory streamers per node is calibrated from measured
+   bandwidth saturation, otherwise it is half the CPUs on the node. */
+#define WAVEMOTH_COSCHEDULE 0x20
+/* Let nthreads count physical cores, and run one Legendre transform
+   worker per SMT sibling of each core. With WAVEMOTH_MEASURE, the
+   number of workers per core is chosen by timing the transforms. */
+#define WAVEMOTH_SMT 0x40
+/* Back the resource copies and large work buffers by huge pages
+   (hugetlbfs if reserved, otherwise transparent huge pages). */
+#define WAVEMOTH_HUGEPAGES 0x80
+/* Keep the node-local resource copies in shared memory segments, so
+   that processes on the same host with the same resources and node
+   layout share a single copy per node (see shmstore.h). */
+#define WAVEMOTH_SHARED_RESOURCES 0x100
+/* Copy the alm of each m to the node that transforms it at the start
+   of its work item, so that the transform reads node-local input
+   whatever the placement of the input array. Useful when the input is
+   small compared to the resources (few maps), or not allocated with
+   wavemoth_alloc_input. */
+#define WAVEMOTH_REPLICATE_INPUT 0x200
+/* If the resource file does not exist, compute it (with default
+   precomputation parameters, using the plan's CPUs; see precompute.h)
+   and write it before loading. This takes a long time for large
+   Nside. */
+#define WAVEMOTH_GENERATE_RESOURCES 0x400
+/* Use no resource file: the matrices are computed at plan creation
+   without butterfly compression (see
+   wavemoth_precompute_uncompressed_matrix), so that the transform runs
+   the full Legendre recurrence from a small table of starting values
+   per column strip, skipping the zeros below each column's first l.
+   Plan creation is quick and the memory use O(Nside * mmax), for any
+   lmax, but the transform is slower for large Nside than with a
+   resource file. Without this flag, this is also how the m missing
+   from the resource file (or all m, if there is none) are handled. */
+#define WAVEMOTH_ON_THE_FLY 0x800
 
 /*
 Driver functions. Stable API.
@@ -32,15 +82,90 @@ Driver functions. Stable API.
 
 void wavemoth_configure(char *resource_dir);
 
+/*
+Node-local copies of resources are shared by plans with the same
+resources and node layout, and kept after the last such plan is
+destroyed as long as the total size of the copies stays within this
+budget (bytes, default 0); beyond it, the least recently used unused
+copies are freed. wavemoth_clear_resource_cache frees all unused
+copies. Both are thread-safe.
+*/
+void wavemoth_set_resource_cache_budget(size_t bytes);
+void wavemoth_clear_resource_cache(void);
+
+/*
+The input holds the alm with 0 <= m <= mmax <= lmax, m-major. The
+resource file may be computed for a larger lmax and mmax than the
+plan: only the matrices of m <= mmax are loaded, and their rows beyond
+lmax are skipped, so that the time and memory used scale with the band
+of the plan.
+*/
 wavemoth_plan wavemoth_plan_to_healpix(int Nside, int lmax, int mmax, int nmaps,
                                      int nthreads,
                                      double *input, double *output,
                                      int ordering, unsigned flags,
                                      char *resource_filename);
 
+/*
+As wavemoth_plan_to_healpix, but run on exactly the ncpus CPUs listed
+in cpu_ids (one thread per CPU, or one per core with WAVEMOTH_SMT, in
+which case listed SMT siblings of a core add workers to it). Returns
+NULL if any of them is not in the affinity mask of the process.
+*/
+wavemoth_plan wavemoth_plan_to_healpix_on_cpus(int Nside, int lmax, int mmax, int nmaps,
+                                              int ncpus, const int *cpu_ids,
+                                              double *input, double *output,
+                                              int ordering, unsigned flags,
+                                              char *resource_filename);
+
 void wavemoth_destroy_plan(wavemoth_plan plan);
+
+/*
+Save a plan to the directory dirname (which must exist), so that it
+can be recreated quickly with wavemoth_plan_load: the node-local
+resource arenas are written as one page-aligned file per node, to be
+memory mapped directly, together with the CPU/node layout, measured
+parameters and FFTW wisdom. Not supported for plans made with
+WAVEMOTH_NO_RESOURCE_COPY. Returns 0 on success, -1 on error.
+
+wavemoth_plan_load must run on the same CPUs and nodes as the saved
+plan; input and output are as for wavemoth_plan_to_healpix. Returns
+NULL on error.
+*/
+int wavemoth_plan_save(wavemoth_plan plan, const char *dirname);
+wavemoth_plan wavemoth_plan_load(const char *dirname, double *input, double *output);
+
+/*
+Statistics gathered during plan creation. load_time is the wall time
+of the slowest CPU loading its share of the resources; the achieved
+load throughput is load_bytes / load_time.
+*/
+typedef struct {
+  double plan_time; /* seconds, all of plan creation */
+  double load_time; /* seconds */
+  int64_t load_bytes;
+} wavemoth_plan_stats_t;
+
+/*
+NUMA-aware input and output arrays for a plan. wavemoth_alloc_input
+places the alm of each m on the node transforming that m, and
+wavemoth_alloc_output places each ring of the map on the node of the
+CPU doing its FFT. The arrays have the layout expected by the plan,
+and are installed as the plan's input/output (which may then be NULL
+when creating the plan). They are zero-filled, and must be freed with
+wavemoth_free_input/wavemoth_free_output for the same plan. Return
+NULL on failure.
+*/
+double *wavemoth_alloc_input(wavemoth_plan plan);
+double *wavemoth_alloc_output(wavemoth_plan plan);
+void wavemoth_free_input(wavemoth_plan plan, double *input);
+void wavemoth_free_output(wavemoth_plan plan, double *output);
+
+void wavemoth_get_plan_stats(wavemoth_plan plan, wavemoth_plan_stats_t *stats);
 void wavemoth_execute(wavemoth_plan plan);
 
+/* Flops of the Legendre transform of (m, odd) with 2 vectors; 0 for
+   an m the plan does not transform */
 int64_t wavemoth_get_legendre_flops(wavemoth_plan plan, int m, int odd);
 
 int wavemoth_query_resourcefile(char *filename, int *out_Nside, int *out_lmax);
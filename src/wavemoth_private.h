@@ -10,10 +10,25 @@ The API is unstable and may change at any point.
 #define _WAVEMOTH_PRIVATE_H_
 
 #include "butterfly.h"
+#include "shmstore.h"
+#include "arena.h"
 #include "wavemoth.h"
 #include "complex.h"
+#include <sys/types.h>
 #include <fftw3.h>
 
+/*
+Every time resource format changes, we increase this, so that
+we can keep multiple resource files around and jump in git
+history. Plan snapshots (snapshot.c) record it, as their arenas hold
+the matrices in this format.
+
+  2: recurrence coefficients and x^2 of the strips shared by the
+     matrix and the file (see serialize_matrix_record in precompute.c)
+  3: P1 left out of strips starting at the first row of a matrix
+*/
+#define RESOURCE_FORMAT_VERSION 3
+
 /*
 The precomputed data, per m. Index to data/len is even=0, odd=1
 */
@@ -21,13 +36,18 @@ typedef struct {
   char *data[2];
   size_t len[2];
   size_t m;
+  /* Compiled from data at plan creation in the node plans (see
+     bfm_compile_schedule); not used elsewhere */
+  bfm_schedule *schedules[2];
 } m_resource_t;
 
 typedef struct {
   char *mmapped_buffer;
   size_t mmap_len;
+  int fd; /* kept open for pread-based loading; -1 if not available */
 
   m_resource_t *matrices;  /* indexed by m */
+  double *x_squared; /* [2 * Nside] table of the file header (unaligned), or NULL */
   int lmax, mmax;
   int refcount;
 } precomputation_t;
@@ -64,6 +84,9 @@ typedef struct {
   bfm_plan *bfm;
   char *legendre_transform_work;
   double *work_a_l;  
+  double *work_x_squared; /* [2 * Nside], x^2 of the columns of a strip */
+  double *work_P1; /* [2 * Nside], P1 of a strip starting at the first row */
+  pid_t tid; /* kernel thread id of the execute thread running this worker, or 0 */
 } wavemoth_legendre_worker_t;
 
 typedef struct {
@@ -73,6 +96,9 @@ typedef struct {
   size_t nrings;
   int threadnum_on_node;
   int cpu_id;
+  int *sibling_ids; /* CPUs for the workers; sibling_ids[0] == cpu_id */
+  int nsiblings;    /* > 1 only with WAVEMOTH_SMT */
+  pid_t tid; /* kernel thread id of the execute thread, for perf counters */
   sem_t cpu_lock;
   wavemoth_legendre_worker_t *legendre_workers;
 } wavemoth_cpu_plan_t;
@@ -82,11 +108,15 @@ typedef struct {
   double *work_q;
   size_t size_allocated;
   m_resource_t *m_resources;
+  /* Copies of the resources of this node, packed in traversal order */
+  char *resource_arena;
+  int fill_resources; /* whether this plan must load the arena */
   /* Set up a map of m -> phase ring. This is copied to all threads
      until it can be proven that sharing it for read-only access
      doesn't hurt... */
   size_t nm, im;
   sem_t memory_bus_semaphore;
+  int mem_concurrency; /* initial value of memory_bus_semaphore */
   pthread_mutex_t queue_lock;
   size_t k_max, nblocks_max;
   wavemoth_cpu_plan_t *cpu_plans;
@@ -95,13 +125,49 @@ typedef struct {
 } wavemoth_node_plan_t;
 
 
+/*
+Phase boundaries reported to the (optional) benchmarking hook, which
+is called on the thread calling wavemoth_execute.
+*/
+#define WAVEMOTH_PHASE_START 0
+#define WAVEMOTH_PHASE_LEGENDRE_DONE 1
+#define WAVEMOTH_PHASE_FFT_DONE 2
+
+typedef void (*wavemoth_phase_hook_t)(wavemoth_plan plan, int phase, void *ctx);
+
+/*
+Plan state restored by wavemoth_plan_load (snapshot.c). Given to
+wavemoth_create_plan, the node arenas are used instead of loading
+resources, and the saved measurements instead of measuring.
+*/
+typedef struct {
+  int nnodes;
+  int *node_ids; /* [nnodes] */
+  int *mem_concurrency; /* [nnodes] */
+  char **arenas; /* [nnodes] the saved node arenas, in memory of each node */
+  size_t *arena_sizes; /* [nnodes] mapped sizes (see wavemoth_alloc_large) */
+  size_t *lens; /* [2 * (mmax + 1)], length of matrix (m, odd) at 2 * m + odd */
+  int threads_per_cpu;
+  char *wisdom; /* FFTW wisdom, or NULL */
+} wavemoth_plan_snapshot_t;
+
+#define MAX_SNAPSHOT_PATH 2048
+
+void wavemoth_free_plan_snapshot(wavemoth_plan_snapshot_t *snapshot);
+
 struct _wavemoth_plan {
   double *output, *input;
   wavemoth_grid_info *grid;
   fftw_plan *fft_plans;
   precomputation_t *resources;
-  wavemoth_node_plan_t *node_plans[8];
+  /* Matrices computed at plan creation, for the m that resources lack
+     (all m with WAVEMOTH_ON_THE_FLY); NULL if none. See matrix_source */
+  precomputation_t *generated;
+  double *x_squared; /* [2 * Nside], the x^2 of the rings the residual payloads refer to */
+  wavemoth_node_plan_t **node_plans; /* [nnodes], allocated in node_arenas */
+  wavemoth_arena_t *node_arenas; /* [nnodes] */
   double **m_to_phase_ring;
+  double **input_replicas; /* [mmax + 1] or NULL; see WAVEMOTH_REPLICATE_INPUT */
 
   pthread_t *execute_threads;
   pthread_barrier_t execute_barrier;
@@ -115,19 +181,37 @@ struct _wavemoth_plan {
   int lmax, mmax;
   int nmaps;
   int nnodes, ncpus_total;
+  int threads_per_cpu; /* Legendre transform threads per CPU */
+  int max_threads_per_cpu; /* legendre_workers allocated per CPU */
 
-  int did_allocate_resources;
+  uint64_t resource_key; /* see resource_layout_key */
+  struct _resource_copy *resource_copy; /* node-local copies, from the registry */
+  wavemoth_plan_snapshot_t *snapshot; /* if created by wavemoth_plan_load */
   int Nside;
   unsigned flags;
 
   struct {
     double legendre_transform_start, legendre_transform_done, fft_done;
   } times;
+  wavemoth_plan_stats_t stats;
+
+  wavemoth_phase_hook_t phase_hook;
+  void *phase_hook_ctx;
 };
 
+/*
+The butterfly matrix data of a matrix record of the resources (see
+serialize_matrix_record in precompute.c); *auxdata is set to the
+recurrence coefficients shared by its residual blocks.
+*/
+char *wavemoth_matrix_bfm_data(char *record, double **auxdata);
+
+/* schedule may be NULL, in which case the butterfly of matrix_data is
+   interpreted as it is applied */
 void wavemoth_perform_matmul(wavemoth_plan plan, bfm_plan *bfm, char *matrix_data,
-                            bfm_index_t m, int odd, size_t ncols, double *output,
-                            char *legendre_transform_work, double *work_a_l);
+                            bfm_schedule *schedule, bfm_index_t m, int odd, size_t ncols, double *output,
+                            char *legendre_transform_work, double *work_a_l,
+                            double *work_x_squared, double *work_P1);
 void wavemoth_perform_interpolation(wavemoth_plan plan, bfm_index_t m, int odd);
 void wavemoth_perform_legendre_transforms(wavemoth_plan plan);
 
@@ -137,6 +221,21 @@ wavemoth_grid_info* wavemoth_create_healpix_grid_info(int Nside);
 void wavemoth_free_grid_info(wavemoth_grid_info *info);
 void wavemoth_disable_phase_shifting(wavemoth_plan plan);
 
+int wavemoth_mmap_resources(char *filename, precomputation_t *data, int *out_Nside);
+
+/* snapshot is NULL, except from wavemoth_plan_load; the plan takes ownership */
+wavemoth_plan wavemoth_create_plan(int Nside, int lmax, int mmax, int nmaps,
+                                   int ncpus, const int *cpu_ids,
+                                   double *input, double *output,
+                                   int ordering, unsigned flags,
+                                   char *resource_filename,
+                                   wavemoth_plan_snapshot_t *snapshot);
+/* Free with free() */
+char *wavemoth_export_wisdom(void);
+
+/* Exposed for kernelbench */
+void pack_every_other(size_t nk, size_t nvecs, double *input, double *packed);
+
 void wavemoth_execute_out_of_core(wavemoth_plan plan,
                                  double *out_compute_time,
                                  double *out_load_time);
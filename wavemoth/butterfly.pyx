@@ -11,7 +11,8 @@ cimport numpy as np
 from wavemoth cimport blas
 from .streamutils import write_int32, write_int64, pad128, write_array, write_aligned_array
 
-from interpolative_decomposition import sparse_interpolative_decomposition
+from interpolative_decomposition import (sparse_interpolative_decomposition,
+                                         randomized_sparse_interpolative_decomposition)
 from collections import namedtuple
 
 cdef extern from "semaphore.h":
@@ -39,7 +40,8 @@ cdef extern from "butterfly.h":
     ctypedef struct bfm_plan
 
     bfm_plan* bfm_create_plan(size_t k_max, size_t nblocks_max, size_t nvecs,
-                              sem_t *mem_semaphore, sem_t *cpu_semaphore)
+                              sem_t *mem_semaphore, sem_t *cpu_semaphore,
+                              unsigned flags)
     void bfm_destroy_plan(bfm_plan *plan)
 
     int bfm_transpose_apply_d(bfm_plan *plan,
@@ -48,6 +50,17 @@ cdef extern from "butterfly.h":
                               double *target,
                               size_t target_len,
                               void *caller_ctx)
+
+    ctypedef struct bfm_schedule
+
+    bfm_schedule *bfm_compile_schedule(char *matrix_data)
+    void bfm_destroy_schedule(bfm_schedule *schedule)
+    int bfm_transpose_apply_schedule_d(bfm_plan *plan,
+                                       bfm_schedule *schedule,
+                                       pull_func_t pull_func,
+                                       double *target,
+                                       size_t target_len,
+                                       void *caller_ctx)
     
     ctypedef struct bfm_matrix_data_info:
         size_t nrows, ncols
@@ -87,7 +100,7 @@ cdef class ButterflyPlan:
         sem_init(&self.mem_sem, 0, 1)
         sem_init(&self.cpu_sem, 0, 1)
         self.plan = bfm_create_plan(k_max, nblocks_max, nvecs,
-                                    &self.mem_sem, &self.cpu_sem)
+                                    &self.mem_sem, &self.cpu_sem, 0)
         self.nvecs = nvecs
 
     def __dealloc__(self):
@@ -96,9 +109,14 @@ cdef class ButterflyPlan:
         pass
         #bfm_destroy_plan(self.plan)
 
-    def transpose_apply(self, bytes matrix_data, x):
+    def transpose_apply(self, bytes matrix_data, x, compiled=False):
+        """
+        If compiled is True, the matrix is compiled to a schedule first
+        and applied with bfm_transpose_apply_schedule_d.
+        """
         cdef char *buf
         cdef bint need_realign
+        cdef bfm_schedule *schedule = NULL
 
         # Read ncols from matrix_data
         cdef bfm_matrix_data_info info
@@ -118,15 +136,26 @@ cdef class ButterflyPlan:
                 memcpy(buf, <char*>matrix_data, len(matrix_data))
             else:
                 buf = <char*>matrix_data
-            ret = bfm_transpose_apply_d(self.plan, buf,
-                                        &pull_input_callback,
-                                        <double*>self.output_array.data,
-                                        self.output_array.shape[0] * self.output_array.shape[1],
-                                        <void*>self)
+            if compiled:
+                schedule = bfm_compile_schedule(buf)
+                if schedule == NULL:
+                    raise MemoryError()
+                ret = bfm_transpose_apply_schedule_d(self.plan, schedule,
+                                                     &pull_input_callback,
+                                                     <double*>self.output_array.data,
+                                                     self.output_array.shape[0] * self.output_array.shape[1],
+                                                     <void*>self)
+            else:
+                ret = bfm_transpose_apply_d(self.plan, buf,
+                                            &pull_input_callback,
+                                            <double*>self.output_array.data,
+                                            self.output_array.shape[0] * self.output_array.shape[1],
+                                            <void*>self)
             if ret != 0:
                 raise Exception("bfm_transpose_apply_d returned %d" % ret)
         finally:
             self.input_array = self.output_array = None
+            bfm_destroy_schedule(schedule)
             if need_realign:
                 free(buf)
         return output_array
@@ -529,12 +558,18 @@ def permutations_to_filter(alst, blst):
     filter[blst] = 1
     return filter
 
-def matrix_interpolative_decomposition(A, eps):
-    iden_list, ipol_list, A_ip = sparse_interpolative_decomposition(A, eps)
+def matrix_interpolative_decomposition(A, eps, random_state=None, rank_hint=0):
+    # random_state given: use the randomized ID
+    if random_state is None:
+        iden_list, ipol_list, A_ip = sparse_interpolative_decomposition(A, eps)
+    else:
+        iden_list, ipol_list, A_ip = randomized_sparse_interpolative_decomposition(
+            A, eps, rank_hint, random_state)
     filter = permutations_to_filter(iden_list, ipol_list)
     return iden_list, InterpolationBlock(filter, A_ip)
 
-def butterfly_core(col, row, nrows, partition, matrix_provider, eps):
+def butterfly_core(col, row, nrows, partition, matrix_provider, eps,
+                   random_state=None):
     # partition: list of end-column-index of each column block;
     # partition[-1] == ncols.
     if len(partition) == 1:
@@ -547,9 +582,9 @@ def butterfly_core(col, row, nrows, partition, matrix_provider, eps):
 
     mid = len(partition) // 2
     L_k_list, L_node = butterfly_core(col, row, nrows, partition[:mid],
-                                      matrix_provider, eps)
+                                      matrix_provider, eps, random_state)
     R_k_list, R_node = butterfly_core(col + L_node.ncols, row, nrows, partition[mid:],
-                                      matrix_provider, eps)
+                                      matrix_provider, eps, random_state)
 
     # Compress further
     out_remainders = []
@@ -575,7 +610,8 @@ def butterfly_core(col, row, nrows, partition, matrix_provider, eps):
         interpolant_pair = []
         i = row_start
         for X in [T, B]:
-            relative_col_indices, interpolant = matrix_interpolative_decomposition(X, eps)
+            relative_col_indices, interpolant = matrix_interpolative_decomposition(
+                X, eps, random_state, max(L.shape[1], R.shape[1]))
             absolute_col_indices = LR_col_indices[relative_col_indices]
             interpolant_pair.append(interpolant)
             out_remainders.append(RemainderBlockInfo(row_start=i,
@@ -666,7 +702,7 @@ def as_matrix_provider(x):
         raise TypeError('Not a matrix provider instance')
 
 def butterfly_compress(matrix_provider, chunk_size, shape=None, eps=1e-10, 
-                       col=0, row=0):
+                       col=0, row=0, randomized=False):
     if isinstance(matrix_provider, np.ndarray):
         if shape is None:
             shape = matrix_provider.shape
@@ -676,7 +712,10 @@ def butterfly_compress(matrix_provider, chunk_size, shape=None, eps=1e-10,
         
     partition = make_partition(col, shape[1], chunk_size)
     partition = pad_with_empty_columns(partition)
-    residual, root = butterfly_core(col, row, shape[0], partition, matrix_provider, eps)
+    # Fixed seed, so that the result is reproducible
+    random_state = np.random.RandomState(0) if randomized else None
+    residual, root = butterfly_core(col, row, shape[0], partition, matrix_provider, eps,
+                                    random_state)
     return root
 
 def find_heap_size(node, skip_levels=0):
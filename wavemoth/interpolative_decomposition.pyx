@@ -127,3 +127,46 @@ def interpolative_decomposition(A, eps=1e-10):
     A_ip_full[:, iden_list] = np.eye(k)
     A_ip_full[:, ipol_list] = A_ip
     return A_k, A_ip_full
+
+def randomized_sparse_interpolative_decomposition(A, double eps=1e-10,
+                                                  int rank_hint=0,
+                                                  random_state=None):
+    """ Randomized variant of sparse_interpolative_decomposition.
+
+    The decomposition is computed from the sketch ``np.dot(Omega, A)``,
+    Omega having random signs, which is much cheaper for tall matrices
+    of low rank. The sketch size starts at ``rank_hint + 8`` (at least
+    32) and is grown until the rank leaves enough oversampling and
+    every residual column is within the bound of the deterministic
+    decomposition (norm below eps times the largest column of A),
+    which is checked exactly. Falls back to
+    sparse_interpolative_decomposition when the sketch would not be
+    much smaller than A. Same output; see wavemoth_sparse_id_randomized
+    in src/interpolative.h.
+    """
+    A = np.asarray(A, dtype=np.double)
+    m, n = A.shape
+    if n == 0 or m == 0:
+        return sparse_interpolative_decomposition(A, eps)
+    if random_state is None:
+        random_state = np.random.RandomState()
+    elif not isinstance(random_state, np.random.RandomState):
+        random_state = np.random.RandomState(random_state)
+    l_max = n + 8
+    l = min(max(rank_hint + 8, 32), l_max)
+    max_norm2 = np.max(np.sum(A**2, axis=0))
+    while 2 * l <= m:
+        Omega = random_state.randint(2, size=(l, m)) * 2.0 - 1
+        iden_list, ipol_list, A_ip = sparse_interpolative_decomposition(
+            np.dot(Omega, A), eps / 2)
+        k = iden_list.shape[0]
+        if k == n:
+            return iden_list, ipol_list, A_ip
+        if k + 8 <= l:
+            R = A[:, ipol_list] - np.dot(A[:, iden_list], A_ip)
+            if np.max(np.sum(R**2, axis=0)) <= eps**2 * max_norm2:
+                return iden_list, ipol_list, A_ip
+        if l == l_max:
+            break
+        l = min(max(l + l // 2, k + 16), l_max)
+    return sparse_interpolative_decomposition(A, eps)
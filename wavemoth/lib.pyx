@@ -63,6 +63,7 @@ cdef extern from "wavemoth.h":
         WAVEMOTH_MMAJOR
         WAVEMOTH_MEASURE
         WAVEMOTH_ESTIMATE
+        WAVEMOTH_ON_THE_FLY
         
 
     wavemoth_plan wavemoth_plan_to_healpix(int Nside, int lmax, int mmax,
@@ -76,9 +77,40 @@ cdef extern from "wavemoth.h":
     void wavemoth_destroy_plan(wavemoth_plan plan)
     void wavemoth_execute(wavemoth_plan plan)
     void wavemoth_configure(char *resource_dir)
+    void wavemoth_set_resource_cache_budget(size_t bytes)
+    void wavemoth_clear_resource_cache()
     void wavemoth_perform_matmul(wavemoth_plan plan, bfm_index_t m, int odd)
     void wavemoth_perform_legendre_transforms(wavemoth_plan plan)
     void wavemoth_disable_phase_shifting(wavemoth_plan plan)
+    int wavemoth_plan_save(wavemoth_plan plan, char *dirname)
+    wavemoth_plan wavemoth_plan_load(char *dirname, double *input, double *output)
+    int64_t wavemoth_get_legendre_flops(wavemoth_plan plan, int m, int odd)
+
+cdef extern from "costmodel.h":
+    ctypedef struct wavemoth_cost_model_t:
+        double ip_element, ip_row, ip_block
+        double residual_element, residual_block
+
+    int wavemoth_calibrate_cost_model(wavemoth_cost_model_t *model, size_t nvecs) nogil
+
+cdef extern from "precompute.h":
+    ctypedef struct wavemoth_precompute_options_t:
+        int Nside, lmax, mmax
+        int chunk_size
+        double eps
+        double memop_cost
+        wavemoth_cost_model_t *cost_model
+        int randomized
+        int m_stride
+        int nthreads
+        int verbose
+
+    void wavemoth_precompute_default_options(wavemoth_precompute_options_t *opts, int Nside)
+    int wavemoth_precompute_resources(char *filename,
+                                      wavemoth_precompute_options_t *opts) nogil
+    int wavemoth_precompute_regenerate(char *filename,
+                                       wavemoth_precompute_options_t *opts,
+                                       int *ms, size_t nms) nogil
 
 cdef extern from "legendre_transform.h":
     void wavemoth_legendre_transform(size_t nx, size_t nl,
@@ -103,6 +135,9 @@ cdef extern from "legendre_transform.h":
         size_t m, size_t lmin, size_t nk,
         double *auxdata)
 
+    void wavemoth_legendre_transform_first_step(
+        size_t m, size_t lmin, double *alpha, double *beta)
+
     void wavemoth_legendre_transform_pack(size_t nk, size_t nvecs, double *input,
                                          double *output)
 
@@ -119,9 +154,10 @@ cdef class ShtPlan:
                   np.ndarray[double complex, ndim=2, mode='c'] input,
                   np.ndarray[double, ndim=2, mode='c'] output,
                   ordering, phase_shifts=True, bytes matrix_data_filename=None,
-                  nthreads=1):
+                  nthreads=1, on_the_fly=False, bytes snapshot_dir=None):
         global _configured
         cdef int flags
+        cdef unsigned plan_flags = WAVEMOTH_ESTIMATE
         if ordering == 'mmajor':
             flags = WAVEMOTH_MMAJOR
         else:
@@ -133,19 +169,38 @@ cdef class ShtPlan:
         if output.shape[0] != 12 * Nside * Nside:
             raise ValueError("Output must have shape (Npix, nmaps), has %r" %
                              (<object>output).shape)
-
-        if not _configured and matrix_data_filename is None:
+        if not 0 <= mmax <= lmax:
+            raise ValueError("Require 0 <= mmax <= lmax")
+        if input.shape[0] < (mmax + 1) * (2 * lmax - mmax + 2) // 2:
+            raise ValueError("Input must have a row for each (l, m) with m <= mmax")
+
+        if on_the_fly:
+            plan_flags |= WAVEMOTH_ON_THE_FLY
+        elif (not _configured and matrix_data_filename is None and
+              snapshot_dir is None):
             wavemoth_configure(os.environ['SHTRESOURCES'])
             _configured = True
         
-        self.plan = wavemoth_plan_to_healpix(Nside, lmax, mmax, input.shape[1], nthreads,
-                                            <double*>input.data, <double*>output.data,
-                                            flags,
-                                            WAVEMOTH_ESTIMATE,
-                                            NULL if matrix_data_filename is None
-                                            else <char*>matrix_data_filename)
-        if self.plan == NULL:
-            raise Exception("Plan creation failed")
+        if snapshot_dir is not None:
+            # Restore a plan saved with save(); the other arguments must match it
+            self.plan = wavemoth_plan_load(<char*>snapshot_dir, <double*>input.data,
+                                           <double*>output.data)
+            if self.plan == NULL:
+                raise Exception("Plan loading failed")
+            if (self.plan.Nside, self.plan.lmax, self.plan.mmax, self.plan.nmaps) != (
+                Nside, lmax, mmax, input.shape[1]):
+                wavemoth_destroy_plan(self.plan)
+                self.plan = NULL
+                raise ValueError("Arguments do not match the saved plan")
+        else:
+            self.plan = wavemoth_plan_to_healpix(Nside, lmax, mmax, input.shape[1], nthreads,
+                                                <double*>input.data, <double*>output.data,
+                                                flags,
+                                                plan_flags,
+                                                NULL if matrix_data_filename is None
+                                                else <char*>matrix_data_filename)
+            if self.plan == NULL:
+                raise Exception("Plan creation failed")
         self.Nside = Nside
         self.lmax = lmax
         if not phase_shifts:
@@ -184,6 +239,14 @@ cdef class ShtPlan:
             wavemoth_execute(self.plan)
         return self.output
 
+    def save(self, bytes dirname):
+        " Save a snapshot of the plan, to be restored with snapshot_dir "
+        if wavemoth_plan_save(self.plan, <char*>dirname) != 0:
+            raise IOError("Could not save the plan to %s" % dirname)
+
+    def get_legendre_flops(self, int m, int odd):
+        return wavemoth_get_legendre_flops(self.plan, m, odd)
+
     def perform_backward_ffts(self):
         wavemoth_perform_backward_ffts(self.plan)
 
@@ -200,6 +263,67 @@ cdef class ShtPlan:
 #        wavemoth_perform_matmul(self.plan, m, odd)
 #        return out
 
+def set_resource_cache_budget(size_t nbytes):
+    """
+    Keep node-local resource copies of destroyed plans around for reuse
+    as long as they take at most nbytes in total.
+    """
+    wavemoth_set_resource_cache_budget(nbytes)
+
+def clear_resource_cache():
+    wavemoth_clear_resource_cache()
+
+def compute_resources_native(filename, int Nside, lmax=None, int chunk_size=64,
+                             double eps=1e-10, double memop_cost=20, int nthreads=0,
+                             verbose=False, randomized=False, ms=None, cost_model=None,
+                             mmax=None):
+    """
+    Write a resource file using the multithreaded C precomputation
+    engine (see precompute.h); same parameters as ResourceComputer.
+    nthreads <= 0 means all online CPUs. randomized selects the
+    faster randomized interpolative decompositions. cost_model, as
+    returned by calibrate_cost_model, replaces memop_cost. mmax
+    defaults to lmax.
+
+    An interrupted run is resumed by calling this again with the same
+    arguments. If ms is given, only the matrices for those m are
+    recomputed, and the others are copied from the existing file.
+    """
+    cdef wavemoth_precompute_options_t opts
+    cdef bytes filename_bytes = filename.encode()
+    cdef char *c_filename = filename_bytes
+    cdef np.ndarray[int, mode='c'] ms_arr
+    cdef wavemoth_cost_model_t model
+    cdef int ret
+    wavemoth_precompute_default_options(&opts, Nside)
+    if cost_model is not None:
+        model.ip_element = cost_model['ip_element']
+        model.ip_row = cost_model['ip_row']
+        model.ip_block = cost_model['ip_block']
+        model.residual_element = cost_model['residual_element']
+        model.residual_block = cost_model['residual_block']
+        opts.cost_model = &model
+    if lmax is not None:
+        opts.lmax = opts.mmax = lmax
+    if mmax is not None:
+        opts.mmax = mmax
+    opts.chunk_size = chunk_size
+    opts.eps = eps
+    opts.memop_cost = memop_cost
+    opts.nthreads = nthreads
+    opts.randomized = 1 if randomized else 0
+    opts.verbose = 1 if verbose else 0
+    if ms is None:
+        with nogil:
+            ret = wavemoth_precompute_resources(c_filename, &opts)
+    else:
+        ms_arr = np.ascontiguousarray(ms, dtype=np.intc)
+        with nogil:
+            ret = wavemoth_precompute_regenerate(c_filename, &opts, <int*>ms_arr.data,
+                                                 ms_arr.shape[0])
+    if ret != 0:
+        raise RuntimeError('Precomputation of %s failed' % filename)
+
 def _get_healpix_phi0s(Nside):
     " Expose wavemoth_create_healpix_grid_info for unit tests. "
 
@@ -288,6 +412,11 @@ def legendre_transform_auxdata(size_t m, size_t lmin, size_t nk):
         wavemoth_legendre_transform_auxdata(m, lmin, nk, <double*>out.data)
         return out
 
+def legendre_transform_first_step(size_t m, size_t lmin):
+    cdef double alpha, beta
+    wavemoth_legendre_transform_first_step(m, lmin, &alpha, &beta)
+    return alpha, beta
+
 def first_true(x):
     """ Given a 1D array of booleans x, return the first index that
         is True, or if all is False, the length of the array.
@@ -298,25 +427,34 @@ def first_true(x):
     else:
         return nz[0]
 
-def stripify(A, include_above=1e-30, exclude_below=1e-80,
-             jump_treshold=10, col_divisor=6):
+def strip_cost(nrows, ncols, call_cost=50, pack_cost=0.5):
+    """
+    Cost model of a strip in pull_a_through_legendre_block, in units of
+    the recurrence on one element (measured with nvecs=2): the
+    recurrence, a lone odd column running in both SSE lanes, packing
+    the input rows for the strip, and the call and setup of the first
+    two rows. See strip_cost in src/precompute.c.
+    """
+    return nrows * (ncols + (ncols % 2) + pack_cost) + call_cost
+
+def stripify(A, include_above=1e-30, exclude_below=1e-80, col_divisor=6,
+             call_cost=50, pack_cost=0.5):
     """
     Partitions the elements of a matrix intro strips. Strips are made
     so that elements smaller than exclude_below are excluded and
     elements larger than include_above are included.
 
-    In addition, a dumb greedy algorithm is made to try to make the
-    number of elements as small as possible, without creating too many
-    strips. Concretely, when more than `jump_treshold` rows can be
-    dropped, a new strip is created, but only so that the number of
-    columns in the resulting strip is a multiple of divisor.
+    Among such partitions, the one minimizing the sum of strip_cost
+    over the strips is found by dynamic programming; each strip starts
+    at the first row any of its columns needs, so that fewer strips
+    means more rows computed but less overhead.
 
     Assumption made: Each column is increasing "fast enough" in magnitude
     (i.e. can start on zero on top but don't decrease towards zero again,
     the bottom is included in all strips).
 
-    Column coordinates will be divisible by col_divisor on best-effort,
-    although the other constraints comes first.
+    Column coordinates will be divisible by col_divisor, except where
+    a column can not share a strip with the preceding columns.
     
     Returns
     -------
@@ -336,35 +474,53 @@ def stripify(A, include_above=1e-30, exclude_below=1e-80,
 
     # First: For each column, find the index where it is first above
     # exclude_below (=a), and then where it it is first above
-    # include_above (=b)
-    col_starts = []
+    # include_above (=b). Columns are grouped in segments, starting
+    # at every col_divisor-th column and where a column can not join
+    # the current segment, which are the candidate strip boundaries.
+    seg_start, seg_a, seg_b = [], [], []
     for col in range(M.shape[1]):
         a = first_true(M[:, col] >= exclude_below)
         b = first_true(M[:, col] >= include_above)
         if np.any(M[a:, col] < exclude_below):
             raise ValueError("Magnitude of column %d not increasing regularly "
                              "enough in magnitude" % col)
-        col_starts.append((a, b))
-
-    # Then, take a greedy approach in creating as wide strips as
-    # possible. This is not optimal for all inputs; TODO: use dynamic
-    # programming + permutations to minimize a cost function
-    inf = M.shape[0] + 1
-    max_a = -1
-    min_b = inf
-    start_col = 0
+        if (len(seg_start) == 0 or col % col_divisor == 0 or
+            a > seg_b[-1] or b < seg_a[-1]):
+            seg_start.append(col)
+            seg_a.append(a)
+            seg_b.append(b)
+        else:
+            seg_a[-1] = max(seg_a[-1], a)
+            seg_b[-1] = min(seg_b[-1], b)
+    seg_start.append(M.shape[1])
+
+    # best[j] is the cost of the columns before segment j. A strip
+    # covering segments i..j-1 starts at the min include row, and is
+    # only possible if that is not above the max exclude row.
+    cdef Py_ssize_t nrows = M.shape[0], nseg = len(seg_start) - 1, i, j, max_a, min_b
+    cdef double cost
+    best = [0.0] + [np.inf] * nseg
+    prev = [0] * (nseg + 1)
+    for j in range(1, nseg + 1):
+        max_a, min_b = -1, nrows
+        for i in range(j - 1, -1, -1):
+            max_a = max(max_a, seg_a[i])
+            min_b = min(min_b, seg_b[i])
+            if max_a > min_b:
+                break
+            cost = best[i] + strip_cost(nrows - min_b, seg_start[j] - seg_start[i],
+                                        call_cost, pack_cost)
+            if cost < best[j]:
+                best[j] = cost
+                prev[j] = i
+
     strips = []
-    col_starts.append((inf, inf)) # sentinel
-    for col, (a, b) in enumerate(col_starts):
-        new_strip_needed = (a > min_b or b < max_a)
-        new_strip_wanted = col > 0 and (b - min_b) > jump_treshold
-        if new_strip_needed or (new_strip_wanted and col % col_divisor == 0):
-            # Emit strip
-            strips.append((min_b, M.shape[0], start_col, col))
-            start_col = col
-            max_a, min_b = a, b
-        max_a = max(a, max_a)
-        min_b = min(b, min_b)
+    j = nseg
+    while j > 0:
+        i = prev[j]
+        strips.append((min(seg_b[i:j]), nrows, seg_start[i], seg_start[j]))
+        j = i
+    strips.reverse()
     return strips
 
 class NullLogger(object):
@@ -417,7 +573,7 @@ class LegendreMatrixProvider(object):
         Lambda = compute_normalized_associated_legendre(self.m, thetas, lmax,
                                                         epsilon=1e-300).T[lmin - self.m::2, :]
         strips = stripify(Lambda, include_above=1e-30, exclude_below=1e-250,
-                          jump_treshold=10, col_divisor=6)
+                          col_divisor=6)
         # Adjust row_start in order to avoid saving unecesarry aux_data
         min_rstart = 2**63
         for rstart, rstop, cstart, cstop in strips:
@@ -440,9 +596,15 @@ class LegendreMatrixProvider(object):
             return
             
         write_int64(stream, len(strips))
-        auxdata = legendre_transform_auxdata(self.m, lmin, row_stop - row_start)
-        assert auxdata.shape[0] == 3 * (row_stop - row_start - 2)
-        write_aligned_array(stream, auxdata)
+        # The recurrence coefficients are shared by the whole matrix (see
+        # ResourceComputer.compute_matrix), and x^2 is looked up by ring
+        # in the table of the file header
+        col_indices = np.asarray(col_indices)
+        if np.all(np.diff(col_indices) == 1):
+            write_int64(stream, col_indices[0])
+        else:
+            write_int64(stream, -1)
+            write_aligned_array(stream, col_indices.astype(np.int32))
 
         first = True
         for rstart, rstop, cstart, cstop in strips:
@@ -463,9 +625,14 @@ class LegendreMatrixProvider(object):
             else:
                 L0 = Lambda[rstart, cstart:cstop].copy()
                 L2 = Lambda[rstart + 1, cstart:cstop].copy()
-                write_aligned_array(stream, x_squared[cstart:cstop])
                 write_aligned_array(stream, L0)
-                write_aligned_array(stream, L2)
+                if row_start + rstart == 0:
+                    # L2 follows from L0 at the first row of the matrix, and
+                    # is computed at runtime; check with that one
+                    alpha, beta = legendre_transform_first_step(self.m, lmin)
+                    L2 = (x_squared[cstart:cstop] + alpha) * beta * L0
+                else:
+                    write_aligned_array(stream, L2)
 
                 # Check:
                 # Use the Legendre-transform implementation to compute the last row
@@ -509,14 +676,67 @@ def _compute_matrix(resource_computer, m, odd, termination_filename):
         raise
     return stream.getvalue()
 
+def memop_cost_model(memop_cost):
+    """
+    The hand-set cost model, where an interpolation matrix element
+    costs 1 and a residual element 3.5 / memop_cost. See
+    src/costmodel.h.
+    """
+    return dict(ip_element=1., ip_row=1., ip_block=0.,
+                residual_element=(5. / 2. + 1) / memop_cost, residual_block=0.)
+
+def calibrate_cost_model(size_t nvecs=2):
+    """
+    Measure the cost model on this host (takes about a second); the
+    result can be passed as cost_model to ResourceComputer and
+    compute_resources_native.
+    """
+    cdef wavemoth_cost_model_t model
+    cdef int ret
+    with nogil:
+        ret = wavemoth_calibrate_cost_model(&model, nvecs)
+    if ret != 0:
+        raise MemoryError()
+    return dict(ip_element=model.ip_element, ip_row=model.ip_row, ip_block=model.ip_block,
+                residual_element=model.residual_element,
+                residual_block=model.residual_block)
+
+def interpolation_cost(node, cost_model):
+    " Estimated time of applying the interpolation blocks of a butterfly subtree "
+    cost = sum([interpolation_cost(child, cost_model) for child in node.children])
+    for pair in getattr(node, 'blocks', ()):
+        for block in pair:
+            k, n = block.shape
+            cost += (cost_model['ip_element'] * k * (n - k) + cost_model['ip_row'] * n +
+                     cost_model['ip_block'])
+    return cost
+
 class ResourceComputer:
-    def __init__(self, Nside, lmax, mmax, chunk_size, eps, memop_cost, logger=null_logger):
+    def __init__(self, Nside, lmax, mmax, chunk_size, eps, memop_cost, logger=null_logger,
+                 randomized=False, cost_model=None):
         self.Nside, self.lmax, self.mmax, self.chunk_size, self.eps, self.memop_cost, self.logger = (
             Nside, lmax, mmax, chunk_size, eps, memop_cost, logger)
-        assert lmax == mmax, 'Other cases not tested yet'
+        self.randomized = randomized
+        if cost_model is None:
+            cost_model = memop_cost_model(memop_cost)
+        self.cost_model = cost_model
+        assert mmax <= lmax
 
     def residual_cost(self, m, n):
-        return m * n * (5. / 2. + 1) / self.memop_cost
+        return m * n * self.cost_model['residual_element'] + self.cost_model['residual_block']
+
+    def level_cost(self, tree, level):
+        " Estimated time of applying tree with level levels of compression "
+        if tree.nrows == 0 or tree.ncols == 0:
+            return 0
+        elif level == 0:
+            return self.residual_cost(tree.nrows, tree.ncols)
+        cost = 0
+        for node in tree.get_nodes_at_level(tree.get_max_depth() - level):
+            cost += interpolation_cost(node, self.cost_model)
+            cost += sum([self.residual_cost(stop - start, len(cols))
+                         for start, stop, cols in node.remainder_blocks])
+        return cost
 
     def compute_matrix(self, stream, m, odd):
         """
@@ -527,18 +747,30 @@ class ResourceComputer:
         provider = LegendreMatrixProvider(m, odd, self.Nside)
         nk = (self.lmax - m - odd) // 2 + 1
         tree = butterfly_compress(provider, shape=(nk, provider.ncols_full_matrix),
-                                  chunk_size=self.chunk_size, eps=self.eps)
-        # Drop levels of compression until residual size is 70% or more
+                                  chunk_size=self.chunk_size, eps=self.eps,
+                                  randomized=self.randomized)
+        # Drop levels of compression where the residual is cheaper
         depth = tree.get_max_depth()
         costs = np.zeros(depth + 1)
         for level in range(depth + 1):
-            total, ip, res = tree.get_stats(level, self.residual_cost)
-            costs[level] = ip + res
+            costs[level] = self.level_cost(tree, level)
         best_level = costs.argmin()
         self.logger.info('Computed m=%d of %d, level=%d: %s' % (m, self.lmax, best_level,
                                                                 tree.format_stats(
                                                                     best_level)))
-        # Serialize the butterfly tree to the stream
+        # The matrix record: recurrence coefficients of all rows, which the
+        # residual blocks share, followed by the butterfly tree
+        start_pos = stream.tell()
+        write_int64(stream, nk)
+        offset_pos = stream.tell()
+        write_int64(stream, 0)
+        if nk > 2:
+            write_aligned_array(stream, legendre_transform_auxdata(m, m + odd, nk))
+        pad128(stream)
+        bfm_pos = stream.tell()
+        stream.seek(offset_pos)
+        write_int64(stream, bfm_pos - start_pos)
+        stream.seek(bfm_pos)
         serialize_butterfly_matrix(tree, provider, num_levels=best_level, stream=stream)
         return stream
 
@@ -558,6 +790,7 @@ class ResourceComputer:
         header_pos = stream.tell()
         for i in range(4 * (self.mmax + 1)):
             write_int64(stream, 0)
+        write_array(stream, np.cos(get_ring_thetas(self.Nside, positive_only=True))**2)
 
         import tempfile
         fd, termination_filename = tempfile.mkstemp()
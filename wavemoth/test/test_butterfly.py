@@ -374,19 +374,20 @@ def test_transpose_apply_c():
     A = (i * j).astype(np.double)
     A_compressed = butterfly_compress(A, chunk_size=3)
 
-    def test(num_levels):
+    def test(num_levels, compiled):
         stream = BytesIO() # ensure that matrix data can be embedded in larger stream
         stream.write('a' * 160)
         matrix_data = serialize_butterfly_matrix(A_compressed, A, stream=stream,
                                                  num_levels=num_levels).getvalue()
         matrix_data = matrix_data[160:]
         x = ndrange((20, 2))
-        y = plan.transpose_apply(matrix_data, x)
+        y = plan.transpose_apply(matrix_data, x, compiled=compiled)
         assert_almost_equal(np.dot(A.T, x), y)
 
-    yield test, 1
-    yield test, 2
-    yield test, 200
+    for compiled in [False, True]:
+        yield test, 1, compiled
+        yield test, 2, compiled
+        yield test, 200, compiled
 
 
 #
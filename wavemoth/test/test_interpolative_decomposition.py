@@ -87,3 +87,24 @@ def test_lssolve():
     S = lssolve(A, np.arange(5)[selection])
     assert_almost_equal(np.dot(A[:, selection], S), A[:, ~selection])
 
+
+def test_randomized():
+    # Tall, numerically low-rank matrix; the sketch is much smaller than A
+    x, y = np.ogrid[0:1:2000j, 0:1:60j]
+    A = np.exp(-(x - y)**2)
+    A[:, 7] = 0
+    eps = 1e-10
+    # Bound of the deterministic decomposition: every residual column
+    # below eps times the largest column of A
+    bound = eps * np.sqrt(np.max(np.sum(A**2, axis=0)))
+    def max_residual(iden_list, ipol_list, A_ip):
+        R = A[:, ipol_list] - np.dot(A[:, iden_list], A_ip)
+        return np.sqrt(np.max(np.sum(R**2, axis=0)))
+    ok_(max_residual(*sparse_interpolative_decomposition(A, eps)) <= bound)
+    for seed in range(4):
+        iden_list, ipol_list, A_ip = randomized_sparse_interpolative_decomposition(
+            A, eps, random_state=seed)
+        yield eq_, sorted(list(iden_list)), list(iden_list)
+        yield eq_, sorted(list(iden_list) + list(ipol_list)), range(A.shape[1])
+        yield ok_, len(iden_list) < 40
+        yield ok_, max_residual(iden_list, ipol_list, A_ip) <= bound
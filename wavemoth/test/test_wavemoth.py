@@ -49,10 +49,22 @@ def make_matrix_data(Nside, lmax, chunk_size=4, eps=1e-10, memop_cost=1):
         ResourceComputer(Nside, lmax, lmax, chunk_size, eps, memop_cost).compute(f, max_workers=1)
     return matrix_data_filename
 
-def make_plan(nmaps, Nside=Nside, lmax=None, **kw):
+def make_matrix_data_native(Nside, lmax, chunk_size=4, eps=1e-10, memop_cost=1):
+    fd, matrix_data_filename = mkstemp()
+    os.close(fd)
+    matrix_data_filenames.append(matrix_data_filename) # schedule cleanup
+    matrix_data_filenames.append(matrix_data_filename + '.journal')
+    lib.compute_resources_native(matrix_data_filename, Nside, lmax, chunk_size, eps,
+                                 memop_cost, nthreads=2)
+    return matrix_data_filename
+
+def make_plan(nmaps, Nside=Nside, lmax=None, native=False, **kw):
     if lmax is None:
         lmax = 2 * Nside
-    matrix_data_filename = make_matrix_data(Nside, lmax)
+    if native:
+        matrix_data_filename = make_matrix_data_native(Nside, lmax)
+    else:
+        matrix_data_filename = make_matrix_data(Nside, lmax)
 
     input = np.zeros((((lmax + 1) * (lmax + 2)) // 2, nmaps), dtype=np.complex128)
     output = np.zeros((12*Nside**2, nmaps))
@@ -62,8 +74,8 @@ def make_plan(nmaps, Nside=Nside, lmax=None, **kw):
 
     return plan
 
-def assert_basic(nmaps, nthreads=1):
-    plan = make_plan(nmaps, nthreads=nthreads)
+def assert_basic(nmaps, nthreads=1, native=False):
+    plan = make_plan(nmaps, nthreads=nthreads, native=native)
 
     plan.input[0, :] = 10
     plan.input[lm_to_idx_mmajor(1, 0), :] = np.arange(nmaps) * 30
@@ -89,6 +101,160 @@ def test_basic():
     yield assert_basic, 8
     yield assert_basic, 8, 3
 
+def test_basic_native_resources():
+    "Resources computed by the C precomputation engine"
+    yield assert_basic, 1, 1, True
+    yield assert_basic, 6, 3, True
+
+def test_regenerate_native_resources():
+    "Recompute some m of a resource file; the others are copied"
+    def read_matrices(filename):
+        data = np.fromfile(filename, dtype=np.byte)
+        header = data[:8 * (3 + 4 * (lmax + 1))].view(np.int64)[3:]
+        return [data[header[2 * i]:header[2 * i] + header[2 * i + 1]].tostring()
+                for i in range(2 * (lmax + 1))]
+
+    filename = make_matrix_data_native(Nside, lmax)
+    before = read_matrices(filename)
+    # Damage the end of the matrices of m=0 and m=3, so that copying
+    # them rather than recomputing them shows
+    data = np.fromfile(filename, dtype=np.byte)
+    header = data[:8 * (3 + 4 * (lmax + 1))].view(np.int64)[3:]
+    for m in (0, 3):
+        for odd in range(2):
+            i = 2 * (2 * m + odd)
+            data[header[i] + header[i + 1] - 8:header[i] + header[i + 1]] ^= 0x55
+    data.tofile(filename)
+    damaged = read_matrices(filename)
+
+    lib.compute_resources_native(filename, Nside, lmax, 4, 1e-10, 1, nthreads=2,
+                                 ms=[0, 3])
+    after = read_matrices(filename)
+    for m in range(lmax + 1):
+        for odd in range(2):
+            eq_(before[2 * m + odd], after[2 * m + odd])
+            if m in (0, 3):
+                assert damaged[2 * m + odd] != after[2 * m + odd]
+
+def test_regenerate_old_format():
+    "Regenerating from a file of another format is refused"
+    filename = make_matrix_data_native(Nside, lmax)
+    with file(filename + '.journal') as f:
+        lines = f.readlines()
+    fields = lines[0].split(' ')
+    fields[1] = str(int(fields[1]) - 1) # the journal version
+    lines[0] = ' '.join(fields)
+    with file(filename + '.journal', 'w') as f:
+        f.writelines(lines)
+    assert_raises(RuntimeError, lib.compute_resources_native, filename, Nside, lmax,
+                  4, 1e-10, 1, nthreads=2, ms=[0])
+
+def test_band_limited():
+    "Plans for a smaller lmax or mmax than the resource file"
+    filename = make_matrix_data(Nside, lmax)
+    random_state = np.random.RandomState(0)
+    for plan_lmax, plan_mmax in [(lmax, 3), (6, 6), (5, 2), (lmax, 0)]:
+        nfull = (plan_lmax + 1) * (plan_lmax + 2) // 2
+        n = (plan_mmax + 1) * (2 * plan_lmax - plan_mmax + 2) // 2
+        alm = np.zeros((nfull, 2), dtype=np.complex128)
+        alm[:n] = random_state.normal(size=(n, 2)) + 1j * random_state.normal(size=(n, 2))
+        alm[:plan_lmax + 1].imag = 0 # m = 0
+        output = np.zeros((12 * Nside**2, 2))
+        plan = ShtPlan(Nside, plan_lmax, plan_mmax, alm[:n].copy(), output, 'mmajor',
+                       matrix_data_filename=filename)
+        y = psht.alm2map_mmajor(alm, lmax=plan_lmax, Nside=Nside)
+        assert_almost_equal(y, plan.execute())
+
+def test_on_the_fly():
+    "Plans without a resource file, and with one lacking some m"
+    fd, filename = mkstemp()
+    os.close(fd)
+    matrix_data_filenames.extend([filename, filename + '.journal'])
+    lib.compute_resources_native(filename, Nside, lmax, 4, 1e-10, 1, nthreads=2, mmax=3)
+    random_state = np.random.RandomState(1)
+    for kw in [dict(on_the_fly=True), dict(matrix_data_filename=filename)]:
+        nfull = (lmax + 1) * (lmax + 2) // 2
+        alm = random_state.normal(size=(nfull, 2)) + 1j * random_state.normal(size=(nfull, 2))
+        alm[:lmax + 1].imag = 0 # m = 0
+        output = np.zeros((12 * Nside**2, 2))
+        plan = ShtPlan(Nside, lmax, lmax, alm, output, 'mmajor', **kw)
+        y = psht.alm2map_mmajor(alm, lmax=lmax, Nside=Nside)
+        assert_almost_equal(y, plan.execute())
+
+def test_snapshot():
+    "Plans saved and loaded again transform and report flops as the original"
+    from tempfile import mkdtemp
+    import shutil
+    filename = make_matrix_data_native(Nside, lmax)
+    random_state = np.random.RandomState(2)
+    nfull = (lmax + 1) * (lmax + 2) // 2
+    alm = random_state.normal(size=(nfull, 2)) + 1j * random_state.normal(size=(nfull, 2))
+    alm[:lmax + 1].imag = 0 # m = 0
+    y = psht.alm2map_mmajor(alm, lmax=lmax, Nside=Nside)
+    for kw in [dict(matrix_data_filename=filename), dict(on_the_fly=True)]:
+        output = np.zeros((12 * Nside**2, 2))
+        plan = ShtPlan(Nside, lmax, lmax, alm, output, 'mmajor', nthreads=2, **kw)
+        dirname = mkdtemp()
+        try:
+            plan.save(dirname)
+            loaded_output = np.zeros((12 * Nside**2, 2))
+            loaded = ShtPlan(Nside, lmax, lmax, alm, loaded_output, 'mmajor',
+                             snapshot_dir=dirname)
+        finally:
+            shutil.rmtree(dirname)
+        flops = [plan.get_legendre_flops(m, odd) for m in range(lmax + 1) for odd in range(2)]
+        ok_(sum(flops) > 0)
+        eq_(flops, [loaded.get_legendre_flops(m, odd)
+                    for m in range(lmax + 1) for odd in range(2)])
+        assert_almost_equal(y, plan.execute())
+        assert_almost_equal(y, loaded.execute())
+        del loaded
+
+def read_levels(filename):
+    "The number of compression levels kept for each matrix of a resource file"
+    data = np.fromfile(filename, dtype=np.byte)
+    header = data[:8 * (3 + 4 * (lmax + 1))].view(np.int64)[3:]
+    levels = []
+    for i in range(2 * (lmax + 1)):
+        start = header[2 * i]
+        bfm = start + data[start + 8:start + 16].view(np.int64)[0]
+        root_count, heap_size = data[bfm + 24:bfm + 32].view(np.int32)
+        # The forest of root_count trees below the kept levels fills a heap
+        # of 2**(depth + 1) - root_count nodes
+        levels.append(int(np.log2((heap_size + root_count) // root_count)) - 1)
+    return levels
+
+def test_calibrate_cost_model():
+    "Both precomputation engines choose the levels the cost model favours"
+    model = lib.calibrate_cost_model()
+    for key in ['ip_element', 'ip_row', 'ip_block', 'residual_element', 'residual_block']:
+        ok_(model[key] >= 0)
+    ok_(model['ip_element'] > 0 and model['residual_element'] > 0)
+
+    def compute_levels(model):
+        fd, filename = mkstemp()
+        os.close(fd)
+        matrix_data_filenames.extend([filename, filename + '.journal'])
+        lib.compute_resources_native(filename, Nside, lmax, 4, 1e-10, 1, nthreads=2,
+                                     cost_model=model)
+        native_levels = read_levels(filename)
+        with file(filename, 'w') as f:
+            ResourceComputer(Nside, lmax, lmax, 4, 1e-10, 1, cost_model=model).compute(f)
+        return native_levels, read_levels(filename)
+
+    # Expensive residual elements favour compression, cheap ones none
+    heavy = dict(model, residual_element=1e6 * model['ip_element'])
+    light = dict(model, residual_element=1e-6 * model['ip_element'])
+    heavy_native, heavy_python = compute_levels(heavy)
+    light_native, light_python = compute_levels(light)
+    eq_(heavy_native, heavy_python)
+    eq_(light_native, light_python)
+    ok_(max(heavy_native) > 0)
+    eq_(light_native, [0] * len(light_native))
+    # The measured model makes the same choice in both engines
+    native_levels, python_levels = compute_levels(model)
+    eq_(native_levels, python_levels)
+
 def do_deterministic(nthreads):
     def hash_array(x):
         h = hashlib.md5()
@@ -175,6 +341,11 @@ def test_stripify():
     A += 1
     A[:, 2] = 0
     yield eq_, [(0, 2, 0, 2), (2, 2, 2, 3)], stripify(A)
+    # Splitting pays off when enough rows are saved, given the per-strip cost
+    A = np.ones((100, 12))
+    A[:50, 6:] = 1e-40
+    yield eq_, [(0, 100, 0, 6), (50, 100, 6, 12)], stripify(A)
+    yield eq_, [(0, 100, 0, 12)], stripify(A, call_cost=1000)
     
 def test_stripify_legendre():
     def test(Nside, m):